@@ -0,0 +1,147 @@
+#ifndef __ANIMATION_H__
+#define __ANIMATION_H__
+
+#include <vector>
+#include <cstdio>
+#include "Render.h"
+#include "Pipeline.h"
+#include "Output.h"
+#include "CameraPath.h"
+#include "Thread.h"
+#include "Timer.h"
+
+// Renders every pose of a camera path, several frames at once, and presents
+// them in order.  Each of `concurrent` lanes has its own ThreadedRenderer
+// and buffer, and renders every concurrent'th frame; so frames are rendered
+// in parallel as well as their tiles, and a frame of deep portals holds up
+// only its own lane until its turn to be presented.
+class AnimationRenderer {
+    struct Lane {
+        const AnimationRenderer* owner;
+        int index;
+        RenderInfo info;
+        ThreadedRenderer* renderer;
+        FrameSlot slot;
+        TraceStats stats;
+        long rays;
+        Semaphore free;         // the slot may be rendered into
+        Semaphore ready;        // the slot holds the next frame
+        Semaphore exited;
+
+        Lane() : free(1) { }
+    };
+
+    RenderInfo base;
+    const std::vector<CameraPose>* poses;
+    int concurrent, threads, tile_size;
+    TraceStats stats;
+    long rays;
+    double render_seconds;
+
+    static int lane_thread(void* data) {
+        Lane* lane = (Lane*)data;
+        const AnimationRenderer* self = lane->owner;
+        const std::vector<CameraPose>& poses = *self->poses;
+        for (size_t i = lane->index; i < poses.size(); i += self->concurrent) {
+            lane->free.wait();
+            lane->info.world = poses[i].world;
+            lane->info.eye = poses[i].eye;
+            lane->info.frame = poses[i].frame;
+            double start = wall_seconds();
+            lane->renderer->render(lane->slot.buffer);
+            lane->slot.seconds = wall_seconds() - start;
+            lane->stats = lane->renderer->trace_stats();
+            lane->rays = lane->renderer->primary_rays();
+            lane->ready.post();
+        }
+        lane->exited.post();
+        return 0;
+    }
+
+    AnimationRenderer(const AnimationRenderer&);
+    AnimationRenderer& operator= (const AnimationRenderer&);
+public:
+    // Frames are rendered with `info`'s settings, `concurrent` at a time,
+    // each with `threads` threads.
+    AnimationRenderer(const RenderInfo& info, const std::vector<CameraPose>& poses, int concurrent, int threads,
+                      int tile_size = 32)
+        : base(info), poses(&poses), concurrent(concurrent), threads(threads), tile_size(tile_size),
+          rays(0), render_seconds(0)
+    { }
+
+    // Renders the path and presents each frame to `sink` in order.
+    void run(PresentSink* sink) {
+        std::vector<Lane*> lanes;
+        for (int i = 0; i < concurrent; i++) {
+            Lane* lane = new Lane;
+            lane->owner = this;
+            lane->index = i;
+            lane->info = base;
+            lane->renderer = new ThreadedRenderer(&lane->info, threads, tile_size);
+            lane->slot.buffer.pixels = new unsigned char [base.bpp*base.width*base.height];
+            lane->slot.width = base.width;
+            lane->slot.height = base.height;
+            lane->slot.bpp = base.bpp;
+            lane->slot.region = Tile(0, 0, base.width, base.height);
+            lane->slot.show = true;
+            lanes.push_back(lane);
+            spawn_thread(lane_thread, lane);
+        }
+        stats.clear();
+        rays = 0;
+        render_seconds = 0;
+        for (size_t i = 0; i < poses->size(); i++) {
+            Lane* lane = lanes[i % concurrent];
+            lane->ready.wait();
+            sink->present(lane->slot);
+            stats.add(lane->stats);
+            rays += lane->rays;
+            render_seconds += lane->slot.seconds;
+            lane->free.post();
+        }
+        for (int i = 0; i < concurrent; i++) {
+            lanes[i]->exited.wait();
+            delete lanes[i]->renderer;
+            delete[] lanes[i]->slot.buffer.pixels;
+            delete lanes[i];
+        }
+    }
+
+    // Over the whole path: what the rays did, primary rays traced, and the
+    // sum of the frames' render times.
+    const TraceStats& trace_stats() const { return stats; }
+    long primary_rays() const { return rays; }
+    double frame_seconds() const { return render_seconds; }
+};
+
+// Writes the frames presented to it to a file or pipe as a video stream:
+// YUV4MPEG2 for an encoder to read, or binary PPMs one after another.
+class StreamSink : public PresentSink {
+    FILE* file;
+    bool y4m;
+    int fps;
+    int frames;
+    bool failed;
+    std::vector<unsigned char> planes;
+public:
+    StreamSink(FILE* file, bool y4m, int fps = 60) : file(file), y4m(y4m), fps(fps), frames(0), failed(false) { }
+
+    void present(const FrameSlot& frame) {
+        if (failed) { return; }
+        if (y4m && frames == 0) { failed = !write_y4m_header(file, frame.width, frame.height, fps); }
+        if (!failed) {
+            failed = y4m ? !write_y4m_frame(file, frame.buffer, frame.width, frame.height, frame.bpp, &planes)
+                         : !write_ppm(file, frame.buffer, frame.width, frame.height, frame.bpp);
+        }
+        // Hand the frame on now, so an encoder reading the pipe keeps up.
+        failed = fflush(file) != 0 || failed;
+        frames++;
+    }
+
+    int frames_presented() const { return frames; }
+
+    // Whether every frame has been written so far.
+    bool ok() const { return !failed; }
+};
+
+#endif
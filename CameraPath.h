@@ -0,0 +1,190 @@
+#ifndef __CAMERAPATH_H__
+#define __CAMERAPATH_H__
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+#include "Render.h"
+#include "Shapes/CompiledScene.h"
+
+// Moves the camera by `motion`, going through any portals in the way, as
+// the player walks.  Returns whether it went through one.
+inline bool move_camera(RenderInfo* info, Vec motion) {
+    bool jumped = false;
+    int safety = 5;
+    while (motion.norm2() > 0 && safety--) {
+        RayHit hit;
+        RayCast cast(Ray(info->eye, motion.unit()), info->world);
+        cast.set_frame(info->frame);
+        info->world->scene->ray_cast(cast, &hit);
+        if (hit.type == RayHit::TYPE_MISS) { break; }
+        else if (hit.type == RayHit::TYPE_PORTAL) {
+            double distance = std::sqrt(hit.distance2);
+            double idistance = motion.norm();
+            if (distance <= idistance) {
+                jumped = true;
+                info->eye = hit.portal.new_cast.ray.origin;
+                info->frame = hit.portal.new_cast.frame;
+                info->world = hit.portal.new_cast.world;
+                motion = (idistance - distance) * hit.portal.new_cast.ray.direction;
+            }
+            else {
+                break;
+            }
+        }
+        else {
+            abort();
+        }
+    }
+    info->eye += motion;
+    return jumped;
+}
+
+// The camera at one step of a recorded session.
+struct CameraPose {
+    double dt;                  // seconds since the previous step
+    World* world;
+    Point eye;
+    Frame frame;
+    bool jumped;                // went through a portal this step
+};
+
+// The path of a camera starting at `info`'s view and moving `speed` along
+// it each step, through portals as the player would, as if at 60 frames
+// per second.
+inline void flythrough_path(RenderInfo info, Real speed, int steps, std::vector<CameraPose>* poses) {
+    for (int i = 0; i < steps; i++) {
+        bool jumped = i > 0 && move_camera(&info, speed * info.frame.forward);
+        CameraPose pose = { i > 0 ? 1/60.0 : 0, info.world, info.eye, info.frame, jumped };
+        poses->push_back(pose);
+    }
+}
+
+// A camera path file is a header and then one fixed-size record per step,
+// in native byte order.  Worlds are stored by their CompiledScene id, so a
+// path replays against the scene it was recorded in, compiled or cached.
+// Poses are kept in double, so replays see exactly the recorded views.
+const char CAMERA_PATH_MAGIC[8] = { 'R', 'T', 'P', 'A', 'T', 'H', '1', '\n' };
+
+struct CameraPathHeader {
+    char magic[8];
+    uint32_t world_count;       // of the scene, to catch replays against another
+    uint32_t record_size;
+};
+
+struct CameraPathRecord {
+    int32_t world;
+    uint32_t jumped;
+    double dt;
+    double eye[3];
+    double right[3], up[3], forward[3];
+};
+
+// Records a session's camera, a step at a time.  Records are buffered by
+// stdio, and flushed on close or when the program exits.
+class CameraPathWriter {
+    FILE* file;
+    const CompiledScene* scene;
+
+    static void put(double* out, const Vec& v) {
+        out[0] = v.x; out[1] = v.y; out[2] = v.z;
+    }
+
+    CameraPathWriter(const CameraPathWriter&);
+    CameraPathWriter& operator= (const CameraPathWriter&);
+public:
+    CameraPathWriter() : file(NULL), scene(NULL) { }
+    ~CameraPathWriter() { close(); }
+
+    // Starts a path in `world`'s scene, which must be compiled.  Returns
+    // false with a message if it can't.
+    bool open(const char* path, const World* world, std::string* error) {
+        scene = CompiledScene::of(world);
+        if (!scene) {
+            *error = "camera paths need a compiled scene";
+            return false;
+        }
+        file = fopen(path, "wb");
+        if (!file) {
+            *error = std::string(path) + ": cannot open file";
+            return false;
+        }
+        CameraPathHeader header;
+        memcpy(header.magic, CAMERA_PATH_MAGIC, sizeof(header.magic));
+        header.world_count = scene->world_count();
+        header.record_size = sizeof(CameraPathRecord);
+        fwrite(&header, sizeof(header), 1, file);
+        return true;
+    }
+
+    void add(double dt, const RenderInfo& info, bool jumped) {
+        if (!file) { return; }
+        CameraPathRecord record;
+        record.world = scene->world_id(info.world);
+        record.jumped = jumped;
+        record.dt = dt;
+        put(record.eye, info.eye.v);
+        put(record.right, info.frame.right);
+        put(record.up, info.frame.up);
+        put(record.forward, info.frame.forward);
+        fwrite(&record, sizeof(record), 1, file);
+    }
+
+    void close() {
+        if (file) { fclose(file); }
+        file = NULL;
+    }
+};
+
+// Reads a camera path recorded in `world`'s scene.  Returns false with a
+// message if it can't.
+inline bool read_camera_path(const char* path, const World* world, std::vector<CameraPose>* poses,
+                             std::string* error) {
+    const CompiledScene* scene = CompiledScene::of(world);
+    if (!scene) {
+        *error = "camera paths need a compiled scene";
+        return false;
+    }
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        *error = std::string(path) + ": cannot open file";
+        return false;
+    }
+    CameraPathHeader header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+           && !memcmp(header.magic, CAMERA_PATH_MAGIC, sizeof(header.magic))
+           && header.record_size == sizeof(CameraPathRecord);
+    if (!ok) {
+        *error = std::string(path) + ": not a camera path";
+    }
+    else if (int(header.world_count) != scene->world_count()) {
+        *error = std::string(path) + ": recorded in a different scene";
+        ok = false;
+    }
+    CameraPathRecord record;
+    while (ok && fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.world < 0 || record.world >= scene->world_count()) {
+            *error = std::string(path) + ": bad world id";
+            ok = false;
+            break;
+        }
+        CameraPose pose;
+        pose.dt = record.dt;
+        pose.world = scene->world(record.world);
+        pose.eye = Point(record.eye[0], record.eye[1], record.eye[2]);
+        pose.frame = Frame(Vec(record.right[0], record.right[1], record.right[2]),
+                           Vec(record.up[0], record.up[1], record.up[2]),
+                           Vec(record.forward[0], record.forward[1], record.forward[2]));
+        pose.jumped = record.jumped != 0;
+        poses->push_back(pose);
+    }
+    fclose(file);
+    return ok;
+}
+
+#endif
@@ -1,29 +1,39 @@
 #ifndef __COLOR_H__
 #define __COLOR_H__
 
+#include "Vec.h"
+
 template<class T>
-inline double clamp(T x, T min, T max) {
+inline T clamp(T x, T min, T max) {
     if (x < min) { return min; }
     if (x > max) { return max; }
     return x;
 }
 
-struct Color {
-    double red, green, blue;
-    Color(double red, double green, double blue) : red(red), green(green), blue(blue) { }
+template<class T>
+struct ColorT {
+    typedef T Scalar;
+
+    T red, green, blue;
+    ColorT() : red(0), green(0), blue(0) { }
+    ColorT(T red, T green, T blue) : red(red), green(green), blue(blue) { }
     void to_bytes(unsigned char* r, unsigned char* g, unsigned char* b) const {
-        *r = (unsigned char)(clamp(red,0.0,1.0)*255);
-        *g = (unsigned char)(clamp(green,0.0,1.0)*255);
-        *b = (unsigned char)(clamp(blue,0.0,1.0)*255);
+        *r = (unsigned char)(clamp<T>(red,0,1)*255);
+        *g = (unsigned char)(clamp<T>(green,0,1)*255);
+        *b = (unsigned char)(clamp<T>(blue,0,1)*255);
     }
 };
 
-inline Color operator* (double s, const Color& color) {
-    return Color(s*color.red, s*color.green, s*color.blue);
+typedef ColorT<Real> Color;
+
+template<class T>
+inline ColorT<T> operator* (typename ColorT<T>::Scalar s, const ColorT<T>& color) {
+    return ColorT<T>(s*color.red, s*color.green, s*color.blue);
 }
 
-inline Color operator+ (const Color& a, const Color& b) {
-    return Color(a.red+b.red, a.green+b.green, a.blue+b.blue);
+template<class T>
+inline ColorT<T> operator+ (const ColorT<T>& a, const ColorT<T>& b) {
+    return ColorT<T>(a.red+b.red, a.green+b.green, a.blue+b.blue);
 }
 
 
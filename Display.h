@@ -0,0 +1,155 @@
+#ifndef __DISPLAY_H__
+#define __DISPLAY_H__
+
+// Interactive render targets.  These need SDL video and OpenGL, so they are
+// kept out of Render.h, which the headless build uses.
+
+#include <algorithm>
+#include "SDL.h"
+#include "SDL_opengl.h"
+#include "Render.h"
+#include "Pipeline.h"
+
+inline void render_sdl(SDL_Surface* surface, BufRenderer* buf_renderer) {
+    PixelBuffer buffer;
+    buffer.pixels = (unsigned char*)surface->pixels;
+
+    SDL_LockSurface(surface);
+    buf_renderer->render(buffer);
+    SDL_UnlockSurface(surface);
+}
+
+
+class OpenGLTextureTarget {
+    RenderInfo* info;
+    GLuint tex_id;
+    PixelBuffer buffer;
+public:
+    OpenGLTextureTarget(RenderInfo* info) : info(info) {
+        glGenTextures(1, &tex_id);
+        buffer.pixels = new unsigned char [info->bpp*info->width*info->height];
+    }
+    ~OpenGLTextureTarget() {
+        delete buffer.pixels;
+        glDeleteTextures(1, &tex_id);
+    }
+
+    void render(BufRenderer* buf_renderer) {
+        buf_renderer->render(buffer);
+    };
+
+    PixelBuffer get_buffer() const { return buffer; }
+
+    void prepare() {
+        glBindTexture(GL_TEXTURE_2D, tex_id);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, info->width, info->height,
+                     0, GL_RGB, GL_UNSIGNED_BYTE, buffer.pixels);
+    }
+
+    void draw(double alpha = 1) {
+        glBindTexture(GL_TEXTURE_2D, tex_id);
+        glColor4d(1,1,1,alpha);
+        glBegin(GL_QUADS);
+            glTexCoord2f(0, 0);
+            glVertex2f(-1, 1);
+            glTexCoord2f(1, 0);
+            glVertex2f(1, 1);
+            glTexCoord2f(1, 1);
+            glVertex2f(1, -1);
+            glTexCoord2f(0, 1);
+            glVertex2f(-1, -1);
+        glEnd();
+    }
+};
+
+// Shows frames from a FramePipeline.  Two textures are allocated once at the
+// largest frame size, and each frame updates only the rows it rendered, with
+// glTexSubImage2D.  Frames are drawn into the front texture, unless they
+// belong to an image that isn't ready to show: those go to the back texture,
+// which becomes the front when its image is complete.
+class PipelinedTexture : public PresentSink {
+    struct Texture {
+        GLuint id;
+        int width, height;      // of the image in it
+    };
+
+    int max_width, max_height;
+    Texture front, back;
+    bool back_pending;          // the back texture has part of an image
+
+    static void allocate(Texture* texture, int width, int height) {
+        glGenTextures(1, &texture->id);
+        glBindTexture(GL_TEXTURE_2D, texture->id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        texture->width = texture->height = 0;
+    }
+
+    static void upload(Texture* texture, const FrameSlot& frame) {
+        const Tile& r = frame.region;
+        glBindTexture(GL_TEXTURE_2D, texture->id);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, r.y0, frame.width, r.y1 - r.y0, GL_RGB, GL_UNSIGNED_BYTE,
+                        frame.buffer.pixels + frame.bpp * frame.width * r.y0);
+        texture->width = frame.width;
+        texture->height = frame.height;
+    }
+
+public:
+    PipelinedTexture(int max_width, int max_height)
+        : max_width(max_width), max_height(max_height), back_pending(false)
+    {
+        allocate(&front, max_width, max_height);
+        allocate(&back, max_width, max_height);
+    }
+
+    ~PipelinedTexture() {
+        glDeleteTextures(1, &front.id);
+        glDeleteTextures(1, &back.id);
+    }
+
+    void present(const FrameSlot& frame) {
+        if (!frame.show || back_pending) {
+            upload(&back, frame);
+            back_pending = !frame.show;
+            if (frame.show) { std::swap(front, back); }
+        }
+        else {
+            upload(&front, frame);
+        }
+    }
+
+    // Size of the image being shown.
+    int image_width() const { return front.width; }
+    int image_height() const { return front.height; }
+
+    void draw() {
+        // The image is in the texture's top left corner.
+        GLfloat s = GLfloat(front.width) / max_width;
+        GLfloat t = GLfloat(front.height) / max_height;
+        glBindTexture(GL_TEXTURE_2D, front.id);
+        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+        glColor4d(1,1,1,1);
+        glBegin(GL_QUADS);
+            glTexCoord2f(0, 0);
+            glVertex2f(-1, 1);
+            glTexCoord2f(s, 0);
+            glVertex2f(1, 1);
+            glTexCoord2f(s, t);
+            glVertex2f(1, -1);
+            glTexCoord2f(0, t);
+            glVertex2f(-1, -1);
+        glEnd();
+    }
+};
+
+#endif
@@ -0,0 +1,523 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+// Renders a frame's tiles in other processes.  A TileCoordinator listens on
+// a Unix socket; workers (run_tile_worker, `render --worker PATH`) connect
+// to it, load the job's scene once, and render the tiles they're sent with
+// their own threads, sending each tile's pixels back.  A worker that dies or
+// drops its connection has its tiles handed to the others, and workers may
+// join part way through a frame.  POSIX only.
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "Render.h"
+#include "Timer.h"
+#include "Shapes/CompiledScene.h"
+
+// Messages are a header and then `length` bytes of body, in native byte
+// order, so both ends must be the same kind of machine (as for scene
+// caches).
+enum TileMessageType {
+    TILE_HELLO = 1,             // worker: TileHello
+    TILE_JOB,                   // coordinator: TileJob
+    TILE_READY,                 // worker: has loaded the job's scene
+    TILE_FAILED,                // worker: couldn't, with the reason as text
+    TILE_WORK,                  // coordinator: TileWork, a tile to render
+    TILE_DONE                   // worker: TileWork, rays traced, then the tile's pixels
+};
+
+struct TileMessageHeader {
+    uint32_t type;
+    uint32_t length;
+};
+
+const char TILE_PROTOCOL_MAGIC[8] = { 'R', 'T', 'T', 'I', 'L', 'E', '1', '\n' };
+
+struct TileHello {
+    char magic[8];
+    uint32_t real_size;         // workers must trace in the coordinator's precision
+    int32_t pid;
+};
+
+// A frame to render: where the scene comes from, and the RenderInfo
+// settings.  The world is stored by its CompiledScene id.
+struct TileJob {
+    uint32_t job;
+    char scene[256];            // scene file, or "" for a sphere field of `spheres`
+    int32_t spheres;
+    int32_t world, world_count;
+    int32_t width, height, bpp, cast_limit, anti_alias, packet_size, adaptive_samples;
+    int32_t tile_size;          // of the worker's own threads' tiles
+    double adaptive_threshold, portal_cutoff;
+    double eye[3], right[3], up[3], forward[3];
+};
+
+struct TileWork {
+    uint32_t job;
+    int32_t x0, y0, x1, y1;
+};
+
+struct TileDone {
+    TileWork work;
+    int64_t rays;
+};
+
+// Loads a job's scene for a worker, compiled; NULL if it can't.
+typedef World* (*JobSceneLoader)(const char* scene, int spheres);
+
+inline bool write_all(int fd, const void* data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return false; }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool read_all(int fd, void* data, size_t size) {
+    char* p = (char*)data;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return false; }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool send_tile_message(int fd, TileMessageType type, const void* body, size_t length,
+                              const void* extra = NULL, size_t extra_length = 0) {
+    TileMessageHeader header = { type, uint32_t(length + extra_length) };
+    return write_all(fd, &header, sizeof(header))
+        && (length == 0 || write_all(fd, body, length))
+        && (extra_length == 0 || write_all(fd, extra, extra_length));
+}
+
+// Reads a whole message; false if the connection closed or the message
+// is malformed.
+inline bool read_tile_message(int fd, TileMessageType* type, std::vector<char>* body) {
+    TileMessageHeader header;
+    if (!read_all(fd, &header, sizeof(header))) { return false; }
+    if (header.type < TILE_HELLO || header.type > TILE_DONE || header.length > (1u << 30)) { return false; }
+    *type = TileMessageType(header.type);
+    body->resize(header.length);
+    return header.length == 0 || read_all(fd, &(*body)[0], header.length);
+}
+
+inline bool unix_socket_address(const char* path, sockaddr_un* address, std::string* error) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        *error = std::string(path) + ": socket path too long";
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// Hands out the tiles of frames to worker processes and puts their results
+// together.  Each worker has up to two tiles at a time, so it has the next
+// one while it sends the last back.
+class TileCoordinator {
+    enum State { HELLO, LOADING, READY };
+
+    struct Connection {
+        int fd;
+        int pid;
+        State state;
+        std::deque<Tile> assigned;
+        long tiles;
+    };
+
+    int listener;
+    std::string path;
+    std::vector<Connection> workers;
+    std::vector<pid_t> children;
+    TileJob job;
+    std::string last_failure;
+    long rays;
+
+    static void put(double* out, const Vec& v) {
+        out[0] = v.x; out[1] = v.y; out[2] = v.z;
+    }
+
+    void accept_worker() {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) { return; }
+        Connection worker = { fd, 0, HELLO, std::deque<Tile>(), 0 };
+        workers.push_back(worker);
+    }
+
+    // Drops a worker, putting its tiles back at the front of the queue.
+    void drop(size_t index, std::deque<Tile>* pending, const char* why) {
+        Connection& worker = workers[index];
+        if (worker.state != HELLO) {
+            std::cerr << "worker " << worker.pid << " " << why;
+            if (!worker.assigned.empty()) {
+                std::cerr << ", reassigning " << worker.assigned.size() << " tiles";
+            }
+            std::cerr << "\n";
+        }
+        pending->insert(pending->begin(), worker.assigned.begin(), worker.assigned.end());
+        close(worker.fd);
+        workers.erase(workers.begin() + index);
+    }
+
+    // Handles a message from a worker.  Returns false if the worker should
+    // be dropped.
+    bool receive(Connection* worker, RenderInfo* info, PixelBuffer buffer, int* done) {
+        TileMessageType type;
+        std::vector<char> body;
+        if (!read_tile_message(worker->fd, &type, &body)) { return false; }
+        if (worker->state == HELLO) {
+            if (type != TILE_HELLO || body.size() != sizeof(TileHello)) { return false; }
+            TileHello hello;
+            memcpy(&hello, &body[0], sizeof(hello));
+            worker->pid = hello.pid;
+            if (memcmp(hello.magic, TILE_PROTOCOL_MAGIC, sizeof(hello.magic)) || hello.real_size != sizeof(Real)) {
+                std::cerr << "worker " << hello.pid << " is not a compatible renderer\n";
+                return false;
+            }
+            worker->state = LOADING;
+            return send_tile_message(worker->fd, TILE_JOB, &job, sizeof(job));
+        }
+        if (type == TILE_READY) {
+            worker->state = READY;
+            return true;
+        }
+        if (type == TILE_FAILED) {
+            last_failure = std::string(body.begin(), body.end());
+            std::cerr << "worker " << worker->pid << ": " << last_failure << "\n";
+            return false;
+        }
+        if (type != TILE_DONE || body.size() < sizeof(TileDone)) { return false; }
+        TileDone result;
+        memcpy(&result, &body[0], sizeof(result));
+        if (result.work.job != job.job) { return true; }   // from an earlier frame
+        std::deque<Tile>::iterator i = worker->assigned.begin();
+        for (; i != worker->assigned.end(); ++i) {
+            if (i->x0 == result.work.x0 && i->y0 == result.work.y0 && i->x1 == result.work.x1 && i->y1 == result.work.y1) {
+                break;
+            }
+        }
+        if (i == worker->assigned.end()) { return false; }
+        Tile tile = *i;
+        size_t row = size_t(info->bpp) * (tile.x1 - tile.x0);
+        if (body.size() != sizeof(TileDone) + row * (tile.y1 - tile.y0)) { return false; }
+        const char* pixels = &body[sizeof(TileDone)];
+        for (int y = tile.y0; y < tile.y1; y++) {
+            memcpy(buffer.pixels + info->bpp*(tile.x0 + info->width*y), pixels + row*(y - tile.y0), row);
+        }
+        worker->assigned.erase(i);
+        worker->tiles++;
+        rays += result.rays;
+        (*done)++;
+        return true;
+    }
+
+    TileCoordinator(const TileCoordinator&);
+    TileCoordinator& operator= (const TileCoordinator&);
+public:
+    // Seconds a frame waits with no workers connected before giving up.
+    double worker_wait;
+
+    TileCoordinator() : listener(-1), rays(0), worker_wait(10) {
+        memset(&job, 0, sizeof(job));
+    }
+
+    ~TileCoordinator() {
+        for (size_t i = 0; i < workers.size(); i++) {
+            close(workers[i].fd);
+        }
+        if (listener >= 0) {
+            close(listener);
+            unlink(path.c_str());
+        }
+        // Workers exit when their connection closes.
+        for (size_t i = 0; i < children.size(); i++) {
+            waitpid(children[i], NULL, 0);
+        }
+    }
+
+    // Listens for workers at `path`, replacing any stale socket there.
+    bool listen(const char* socket_path, std::string* error) {
+        sockaddr_un address;
+        if (!unix_socket_address(socket_path, &address, error)) { return false; }
+        signal(SIGPIPE, SIG_IGN);       // a dead worker is seen as a failed write
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            *error = std::string("socket: ") + strerror(errno);
+            return false;
+        }
+        unlink(socket_path);
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 64) != 0) {
+            *error = std::string(socket_path) + ": " + strerror(errno);
+            close(listener);
+            listener = -1;
+            return false;
+        }
+        path = socket_path;
+        return true;
+    }
+
+    // Starts `count` local workers running `program --worker PATH --threads
+    // threads`.  They're waited for when the coordinator is destroyed.
+    bool spawn_workers(const char* program, int count, int threads, std::string* error) {
+        char thread_arg[16];
+        sprintf(thread_arg, "%d", threads);
+        for (int i = 0; i < count; i++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                *error = std::string("fork: ") + strerror(errno);
+                return false;
+            }
+            if (pid == 0) {
+                execlp(program, program, "--worker", path.c_str(), "--threads", thread_arg, (char*)NULL);
+                perror(program);
+                _exit(127);
+            }
+            children.push_back(pid);
+        }
+        return true;
+    }
+
+    // Renders the frame `info` describes into `buffer`, in tiles of
+    // tile_size pixels split by the workers into tiles of worker_tile_size.
+    // `scene` is the file info->world was loaded from, or "" for a sphere
+    // field of `spheres`.  Returns false with a message if the frame can't
+    // be finished.
+    bool render(RenderInfo* info, const char* scene, int spheres, int tile_size, int worker_tile_size,
+                PixelBuffer buffer, std::string* error) {
+        const CompiledScene* compiled = CompiledScene::of(info->world);
+        if (!compiled) {
+            *error = "distributed rendering needs a compiled scene";
+            return false;
+        }
+        if (strlen(scene) >= sizeof(job.scene)) {
+            *error = std::string(scene) + ": scene path too long";
+            return false;
+        }
+        job.job++;
+        strcpy(job.scene, scene);
+        job.spheres = spheres;
+        job.world = compiled->world_id(info->world);
+        job.world_count = compiled->world_count();
+        job.width = info->width;
+        job.height = info->height;
+        job.bpp = info->bpp;
+        job.cast_limit = info->cast_limit;
+        job.anti_alias = info->anti_alias;
+        job.packet_size = info->packet_size;
+        job.adaptive_samples = info->adaptive_samples;
+        job.tile_size = worker_tile_size;
+        job.adaptive_threshold = info->adaptive_threshold;
+        job.portal_cutoff = info->portal_cutoff;
+        put(job.eye, info->eye.v);
+        put(job.right, info->frame.right);
+        put(job.up, info->frame.up);
+        put(job.forward, info->frame.forward);
+
+        std::vector<Tile> tiles;
+        make_tiles(Tile(0, 0, info->width, info->height), tile_size, &tiles);
+        std::deque<Tile> pending(tiles.begin(), tiles.end());
+        int done = 0;
+        rays = 0;
+        for (size_t i = workers.size(); i-- > 0; ) {
+            workers[i].tiles = 0;
+            if (workers[i].state == HELLO) { continue; }
+            workers[i].state = LOADING;
+            if (!send_tile_message(workers[i].fd, TILE_JOB, &job, sizeof(job))) {
+                drop(i, &pending, "lost");
+            }
+        }
+
+        double alone_since = wall_seconds();
+        while (done < int(tiles.size())) {
+            for (size_t i = workers.size(); i-- > 0; ) {
+                Connection& worker = workers[i];
+                while (worker.state == READY && worker.assigned.size() < 2 && !pending.empty()) {
+                    Tile tile = pending.front();
+                    TileWork work = { job.job, tile.x0, tile.y0, tile.x1, tile.y1 };
+                    if (!send_tile_message(worker.fd, TILE_WORK, &work, sizeof(work))) { break; }
+                    worker.assigned.push_back(tile);
+                    pending.pop_front();
+                }
+            }
+
+            bool working = false;
+            for (size_t i = 0; i < workers.size(); i++) {
+                working = working || workers[i].state != HELLO;
+            }
+            if (working) {
+                alone_since = wall_seconds();
+            }
+            else if (wall_seconds() - alone_since > worker_wait) {
+                *error = "no workers to render with";
+                if (!last_failure.empty()) { *error += " (last failure: " + last_failure + ")"; }
+                return false;
+            }
+
+            std::vector<pollfd> fds(workers.size() + 1);
+            for (size_t i = 0; i < workers.size(); i++) {
+                fds[i].fd = workers[i].fd;
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+            fds[workers.size()].fd = listener;
+            fds[workers.size()].events = POLLIN;
+            fds[workers.size()].revents = 0;
+            if (poll(&fds[0], fds.size(), 250) < 0 && errno != EINTR) {
+                *error = std::string("poll: ") + strerror(errno);
+                return false;
+            }
+            for (size_t i = workers.size(); i-- > 0; ) {
+                if (fds[i].revents && !receive(&workers[i], info, buffer, &done)) {
+                    drop(i, &pending, "lost");
+                }
+            }
+            if (fds.back().revents & POLLIN) { accept_worker(); }
+        }
+        return true;
+    }
+
+    // Primary rays traced in the last frame, over all workers.
+    long primary_rays() const { return rays; }
+
+    // Workers connected, and how many tiles each rendered of the last frame.
+    int worker_count() const { return workers.size(); }
+    long worker_tiles(int i) const { return workers[i].tiles; }
+    int worker_pid(int i) const { return workers[i].pid; }
+};
+
+// Renders tiles for the coordinator at `path` until it closes the
+// connection, with `threads` threads.  Returns nonzero if it can't connect
+// or the connection breaks.
+inline int run_tile_worker(const char* path, int threads, JobSceneLoader load) {
+    sockaddr_un address;
+    std::string error;
+    if (!unix_socket_address(path, &address, &error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        std::cerr << path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    TileHello hello;
+    memcpy(hello.magic, TILE_PROTOCOL_MAGIC, sizeof(hello.magic));
+    hello.real_size = sizeof(Real);
+    hello.pid = getpid();
+    if (!send_tile_message(fd, TILE_HELLO, &hello, sizeof(hello))) { return 1; }
+
+    // The last scene loaded is kept for the jobs after it.  Scenes aren't
+    // freed, as elsewhere.
+    std::string scene_name;
+    int scene_spheres = -1;
+    const CompiledScene* scene = NULL;
+    RenderInfo info;
+    ThreadedRenderer* renderer = NULL;
+    int renderer_tile_size = 0;
+    PixelBuffer buffer;
+    buffer.pixels = NULL;
+    size_t buffer_size = 0;
+    uint32_t job = 0;
+    std::vector<char> out;
+
+    TileMessageType type;
+    std::vector<char> body;
+    bool ok = true;
+    while (ok && read_tile_message(fd, &type, &body)) {
+        if (type == TILE_JOB && body.size() == sizeof(TileJob)) {
+            TileJob next;
+            memcpy(&next, &body[0], sizeof(next));
+            next.scene[sizeof(next.scene) - 1] = '\0';
+            if (!scene || scene_name != next.scene || scene_spheres != next.spheres) {
+                World* world = load(next.scene, next.spheres);
+                scene = world ? CompiledScene::of(world) : NULL;
+                scene_name = next.scene;
+                scene_spheres = next.spheres;
+            }
+            std::string failure;
+            if (!scene) { failure = "cannot load " + scene_name; }
+            else if (scene->world_count() != next.world_count || next.world < 0 || next.world >= next.world_count) {
+                failure = scene_name + " differs from the coordinator's";
+            }
+            if (!failure.empty()) {
+                ok = send_tile_message(fd, TILE_FAILED, failure.data(), failure.size());
+                continue;
+            }
+            job = next.job;
+            info.world = scene->world(next.world);
+            info.eye = Point(next.eye[0], next.eye[1], next.eye[2]);
+            info.frame = Frame(Vec(next.right[0], next.right[1], next.right[2]),
+                               Vec(next.up[0], next.up[1], next.up[2]),
+                               Vec(next.forward[0], next.forward[1], next.forward[2]));
+            info.width = next.width;
+            info.height = next.height;
+            info.bpp = next.bpp;
+            info.cast_limit = next.cast_limit;
+            info.anti_alias = next.anti_alias != 0;
+            info.packet_size = next.packet_size;
+            info.adaptive_samples = next.adaptive_samples;
+            info.adaptive_threshold = Real(next.adaptive_threshold);
+            info.portal_cutoff = Real(next.portal_cutoff);
+            size_t size = size_t(info.bpp) * info.width * info.height;
+            if (size > buffer_size) {
+                delete[] buffer.pixels;
+                buffer.pixels = new unsigned char [size];
+                buffer_size = size;
+            }
+            if (!renderer || renderer_tile_size != next.tile_size) {
+                delete renderer;
+                renderer = new ThreadedRenderer(&info, threads, next.tile_size);
+                renderer_tile_size = next.tile_size;
+            }
+            ok = send_tile_message(fd, TILE_READY, NULL, 0);
+        }
+        else if (type == TILE_WORK && body.size() == sizeof(TileWork) && renderer) {
+            TileDone result;
+            memcpy(&result.work, &body[0], sizeof(result.work));
+            Tile tile(result.work.x0, result.work.y0, result.work.x1, result.work.y1);
+            if (result.work.job != job || tile.x0 < 0 || tile.y0 < 0 || tile.x1 > info.width || tile.y1 > info.height
+                || tile.x0 >= tile.x1 || tile.y0 >= tile.y1) {
+                ok = false;
+                break;
+            }
+            renderer->render_region(buffer, tile);
+            result.rays = renderer->primary_rays();
+            size_t row = size_t(info.bpp) * (tile.x1 - tile.x0);
+            out.resize(row * (tile.y1 - tile.y0));
+            for (int y = tile.y0; y < tile.y1; y++) {
+                memcpy(&out[row * (y - tile.y0)], buffer.pixels + info.bpp*(tile.x0 + info.width*y), row);
+            }
+            ok = send_tile_message(fd, TILE_DONE, &result, sizeof(result), &out[0], out.size());
+        }
+        else {
+            ok = false;
+        }
+    }
+    delete renderer;
+    delete[] buffer.pixels;
+    close(fd);
+    return ok ? 0 : 1;
+}
+
+#endif
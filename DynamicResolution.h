@@ -0,0 +1,57 @@
+#ifndef __DYNAMICRESOLUTION_H__
+#define __DYNAMICRESOLUTION_H__
+
+#include <cmath>
+#include <algorithm>
+#include "Vec.h"
+
+// Holds interactive frames to a render time budget by trading resolution
+// and portal depth.  Frames over budget lower the resolution first, and the
+// cast limit only once the resolution is at its minimum; frames well under
+// budget restore the cast limit first.  Between the two thresholds nothing
+// changes, so the settings don't oscillate from frame to frame.
+class ResolutionController {
+    double target;
+    Real resolution;            // fraction of the full width and height
+    int casts;
+    int max_casts;
+
+    static Real min_resolution() { return Real(0.25); }
+    static const int MIN_CASTS = 4;
+
+public:
+    ResolutionController(double target_seconds, int max_cast_limit)
+        : target(target_seconds), resolution(Real(0.5)),
+          casts(std::min(8, max_cast_limit)), max_casts(max_cast_limit)
+    { }
+
+    double target_seconds() const { return target; }
+    Real scale() const { return resolution; }
+    int cast_limit() const { return casts; }
+
+    // Adjusts the settings after a frame rendered with them took `seconds`.
+    void frame_done(double seconds) {
+        double ratio = seconds / target;
+        if (ratio > 1.1) {
+            if (resolution > min_resolution()) {
+                // Render time goes with the pixel count.
+                Real step = Real(std::max(0.7, 1/std::sqrt(ratio)));
+                resolution = std::max(min_resolution(), resolution * step);
+            }
+            else if (casts > MIN_CASTS) {
+                casts--;
+            }
+        }
+        else if (ratio < 0.8) {
+            if (casts < max_casts) {
+                casts++;
+            }
+            else {
+                Real step = Real(std::min(1.05, 1/std::sqrt(ratio)));
+                resolution = std::min(Real(1), resolution * step);
+            }
+        }
+    }
+};
+
+#endif
@@ -4,17 +4,25 @@
 #include "Vec.h"
 #include "Tweaks.h"
 #include <math.h>
+#include <algorithm>
+
+template<class T>
+struct FrameT {
+    typedef VecT<T> Vec;
+    typedef FrameT Frame;
 
-struct Frame {
     Vec right;
     Vec up;
     Vec forward;
 
-    Frame() { }
-    Frame(const Vec& right, const Vec& up, const Vec& forward)
+    FrameT() { }
+    FrameT(const Vec& right, const Vec& up, const Vec& forward)
         : right(right), up(up), forward(forward)
     { }
 
+    template<class U>
+    explicit FrameT(const FrameT<U>& f) : right(f.right), up(f.up), forward(f.forward) { }
+
 	static Frame from_normal_up(Vec normal, Vec up)
 	{
 		Frame frame;
@@ -48,18 +56,18 @@ struct Frame {
 		return out;
 	}
 
-    Frame rotate(const Vec& axis, double angle) const {
+    Frame rotate(const Vec& axis, T angle) const {
         return Frame(right.rotate(axis, angle),
                      up.rotate(axis, angle),
                      forward.rotate(axis, angle));
     }
     
-    Frame upright(double dt, const Vec& true_up) const {
-        double hand = handedness();
+    Frame upright(T dt, const Vec& true_up) const {
+        T hand = handedness();
         Vec new_forward = forward.unit();
         Vec new_right = right.flatten(new_forward).unit();
         new_right = new_right.rotate(new_forward, 
-                        -std::min(1.0, Tweaks::UPRIGHT_SPEED*hand*dt)*(new_right*true_up));
+                        -std::min(T(1), T(Tweaks::UPRIGHT_SPEED*hand*dt))*(new_right*true_up));
         Vec new_up = hand * Vec::cross(new_forward, new_right); 
         return Frame(new_right, new_up, new_forward);
     }
@@ -69,9 +77,11 @@ struct Frame {
     }
 
     // returns 1 if the frame is right-handed, -1 if it is left-handed
-    double handedness() const {
+    T handedness() const {
         return sign(Vec::cross(forward, right) * up);
     }
 };
 
+typedef FrameT<Real> Frame;
+
 #endif
@@ -0,0 +1,194 @@
+#ifndef __HEATMAP_H__
+#define __HEATMAP_H__
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include "Render.h"
+#include "Color.h"
+#include "Timer.h"
+
+// What a heat map shows for each pixel's ray.
+enum HeatMetric {
+    HEAT_CASTS,                 // scene casts, one per world the ray was in
+    HEAT_SHAPE_TESTS,           // box and shape tests (see ShapeCounters)
+    HEAT_DEPTH,                 // portals the ray went through
+    HEAT_NANOSECONDS,           // time taken to trace it
+    HEAT_METRICS
+};
+
+inline const char* heat_metric_name(HeatMetric metric) {
+    static const char* names[HEAT_METRICS] = { "casts", "tests", "depth", "time" };
+    return names[metric];
+}
+
+inline bool parse_heat_metric(const char* name, HeatMetric* metric) {
+    for (int i = 0; i < HEAT_METRICS; i++) {
+        if (!strcmp(name, heat_metric_name(HeatMetric(i)))) {
+            *metric = HeatMetric(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Renders what each pixel costs instead of what it shows, from blue (free)
+// through green and yellow to red (at the top of the scale), with a legend
+// along the bottom.  One ray is traced through each pixel's centre, singly
+// so it can be measured on its own.  Casts and depth are scaled to the cast
+// limit; tests and time to the 99th percentile of the frame, so a few
+// outliers don't wash out the rest.  A band of a frame can only raise the
+// scale, so the bands of a progressive render agree.
+class HeatMapRenderer : public TileRenderer {
+    HeatMetric metric;
+    std::vector<float> costs;
+    double scale;
+
+    static Color ramp(double t) {
+        static const Real stops[5][3] = {
+            { 0, 0, Real(0.4) }, { 0, Real(0.6), 1 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 }
+        };
+        t = std::min(std::max(t, 0.0), 1.0) * 4;
+        int i = std::min(int(t), 3);
+        Real f = Real(t - i);
+        return Color(stops[i][0] + f*(stops[i+1][0] - stops[i][0]),
+                     stops[i][1] + f*(stops[i+1][1] - stops[i][1]),
+                     stops[i][2] + f*(stops[i+1][2] - stops[i][2]));
+    }
+
+    // 3x5 pixel glyphs for the legend, a row of three bits per byte.
+    static const unsigned char* glyph(char c) {
+        static const char chars[] = "0123456789ACDEHNPST";
+        static const unsigned char glyphs[][5] = {
+            { 7,5,5,5,7 }, { 2,6,2,2,7 }, { 7,1,7,4,7 }, { 7,1,7,1,7 }, { 5,5,7,1,1 },
+            { 7,4,7,1,7 }, { 7,4,7,5,7 }, { 7,1,1,1,1 }, { 7,5,7,5,7 }, { 7,5,7,1,7 },
+            { 2,5,7,5,5 }, { 7,4,4,4,7 }, { 6,5,5,5,6 }, { 7,4,6,4,7 }, { 5,5,7,5,5 },
+            { 6,5,5,5,5 }, { 7,5,7,4,4 }, { 7,4,7,1,7 }, { 7,2,2,2,2 }
+        };
+        const char* p = strchr(chars, c);
+        return c && p ? glyphs[p - chars] : NULL;
+    }
+
+    static void fill(RenderInfo* info, PixelBuffer buffer, int x0, int y0, int x1, int y1, const Color& color) {
+        for (int y = std::max(y0, 0); y < std::min(y1, info->height); y++) {
+            for (int x = std::max(x0, 0); x < std::min(x1, info->width); x++) {
+                unsigned char* p = buffer.pixels + info->bpp*(x + info->width*y);
+                color.to_bytes(p, p+1, p+2);
+            }
+        }
+    }
+
+    // Draws text with its top left at (x, y), `size` pixels to a glyph
+    // pixel.  Returns the x after it.
+    static int text(RenderInfo* info, PixelBuffer buffer, int x, int y, int size, const char* s) {
+        for (; *s; s++, x += 4*size) {
+            const unsigned char* g = glyph(*s);
+            if (!g) { continue; }
+            for (int row = 0; row < 5; row++) {
+                for (int col = 0; col < 3; col++) {
+                    if (g[row] & (4 >> col)) {
+                        fill(info, buffer, x + col*size, y + row*size, x + (col+1)*size, y + (row+1)*size,
+                             Color(1, 1, 1));
+                    }
+                }
+            }
+        }
+        return x;
+    }
+
+    void legend(RenderInfo* info, PixelBuffer buffer) {
+        int size = std::max(1, info->width / 320);
+        int top = info->height - 9*size;
+        if (top < 0) { return; }
+        fill(info, buffer, 0, top, info->width, info->height, Color(0, 0, 0));
+        int y = top + 2*size;
+        int x = text(info, buffer, 2*size, y, size, "0") + size;
+        int bar = info->width / 2;
+        for (int i = 0; i < bar; i++) {
+            fill(info, buffer, x + i, y, x + i + 1, y + 5*size, ramp(double(i) / (bar - 1)));
+        }
+        static const char* units[HEAT_METRICS] = { "CASTS", "TESTS", "DEPTH", "NS" };
+        char label[32];
+        sprintf(label, "%.0f %s", scale, units[metric]);
+        text(info, buffer, x + bar + 2*size, y, size, label);
+    }
+
+public:
+    HeatMapRenderer(HeatMetric metric) : metric(metric), scale(1) { }
+
+    HeatMetric get_metric() const { return metric; }
+    void set_metric(HeatMetric m) { metric = m; }
+
+    // The cost shown red in the last frame.
+    double legend_scale() const { return scale; }
+
+    void begin_frame(RenderInfo* info, const Tile& region) {
+        costs.resize(info->width * info->height);
+    }
+
+    long render_tile(RenderInfo* info, PixelBuffer buffer, const Tile& tile) {
+        // Shape tests are counted by the render thread's counters, or by
+        // these when there are none.
+        ShapeCounters own;
+        ShapeCounters*& counters = shape_counters();
+        ShapeCounters* outer = counters;
+        if (!outer) { counters = &own; }
+
+        double epsx = 1.0/info->width;
+        double epsy = 1.0/info->height;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                long tests = counters->box_tests + counters->shape_tests;
+                double start = metric == HEAT_NANOSECONDS ? precise_seconds() : 0;
+                int depth;
+                TraceStats::Ending ending;
+                trace_cast(info, primary_cast(info, epsx*x, epsy*(info->height-y)), 0, primary_cone(info),
+                           &depth, NULL, &ending);
+                float cost = 0;
+                switch (metric) {
+                // An escaped ray's last cast missed; any other's crossed a portal.
+                case HEAT_CASTS: cost = float(ending == TraceStats::ESCAPED ? depth + 1 : depth); break;
+                case HEAT_SHAPE_TESTS: cost = float(counters->box_tests + counters->shape_tests - tests); break;
+                case HEAT_DEPTH: cost = float(depth); break;
+                case HEAT_NANOSECONDS: cost = float(1e9 * (precise_seconds() - start)); break;
+                case HEAT_METRICS: break;
+                }
+                costs[y*info->width + x] = cost;
+            }
+        }
+        counters = outer;
+        return long(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    }
+
+    void end_frame(RenderInfo* info, PixelBuffer buffer, const Tile& region) {
+        bool whole = region.x0 == 0 && region.y0 == 0 && region.x1 == info->width && region.y1 == info->height;
+        if (metric == HEAT_CASTS || metric == HEAT_DEPTH) {
+            scale = std::max(info->cast_limit, 1);
+        }
+        else {
+            std::vector<float> sorted;
+            for (int y = region.y0; y < region.y1; y++) {
+                sorted.insert(sorted.end(), costs.begin() + y*info->width + region.x0,
+                              costs.begin() + y*info->width + region.x1);
+            }
+            double high = 1;
+            if (!sorted.empty()) {
+                std::vector<float>::iterator rank = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+                std::nth_element(sorted.begin(), rank, sorted.end());
+                high = std::max(double(*rank), 1.0);
+            }
+            scale = whole ? high : std::max(scale, high);
+        }
+
+        for (int y = region.y0; y < region.y1; y++) {
+            for (int x = region.x0; x < region.x1; x++) {
+                unsigned char* p = buffer.pixels + info->bpp*(x + info->width*y);
+                ramp(costs[y*info->width + x] / scale).to_bytes(p, p+1, p+2);
+            }
+        }
+        if (region.y1 == info->height) { legend(info, buffer); }
+    }
+};
+
+#endif
@@ -1,8 +1,74 @@
 #ifndef __IMAGE_H__
 #define __IMAGE_H__
 
+#include <iostream>
+#include "Color.h"
+
+#ifdef HEADLESS
+#include <cstdio>
+#include <vector>
+#include <jpeglib.h>
+#else
 #include "SDL.h"
 #include "SDL_image.h"
+#endif
+
+#ifdef HEADLESS
+
+// Headless builds decode JPEGs with libjpeg into a packed RGB buffer,
+// since SDL_image isn't available.  Images are only read while building
+// a Skybox, which does all the per-ray sampling.
+class Image {
+    int w, h;
+    std::vector<unsigned char> pixels;
+    bool ok;
+
+public:
+    // An image that can't be opened is one black pixel; see loaded().
+    Image(const char* filename) : w(1), h(1), pixels(3, 0), ok(false) {
+        FILE* file = fopen(filename, "rb");
+        if (!file) {
+            std::cerr << "Failed to load " << filename << ": cannot open file" << std::endl;
+            return;
+        }
+
+        jpeg_decompress_struct cinfo;
+        jpeg_error_mgr jerr;
+        cinfo.err = jpeg_std_error(&jerr);
+        jpeg_create_decompress(&cinfo);
+        jpeg_stdio_src(&cinfo, file);
+        jpeg_read_header(&cinfo, TRUE);
+        cinfo.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&cinfo);
+
+        w = cinfo.output_width;
+        h = cinfo.output_height;
+        pixels.resize(3*w*h);
+        while (cinfo.output_scanline < cinfo.output_height) {
+            JSAMPROW row = &pixels[3*w*cinfo.output_scanline];
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+
+        jpeg_finish_decompress(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        ok = true;
+    }
+
+    // Whether the file was read.
+    bool loaded() const { return ok; }
+
+    int width() const { return w; }
+    int height() const { return h; }
+
+    Color texel(int x, int y) const {
+        const unsigned char* p = &pixels[3*(w*y + x)];
+        double scale = 1/255.0;
+        return Color(scale*p[0], scale*p[1], scale*p[2]);
+    }
+};
+
+#else
 
 class Image {
     SDL_Surface* surface;
@@ -16,17 +82,19 @@ public:
     }
     ~Image() {
         SDL_FreeSurface(surface);
-		
+
     }
 
-    Color at(double x, double y) const {
-#pragma warning(disable:4244)
-        int xidx = clamp(int(x * surface->w), 0, surface->w-1);
-        int yidx = clamp(int(y * surface->h), 0, surface->h-1);
-#pragma warning(default:4244)
+    // Whether the file was read.
+    bool loaded() const { return surface != NULL; }
+
+    int width() const { return surface->w; }
+    int height() const { return surface->h; }
+
+    Color texel(int x, int y) const {
         Uint8* pixels = (Uint8*)surface->pixels;
         SDL_PixelFormat* fmt = surface->format;
-        Uint32 pixel = *(Uint32*)(&pixels[surface->pitch * yidx + fmt->BytesPerPixel * xidx]);
+        Uint32 pixel = *(Uint32*)(&pixels[surface->pitch * y + fmt->BytesPerPixel * x]);
         Uint8 r = (Uint8)(((pixel & fmt->Rmask) >> fmt->Rshift) << fmt->Rloss);
         Uint8 g = (Uint8)(((pixel & fmt->Gmask) >> fmt->Gshift) << fmt->Gloss);
         Uint8 b = (Uint8)(((pixel & fmt->Bmask) >> fmt->Bshift) << fmt->Bloss);
@@ -36,3 +104,5 @@ public:
 };
 
 #endif
+
+#endif
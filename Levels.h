@@ -0,0 +1,118 @@
+#ifndef __LEVELS_H__
+#define __LEVELS_H__
+
+#include <vector>
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+#include "Skybox.h"
+#include "Shapes/Shape.h"
+#include "Shapes/Sphere.h"
+#include "Shapes/LinearCompound.h"
+#include "Shapes/Plane.h"
+#include "Shapes/BoundingBox.h"
+#include "Shapes/BVH.h"
+#include "Shapes/SphereSet.h"
+#include "Shapes/PlaneSet.h"
+#include "Render.h"
+
+/*
+///////////////////////////////////////////////////////////////////
+//                  DEBUG TEST WORLD
+///////////////////////////////////////////////////////////////////
+
+World* make_compound(Sphere** sphere_out) {
+    std::vector<Shape*> shapes;
+
+    // BoundingBoxes are for optimization only.
+
+    shapes.push_back(new Plane(Point(0, -4, 0), Vec(0, 1, 0)));
+
+    std::vector<Shape*> leftbox;
+    for (double x = -40; x < 0; x += 8) {
+        std::vector<Shape*> subshapes;
+        subshapes.push_back(new Sphere(Point(x, 0, 0), 1));
+        subshapes.push_back(new Sphere(Point(x-2, 0, 0), 1));
+        subshapes.push_back(new Sphere(Point(x+2, 0, 0), 1));
+        subshapes.push_back(new Sphere(Point(x, 2, 0), 1));
+        leftbox.push_back(new BoundingBox(Point(x-3,-1,-1), Point(x+3,3,1),
+                            new LinearCompound(subshapes)));
+    }
+    shapes.push_back(new BoundingBox(Point(-43,-1,-1), Point(3,3,1),
+                        new LinearCompound(leftbox)));
+    
+    std::vector<Shape*> rightbox;
+    for (double x = 0; x <= 40; x += 8) {
+        std::vector<Shape*> subshapes;
+        if (x == 0) {
+            *sphere_out = new Sphere(Point(x, 0, 0), 1);
+            subshapes.push_back(*sphere_out);
+        }
+        else {
+            subshapes.push_back(new Sphere(Point(x, 0, 0), 1));
+        }
+        subshapes.push_back(new Sphere(Point(x-2, 0, 0), 1));
+        subshapes.push_back(new Sphere(Point(x+2, 0, 0), 1));
+        subshapes.push_back(new Sphere(Point(x, 2, 0), 1));
+        rightbox.push_back(new BoundingBox(Point(x-3,-1,-1), Point(x+3,3,1),
+                            new LinearCompound(subshapes)));
+    }
+    shapes.push_back(new BoundingBox(Point(-3,-1,-1), Point(43,3,1),
+                        new LinearCompound(rightbox)));
+
+    World* world = new World;
+    world->scene = new LinearCompound(shapes);
+    return world;
+}
+
+World* make_world() {
+    Sphere* red_sphere;
+    Sphere* blue_sphere;
+    World* red_world = make_compound(&red_sphere);
+    World* blue_world = make_compound(&blue_sphere);
+
+    red_world->skybox = new Skybox("sunset.jpg");
+    blue_world->skybox = new Skybox("bluesky.jpg");
+    red_sphere->set_target(blue_world, Point(0, 0, 0), 1);
+    blue_sphere->set_target(red_world, Point(0, 0, 0), 1);
+
+    return red_world;
+}
+*/
+
+const int FIELD_CLUSTER = 4;
+
+///////////////////////////////////////////////////////////////////
+//                  SPHERE FIELD
+///////////////////////////////////////////////////////////////////
+
+// A cube of `count` randomly placed mirror spheres around the origin, with
+// a clear space for the camera at the center.  Deterministic for a given
+// seed, so renders are reproducible.
+inline World* make_sphere_field_world(int count, unsigned int seed = 1) {
+	std::vector<SphereSpec> spheres;
+	double half = 2.0 * std::pow(double(count), 1.0/3.0);
+	unsigned int state = seed;
+	while ((int)spheres.size() < count) {
+		double r[4];
+		for (int i = 0; i < 4; i++) {
+			state = state * 1664525u + 1013904223u;
+			r[i] = (state >> 8) / double(1 << 24);
+		}
+		Point center((2*r[0] - 1)*half, (2*r[1] - 1)*half, (2*r[2] - 1)*half);
+		if (center.v.norm() < 3) { continue; }
+		spheres.push_back(SphereSpec(center, 0.2 + 0.6*r[3]));
+	}
+
+	// Small SoA clusters under a BVH: the BVH culls most of the field and
+	// each leaf tests its spheres in one vectorized pass.
+	std::vector<Shape*> shapes;
+	make_sphere_clusters(spheres, 0, spheres.size(), FIELD_CLUSTER, &shapes);
+
+	World* world = new World;
+	world->scene = make_compound(shapes);
+	world->skybox = new Skybox("sunset.jpg");
+	return world;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "Render.h"
+
+// Writes an RGB pixel buffer (top row first, as the renderers produce it)
+// as a binary PPM.  Returns false if the file couldn't be written.
+inline bool write_ppm(FILE* file, PixelBuffer buffer, int width, int height, int bpp) {
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    if (bpp == 3) {
+        size_t size = 3*width*height;
+        return fwrite(buffer.pixels, 1, size, file) == size;
+    }
+    for (int i = 0; i < width*height; i++) {
+        if (fwrite(buffer.pixels + bpp*i, 1, 3, file) != 3) { return false; }
+    }
+    return true;
+}
+
+inline bool write_ppm(const char* filename, PixelBuffer buffer, int width, int height, int bpp) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) { return false; }
+    bool ok = write_ppm(file, buffer, width, height, bpp);
+    return fclose(file) == 0 && ok;
+}
+
+// YUV4MPEG2, the raw video stream format encoders such as ffmpeg read
+// from a pipe: a header, then each frame as "FRAME" and its Y, Cb and Cr
+// planes.  Frames are converted from RGB with BT.601's studio range
+// coefficients, and chroma is averaged over 2x2 blocks (4:2:0).
+inline bool write_y4m_header(FILE* file, int width, int height, int fps) {
+    return fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps) > 0;
+}
+
+// `planes` is scratch space, kept between frames to save reallocating it.
+inline bool write_y4m_frame(FILE* file, PixelBuffer buffer, int width, int height, int bpp,
+                            std::vector<unsigned char>* planes) {
+    int cw = (width + 1) / 2, ch = (height + 1) / 2;
+    planes->resize(width*height + 2*cw*ch);
+    unsigned char* luma = &(*planes)[0];
+    unsigned char* cb = luma + width*height;
+    unsigned char* cr = cb + cw*ch;
+    for (int y = 0; y < height; y++) {
+        const unsigned char* p = buffer.pixels + bpp*width*y;
+        for (int x = 0; x < width; x++, p += bpp) {
+            luma[width*y + x] = (unsigned char)(16.5 + 0.257*p[0] + 0.504*p[1] + 0.098*p[2]);
+        }
+    }
+    for (int y = 0; y < ch; y++) {
+        for (int x = 0; x < cw; x++) {
+            double r = 0, g = 0, b = 0;
+            for (int k = 0; k < 4; k++) {
+                // Odd edges repeat their last row or column.
+                int sx = std::min(2*x + (k & 1), width - 1);
+                int sy = std::min(2*y + (k >> 1), height - 1);
+                const unsigned char* p = buffer.pixels + bpp*(sx + width*sy);
+                r += p[0]; g += p[1]; b += p[2];
+            }
+            r /= 4; g /= 4; b /= 4;
+            cb[cw*y + x] = (unsigned char)(128.5 - 0.148*r - 0.291*g + 0.439*b);
+            cr[cw*y + x] = (unsigned char)(128.5 + 0.439*r - 0.368*g - 0.071*b);
+        }
+    }
+    return fputs("FRAME\n", file) >= 0 && fwrite(luma, 1, planes->size(), file) == planes->size();
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <vector>
+#include <cstring>
+#include "Render.h"
+#include "Thread.h"
+#include "Timer.h"
+
+// A frame in flight: its buffer, and what was rendered into it.
+struct FrameSlot {
+    PixelBuffer buffer;
+    int width, height, bpp;     // of the image the region belongs to
+    Tile region;                // the rows rendered this frame
+    bool show;                  // whether the image is ready to be shown
+    double seconds;             // render time
+};
+
+// Renders frames for a FramePipeline, on the pipeline's render thread.
+class FrameProducer {
+public:
+    virtual ~FrameProducer() { }
+
+    // Renders the next frame into frame->buffer, leaving the rest of the
+    // buffer undefined, and fills in frame's other fields.  Returns false
+    // if there's nothing new to render.
+    virtual bool produce(FrameSlot* frame) = 0;
+};
+
+// Takes rendered frames, on the thread calling FramePipeline::present.
+class PresentSink {
+public:
+    virtual ~PresentSink() { }
+    virtual void present(const FrameSlot& frame) = 0;
+};
+
+// Renders frames on a thread of its own while the caller presents earlier
+// ones.  There are `in_flight` buffers, passed round two bounded queues: the
+// render thread takes a free one, renders into it and queues it as ready;
+// present hands the oldest ready one to a sink and frees it.  So rendering
+// runs up to in_flight-1 frames ahead of presenting, and blocks beyond that.
+class FramePipeline {
+    FrameProducer* producer;
+    std::vector<FrameSlot> slots;
+    BoundedQueue<FrameSlot*> free_slots;
+    BoundedQueue<FrameSlot*> ready_slots;
+    volatile bool running;
+    Semaphore finished;
+
+    static int render_thread(void* data) {
+        FramePipeline* self = (FramePipeline*)data;
+        while (self->running) {
+            FrameSlot* slot = self->free_slots.pop();
+            if (self->producer->produce(slot)) {
+                self->ready_slots.push(slot);
+            }
+            else {
+                self->free_slots.push(slot);
+                sleep_milliseconds(5);
+            }
+        }
+        self->finished.post();
+        return 0;
+    }
+
+    FramePipeline(const FramePipeline&);
+    FramePipeline& operator= (const FramePipeline&);
+public:
+    // Buffers are `buffer_bytes` long, enough for the largest frame.
+    FramePipeline(FrameProducer* producer, int in_flight, int buffer_bytes)
+        : producer(producer), slots(in_flight), free_slots(in_flight), ready_slots(in_flight),
+          running(true), finished(0)
+    {
+        for (int i = 0; i < in_flight; i++) {
+            slots[i].buffer.pixels = new unsigned char[buffer_bytes];
+            free_slots.push(&slots[i]);
+        }
+        spawn_thread(render_thread, this);
+    }
+
+    ~FramePipeline() {
+        running = false;
+        // The render thread may be waiting for a free slot.
+        FrameSlot* slot;
+        while (!finished.try_wait()) {
+            if (ready_slots.try_pop(&slot)) { free_slots.push(slot); }
+            else { sleep_milliseconds(1); }
+        }
+        for (size_t i = 0; i < slots.size(); i++) {
+            delete[] slots[i].buffer.pixels;
+        }
+    }
+
+    // Presents the oldest rendered frame, if there is one.  Returns whether
+    // there was.
+    bool present(PresentSink* sink) {
+        FrameSlot* slot;
+        if (!ready_slots.try_pop(&slot)) { return false; }
+        sink->present(*slot);
+        free_slots.push(slot);
+        return true;
+    }
+
+    // Waits for the next rendered frame and presents it.
+    void present_next(PresentSink* sink) {
+        FrameSlot* slot = ready_slots.pop();
+        sink->present(*slot);
+        free_slots.push(slot);
+    }
+};
+
+// Presents into an image in memory, standing in for the texture upload when
+// measuring the pipeline without a display.  Each present can also wait for
+// a while, like a blocking buffer swap.
+class HeadlessSink : public PresentSink {
+    std::vector<unsigned char> image;
+    int present_ms;
+    int frames;
+    double first, last;         // present times of the first and last frames
+public:
+    HeadlessSink(int present_ms = 0) : present_ms(present_ms), frames(0), first(0), last(0) { }
+
+    void present(const FrameSlot& frame) {
+        size_t row = frame.bpp * frame.width;
+        image.resize(row * frame.height);
+        std::memcpy(&image[row * frame.region.y0], frame.buffer.pixels + row * frame.region.y0,
+                    row * (frame.region.y1 - frame.region.y0));
+        if (present_ms > 0) { sleep_milliseconds(present_ms); }
+        last = wall_seconds();
+        if (frames == 0) { first = last; }
+        frames++;
+    }
+
+    int frames_presented() const { return frames; }
+
+    // Frames per second between the first frame and the last.
+    double frame_rate() const {
+        return frames > 1 ? (frames - 1) / (last - first) : 0;
+    }
+
+    const unsigned char* pixels() const { return &image[0]; }
+};
+
+#endif
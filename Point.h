@@ -3,31 +3,42 @@
 
 #include "Vec.h"
 
-struct Point {
-    Vec v;
-    Point() {}
-    explicit Point(Vec v) : v(v) { }
-    Point(double x, double y, double z) : v(x,y,z) { }
+template<class T>
+struct PointT {
+    VecT<T> v;
+    PointT() {}
+    explicit PointT(VecT<T> v) : v(v) { }
+    PointT(T x, T y, T z) : v(x,y,z) { }
+
+    template<class U>
+    explicit PointT(const PointT<U>& p) : v(p.v) { }
 };
 
-inline Point operator+ (const Point& p, const Vec& v) {
-    return Point(p.v + v);
+typedef PointT<Real> Point;
+
+template<class T>
+inline PointT<T> operator+ (const PointT<T>& p, const VecT<T>& v) {
+    return PointT<T>(p.v + v);
 }
 
-inline Point operator- (const Point& p, const Vec& v) {
-    return Point(p.v - v);
+template<class T>
+inline PointT<T> operator- (const PointT<T>& p, const VecT<T>& v) {
+    return PointT<T>(p.v - v);
 }
 
-inline Vec operator- (const Point& p, const Point& q) {
+template<class T>
+inline VecT<T> operator- (const PointT<T>& p, const PointT<T>& q) {
     return p.v - q.v;
 }
 
-inline Point& operator+= (Point& a, const Vec& b) {
+template<class T>
+inline PointT<T>& operator+= (PointT<T>& a, const VecT<T>& b) {
     a.v += b;
     return a;
 }
 
-inline Point& operator-= (Point& a, const Vec& b) {
+template<class T>
+inline PointT<T>& operator-= (PointT<T>& a, const VecT<T>& b) {
     a.v -= b;
     return a;
 }
@@ -0,0 +1,187 @@
+#ifndef __PROGRESSIVE_H__
+#define __PROGRESSIVE_H__
+
+#include <vector>
+#include <algorithm>
+#include "Render.h"
+
+// Picks what to render each frame of an interactive session.  Right after
+// the camera moves a frame is rendered coarse and cheap, at the motion
+// quality set by the caller; while it stays put the image is redone in
+// stages of increasing quality, until the last stage is finished and nothing
+// more needs rendering.  Those stages are rendered a band of rows at a time,
+// each band fitting the frame budget, so the camera can move again at any
+// point.
+class Progressive {
+    struct Stage {
+        int cast_limit;
+        int adaptive_samples;
+    };
+
+    static const int STAGES = 5;
+
+    // Stages are rendered at the view's full size, but for stage 0, whose
+    // size and cast limit are the motion quality instead.
+    static const Stage& stage_settings(int stage) {
+        static const Stage stages[STAGES] = {
+            { 8, 0 },
+            { 12, 0 },
+            { 32, 0 },
+            { 32, 4 },
+            { 32, 16 },
+        };
+        return stages[stage];
+    }
+
+    // Rows in a stage's first band, before its cost per row is known.
+    static const int FIRST_BAND = 8;
+
+    const RenderInfo* view;
+    double band_seconds;        // target render time of a band
+    Real motion_scale;
+    int motion_cast_limit;
+    RenderInfo pass;
+    int stage;
+    int row;                    // rows of the stage already rendered
+    Tile band;                  // the last region handed out
+    double row_seconds;         // and its cost per row
+    int done_width, done_height; // size of the last finished stage
+
+    // Render time of each row of this stage so far, and of the last banded
+    // stage, which predicts where this one's cost lies.
+    std::vector<double> row_costs, last_row_costs;
+
+    // The pose the current stages are for.
+    World* world;
+    Point eye;
+    Frame frame;
+
+    static bool same(const Vec& a, const Vec& b) {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+    // Rows for the next band to take about band_seconds.
+    int band_rows() const {
+        // Cost varies over the image, so bands at most double in size.
+        int last = band.y1 - band.y0;
+        if (int(last_row_costs.size()) != pass.height) {
+            return std::min(int(band_seconds / row_seconds), 2*last);
+        }
+        // Otherwise follow the last stage's profile, scaled by the larger of
+        // how this stage compared with it overall and over the last band.
+        double done = 0, predicted = 0, scale = 0;
+        for (int y = row - 1; y >= 0; y--) {
+            done += row_costs[y];
+            predicted += last_row_costs[y];
+            if (y == band.y0 || y == 0) {
+                scale = std::max(scale, predicted > 0 ? done / predicted : 1);
+            }
+        }
+        double estimate = 0;
+        int y = row;
+        while (y < pass.height && y - row < 2*last && estimate + scale*last_row_costs[y] <= band_seconds) {
+            estimate += scale*last_row_costs[y];
+            y++;
+        }
+        return y - row;
+    }
+
+    bool moved() const {
+        return view->world != world || !same(view->eye.v, eye.v) || !same(view->frame.right, frame.right)
+            || !same(view->frame.up, frame.up) || !same(view->frame.forward, frame.forward);
+    }
+
+public:
+    // `view` holds the camera and world, and its size is the full
+    // resolution; its quality settings are replaced by the stages'.
+    Progressive(const RenderInfo* view, double band_seconds = 0.05)
+        : view(view), band_seconds(band_seconds), motion_scale(Real(0.5)), motion_cast_limit(8),
+          pass(*view), stage(0), row(0), band(0, 0, 0, 0), row_seconds(0),
+          done_width(0), done_height(0), world(NULL)
+    { }
+
+    // Sets the size, as a fraction of the view's, and cast limit of frames
+    // rendered while the camera moves.
+    void set_motion_quality(Real scale, int cast_limit) {
+        motion_scale = clamp<Real>(scale, 0, 1);
+        motion_cast_limit = cast_limit;
+    }
+
+    // Renders the stages again from the start, as if the view had moved,
+    // for when what's rendered changes rather than the camera.
+    void restart() { world = NULL; }
+
+    // Whether the frame being rendered is a moving camera's, rather than a
+    // refinement of a still one.
+    bool in_motion() const { return stage == 0; }
+
+    // Settings for the frame being rendered, for the renderer and render
+    // target to point at.  Starts out at the full resolution, so buffers
+    // sized from it fit every stage.
+    RenderInfo* pass_info() { return &pass; }
+
+    // Sets up pass_info() and the region to render this frame.  Returns
+    // false if the view hasn't moved since the last stage was finished, and
+    // the last image can be shown again.
+    bool next_pass(Tile* region) {
+        if (moved()) {
+            stage = 0;
+            row = 0;
+            world = view->world;
+            eye = view->eye;
+            frame = view->frame;
+            last_row_costs.clear();
+        }
+        if (stage >= STAGES) { return false; }
+
+        if (row == 0) {
+            const Stage& s = stage_settings(stage);
+            pass = *view;
+            Real scale = stage == 0 ? motion_scale : 1;
+            pass.width = std::max(int(view->width * scale), 1);
+            pass.height = std::max(int(view->height * scale), 1);
+            pass.cast_limit = stage == 0 ? motion_cast_limit : s.cast_limit;
+            pass.anti_alias = false;
+            pass.adaptive_samples = s.adaptive_samples;
+            row_costs.assign(pass.height, 0);
+        }
+
+        int rows = pass.height - row;
+        if (stage > 0 && row > 0) {
+            rows = band_rows();
+        }
+        else if (stage > 0) {
+            rows = FIRST_BAND;
+        }
+        rows = std::min(std::max(rows, 1), pass.height - row);
+        band = Tile(0, row, pass.width, row + rows);
+        *region = band;
+        return true;
+    }
+
+    // Reports how long the region from next_pass took to render.  Returns
+    // whether the buffer now holds an image to show.  A band can be shown
+    // over the previous stage only at the same size; otherwise the last
+    // image shown stays up until the whole stage is done.
+    bool pass_done(double seconds) {
+        row_seconds = std::max(seconds, 1e-6) / (band.y1 - band.y0);
+        for (int y = band.y0; y < band.y1; y++) {
+            row_costs[y] = row_seconds;
+        }
+        row = band.y1;
+        bool show = stage == 0 || (pass.width == done_width && pass.height == done_height);
+        if (row >= pass.height) {
+            stage++;
+            row = 0;
+            done_width = pass.width;
+            done_height = pass.height;
+            if (stage > 1) {
+                last_row_costs.swap(row_costs);
+            }
+            show = true;
+        }
+        return show;
+    }
+};
+
+#endif
@@ -1,20 +1,122 @@
 #ifndef __RENDER_H__
 #define __RENDER_H__
 
-#include "SDL.h"
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdlib>
+#include "Thread.h"
 #include "Shapes/Shape.h"
 #include "Vec.h"
 #include "Point.h"
-#include "Image.h"
+#include "Skybox.h"
 #include "Frame.h"
+#include "Color.h"
 
-const double PI = 3.14159265358979323846264338327950288;
+// Minimum cosine between a packet's rays and their mean direction for the
+// packet to be traced as a whole.
+const Real PACKET_COHERENCE = Real(0.99);
 
 struct World {
-    Image* skybox;
+    Skybox* skybox;
     Shape* scene;
 };
 
+// Counters a render thread keeps while tracing.  Each ThreadedRenderer
+// worker traces with its own, and the renderer sums them after a frame.
+struct TraceStats {
+    // How a traced ray ended.
+    enum Ending { ESCAPED, FOOTPRINT, CAST_LIMIT };
+
+    // Rays by the number of portals they went through, and how many of
+    // them ended at a portal too small for their footprint, or were still
+    // going at cast_limit.
+    std::vector<long> depths;
+    long footprint_ended;
+    long cast_limited;
+    // Of those, rays whose colour was reused from an earlier frame (see
+    // ReprojectionCache), counted at the depth and ending they were traced
+    // to, but not cast past their first portal or looked up again.
+    long reused;
+    // Scene casts, and the portals they hit: curved ones (spheres) and
+    // flat ones (planes).
+    long casts;
+    long curved_portals, flat_portals;
+    ShapeCounters shapes;
+
+    TraceStats() { clear(); }
+
+    void clear() {
+        depths.clear();
+        footprint_ended = cast_limited = reused = 0;
+        casts = curved_portals = flat_portals = 0;
+        shapes = ShapeCounters();
+    }
+
+    // Counts a cast of a ray against a world's scene.
+    void cast(const RayHit& hit) {
+        casts++;
+        if (hit.type == RayHit::TYPE_PORTAL) {
+            if (hit.portal.curvature != 0) { curved_portals++; }
+            else { flat_portals++; }
+        }
+    }
+
+    // Counts a finished ray.
+    void record(int depth, Ending ending) {
+        if (depth >= int(depths.size())) { depths.resize(depth+1, 0); }
+        depths[depth]++;
+        if (ending == FOOTPRINT) { footprint_ended++; }
+        else if (ending == CAST_LIMIT) { cast_limited++; }
+    }
+
+    // Counts a ray whose colour was reused, as traced earlier.
+    void record_reused(int depth, Ending ending) {
+        record(depth, ending);
+        reused++;
+    }
+
+    void add(const TraceStats& other) {
+        if (other.depths.size() > depths.size()) { depths.resize(other.depths.size(), 0); }
+        for (size_t i = 0; i < other.depths.size(); i++) {
+            depths[i] += other.depths[i];
+        }
+        footprint_ended += other.footprint_ended;
+        cast_limited += other.cast_limited;
+        reused += other.reused;
+        casts += other.casts;
+        curved_portals += other.curved_portals;
+        flat_portals += other.flat_portals;
+        shapes.box_tests += other.shapes.box_tests;
+        shapes.box_rejections += other.shapes.box_rejections;
+        shapes.shape_tests += other.shapes.shape_tests;
+    }
+
+    // Primary rays traced.
+    long rays() const {
+        long total = 0;
+        for (size_t i = 0; i < depths.size(); i++) { total += depths[i]; }
+        return total;
+    }
+
+    // Every traced ray ends in one skybox lookup, but for reused ones.
+    long skybox_lookups() const { return rays() - reused; }
+
+    // Mean number of portals rays went through.
+    double mean_depth() const {
+        long total = 0;
+        for (size_t i = 0; i < depths.size(); i++) { total += i * depths[i]; }
+        return double(total) / std::max(rays(), 1L);
+    }
+
+    int max_depth() const {
+        for (int i = int(depths.size()) - 1; i >= 0; i--) {
+            if (depths[i]) { return i; }
+        }
+        return 0;
+    }
+};
+
 struct RenderInfo {
     World* world;
     Point eye;
@@ -22,39 +124,116 @@ struct RenderInfo {
     int width, height, bpp;
     int cast_limit;
     bool anti_alias;
+    // Rays traced together through packet_cast; 0 or 1 traces rays singly.
+    int packet_size;
+    // Adaptive anti-aliasing: pixels are first sampled at their corners,
+    // and those whose corners differ get up to this many more rays.  0
+    // leaves anti_alias's fixed 4 rays per pixel.
+    int adaptive_samples;
+    // Largest difference in any colour channel between a pixel's corners
+    // that leaves it unrefined.
+    Real adaptive_threshold;
+    // Rays end at portals narrower than this fraction of their footprint,
+    // rather than only at cast_limit.  0 follows every ray to cast_limit.
+    Real portal_cutoff;
+    // Where the tracing thread counts its rays, if anywhere.
+    TraceStats* stats;
+
+    RenderInfo()
+        : world(NULL), width(0), height(0), bpp(3), cast_limit(12),
+          anti_alias(false), packet_size(0), adaptive_samples(0),
+          adaptive_threshold(Real(0.1)), portal_cutoff(Real(0.25)), stats(NULL)
+    { }
+
+    // Angle between neighbouring primary rays at the centre of the view,
+    // which sets the skybox filter width.
+    Real sample_angle() const {
+        return Real(2.0/width / (adaptive_samples > 0 || anti_alias ? 2 : 1));
+    }
 };
 
 struct PixelBuffer {
     unsigned char* pixels;
 };
 
-inline Color compute_skybox(const RayCast& cast) {
-    double angle_h = 0.5 + (1/(2*PI)) * atan2(cast.ray.direction.x, cast.ray.direction.z);
-    double angle_p = 0.5 + (1/PI) * asin(-cast.ray.direction.y);
-    return cast.world->skybox->at(angle_h, angle_p);
+// The footprint of a sample's ray: the width of the bundle of rays it stands
+// for at the ray's origin, and the angle the bundle widens by.
+struct RayCone {
+    Real width, spread;
+
+    RayCone() { }
+    RayCone(Real width, Real spread) : width(width), spread(spread) { }
+
+    // Carries the cone `distance` along its ray and through a portal.
+    // Returns the portal's size relative to the cone's width where it's
+    // hit.
+    Real through(const RayHit::Portal& portal, Real distance) {
+        Real w = width + spread*distance;
+        // A convex mirror spreads the bundle by twice the angle its width
+        // subtends at the centre of curvature.
+        spread += 2*w*portal.curvature;
+        width = w*portal.scale;
+        return portal.size / w;
+    }
+};
+
+inline RayCone primary_cone(RenderInfo* info) {
+    return RayCone(0, info->sample_angle());
 }
 
-inline Color single_ray_cast(RenderInfo* info, double xloc, double yloc) {
+// Carries a ray's cone through a portal hit.  Returns false if the ray
+// should end there, in the sky beyond the portal: the portal is a small
+// part of the footprint, so what's through it would average out to about
+// that, blurred by the spread cone anyway.
+inline bool follow_portal(RenderInfo* info, RayCone* cone, const RayHit& hit) {
+    Real relative_size = cone->through(hit.portal, std::sqrt(hit.distance2));
+    return !(relative_size < info->portal_cutoff);
+}
+
+inline Color compute_skybox(const RayCast& cast, const RayCone& cone) {
+    return cast.world->skybox->sample(cast.ray.direction, cone.spread);
+}
+
+inline RayCast primary_cast(RenderInfo* info, double xloc, double yloc) {
     Vec direction = info->frame.forward - info->frame.right + 2*xloc*info->frame.right
                                         - info->frame.up    + 2*yloc*info->frame.up;
     Ray ray(info->eye, direction.unit());
-    RayCast cast(ray, info->world);
+    return RayCast(ray, info->world);
+}
 
-    // consider adaptive ray limit based on distance
-    for (int casts = 0; casts < info->cast_limit; ++casts) {
+// Follows a cast that has already been through `casts` portals, with
+// footprint `cone`, to the skybox.  Also reports, if asked, how many
+// portals the ray went through in all, the world it ended in and how.
+inline Color trace_cast(RenderInfo* info, RayCast cast, int casts, RayCone cone,
+                        int* depth = NULL, World** world = NULL, TraceStats::Ending* ending = NULL) {
+    bool ended = false;
+    for (; casts < info->cast_limit; ++casts) {
         RayHit hit;
         cast.world->scene->ray_cast(cast, &hit);
-        switch (hit.type) {
-            case RayHit::TYPE_MISS: return compute_skybox(cast);
-            case RayHit::TYPE_PORTAL: {
-                cast = hit.portal.new_cast;
-                break;
-            }
-            default: abort(); break;
+        if (info->stats) { info->stats->cast(hit); }
+        if (hit.type == RayHit::TYPE_MISS) { break; }
+        if (hit.type != RayHit::TYPE_PORTAL) { abort(); }
+        cast = hit.portal.new_cast;
+        if (!follow_portal(info, &cone, hit)) {
+            // Through the portal, into the sky beyond it.
+            ended = true;
+            ++casts;
+            break;
         }
     }
-    return compute_skybox(cast);
-};
+    TraceStats::Ending how = ended ? TraceStats::FOOTPRINT
+                           : casts == info->cast_limit ? TraceStats::CAST_LIMIT : TraceStats::ESCAPED;
+    if (depth) { *depth = casts; }
+    if (world) { *world = cast.world; }
+    if (ending) { *ending = how; }
+    if (info->stats) { info->stats->record(casts, how); }
+    return compute_skybox(cast, cone);
+}
+
+inline Color single_ray_cast(RenderInfo* info, double xloc, double yloc,
+                             int* depth = NULL, World** world = NULL) {
+    return trace_cast(info, primary_cast(info, xloc, yloc), 0, primary_cone(info), depth, world);
+}
 
 inline Color global_ray_cast(RenderInfo* info, int px, int py) {
     double epsx = 1.0/info->width;
@@ -72,176 +251,573 @@ inline Color global_ray_cast(RenderInfo* info, int px, int py) {
     }
 }
 
+// Whether a packet's rays point roughly the same way, so they will mostly
+// visit the same nodes.  Rays scattered by curved portals fail this and are
+// cheaper to trace one at a time.
+inline bool packet_coherent(const RayPacket& packet) {
+    Vec mean;
+    for (int i = 0; i < packet.size; i++) {
+        mean += Vec(packet.dx[i], packet.dy[i], packet.dz[i]).unit();
+    }
+    mean = mean.unit();
+    for (int i = 0; i < packet.size; i++) {
+        Vec d(packet.dx[i], packet.dy[i], packet.dz[i]);
+        if (d * mean < PACKET_COHERENCE * d.norm()) { return false; }
+    }
+    return true;
+}
+
+// Traces up to MAX_PACKET primary casts together, with the same results as
+// calling single_ray_cast on each.  At every step the live rays are grouped by the
+// world they're in, so a packet splits as its rays go through different
+// portals; each coherent group is cast as one packet, and each lane's
+// winning primitive is then recast on its own to follow the portal.
+// depths and worlds, if given, are filled in as by single_ray_cast.
+inline void packet_ray_cast(RenderInfo* info, RayCast* casts, int count, Color* out,
+                            int* depths = NULL, World** worlds = NULL) {
+    bool done[MAX_PACKET];
+    for (int i = 0; i < count; i++) { done[i] = false; }
+
+    RayPacket packet;
+    PacketHit packet_hit;
+    int lanes[MAX_PACKET];
+    int finished[MAX_PACKET];
+    Vec directions[MAX_PACKET];
+    Real footprints[MAX_PACKET];
+    Color sky[MAX_PACKET];
+    RayCone cones[MAX_PACKET];
+    for (int i = 0; i < count; i++) { cones[i] = primary_cone(info); }
+    int remaining = count;
+    for (int step = 0; step < info->cast_limit && remaining > 0; ++step) {
+        bool grouped[MAX_PACKET];
+        for (int i = 0; i < count; i++) { grouped[i] = done[i]; }
+
+        for (int i = 0; i < count; i++) {
+            if (grouped[i]) { continue; }
+            World* world = casts[i].world;
+            packet.size = 0;
+            for (int j = i; j < count; j++) {
+                if (!grouped[j] && casts[j].world == world) {
+                    grouped[j] = true;
+                    lanes[packet.size] = j;
+                    packet.set(packet.size++, casts[j].ray);
+                }
+            }
+
+            int sky_count = 0;
+            bool coherent = packet.size > 1 && packet_coherent(packet);
+            if (coherent) {
+                packet_hit.clear(packet.size);
+                world->scene->packet_cast(packet, (1u << packet.size) - 1, &packet_hit);
+            }
+
+            for (int k = 0; k < packet.size; k++) {
+                int j = lanes[k];
+                RayHit hit;
+                hit.type = RayHit::TYPE_MISS;
+                if (!coherent) {
+                    world->scene->ray_cast(casts[j], &hit);
+                }
+                else if (packet_hit.shape[k]) {
+                    packet_hit.shape[k]->ray_cast(casts[j], &hit);
+                }
+                if (info->stats) { info->stats->cast(hit); }
+                if (hit.type == RayHit::TYPE_PORTAL) {
+                    casts[j] = hit.portal.new_cast;
+                    if (follow_portal(info, &cones[j], hit)) { continue; }
+                    // Ended in another world's sky, so not batched.
+                    out[j] = compute_skybox(casts[j], cones[j]);
+                }
+                else {
+                    finished[sky_count] = j;
+                    footprints[sky_count] = cones[j].spread;
+                    directions[sky_count++] = casts[j].ray.direction;
+                }
+                // A ray ended by its footprint went through this portal too.
+                bool through = hit.type == RayHit::TYPE_PORTAL;
+                if (depths) { depths[j] = step + through; }
+                if (info->stats) {
+                    info->stats->record(step + through, through ? TraceStats::FOOTPRINT : TraceStats::ESCAPED);
+                }
+                done[j] = true;
+                remaining--;
+            }
+
+            // The group shares a world, so its escaped rays share a skybox.
+            world->skybox->sample(directions, footprints, sky_count, sky);
+            for (int k = 0; k < sky_count; k++) {
+                out[finished[k]] = sky[k];
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (!done[i]) {
+            out[i] = compute_skybox(casts[i], cones[i]);
+            if (depths) { depths[i] = info->cast_limit; }
+            if (info->stats) { info->stats->record(info->cast_limit, TraceStats::CAST_LIMIT); }
+        }
+        if (worlds) { worlds[i] = casts[i].world; }
+    }
+}
+
 class BufRenderer {
 public:
     virtual ~BufRenderer() { }
     virtual void render(PixelBuffer buffer) = 0;
 };
 
+// A rectangle of pixels [x0,x1) x [y0,y1) in buffer coordinates (row 0 at top).
+struct Tile {
+    int x0, y0, x1, y1;
+    Tile() { }
+    Tile(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) { }
+};
+
+// The tile renderers return the number of primary rays they traced.
+inline long render_tile_scalar(RenderInfo* info, PixelBuffer buffer, const Tile& tile) {
+    // Row-major within the tile, so consecutive pixels are adjacent in memory.
+    for (int y = tile.y0; y < tile.y1; y++) {
+        unsigned char* p = buffer.pixels + info->bpp*(tile.x0+info->width*y);
+        for (int x = tile.x0; x < tile.x1; x++) {
+            Color c = global_ray_cast(info, x, info->height-y);
+            c.to_bytes(p, p+1, p+2);
+            p += info->bpp;
+        }
+    }
+    return long(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * (info->anti_alias ? 4 : 1);
+}
+
+// Traces the tile in blocks of info->packet_size neighbouring pixels (4x4,
+// 4x2 or 2x2), one packet per anti-aliasing subsample.
+inline long render_tile_packets(RenderInfo* info, PixelBuffer buffer, const Tile& tile) {
+    int size = std::min(info->packet_size, MAX_PACKET);
+    int block_w = size >= 8 ? 4 : size >= 4 ? 2 : 1;
+    int block_h = size / block_w;
+
+    double epsx = 1.0/info->width;
+    double epsy = 1.0/info->height;
+    const double offsets[4][2] = { { -0.25, -0.25 }, { -0.25, 0.25 }, { 0.25, -0.25 }, { 0.25, 0.25 } };
+    int samples = info->anti_alias ? 4 : 1;
+
+    RayCast casts[MAX_PACKET];
+    Color colors[MAX_PACKET];
+    int xs[MAX_PACKET], ys[MAX_PACKET];
+    for (int by = tile.y0; by < tile.y1; by += block_h) {
+        for (int bx = tile.x0; bx < tile.x1; bx += block_w) {
+            int count = 0;
+            for (int y = by; y < std::min(by + block_h, tile.y1); y++) {
+                for (int x = bx; x < std::min(bx + block_w, tile.x1); x++) {
+                    xs[count] = x;
+                    ys[count] = y;
+                    count++;
+                }
+            }
+
+            Color sums[MAX_PACKET];
+            for (int s = 0; s < samples; s++) {
+                for (int i = 0; i < count; i++) {
+                    double xloc = epsx*xs[i];
+                    double yloc = epsy*(info->height - ys[i]);
+                    if (info->anti_alias) {
+                        xloc += offsets[s][0]*epsx;
+                        yloc += offsets[s][1]*epsy;
+                    }
+                    casts[i] = primary_cast(info, xloc, yloc);
+                }
+                packet_ray_cast(info, casts, count, colors);
+                for (int i = 0; i < count; i++) {
+                    sums[i] = s == 0 ? colors[i] : sums[i] + colors[i];
+                }
+            }
+
+            for (int i = 0; i < count; i++) {
+                Color c = info->anti_alias ? 0.25 * sums[i] : sums[i];
+                unsigned char* p = buffer.pixels + info->bpp*(xs[i]+info->width*ys[i]);
+                c.to_bytes(p, p+1, p+2);
+            }
+        }
+    }
+    return long(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samples;
+}
+
+// One traced primary ray, with what adaptive anti-aliasing compares.
+struct Sample {
+    Color color;
+    int depth;
+    World* world;
+};
+
+// Traces rays through the given screen positions (in pixels, y up), in
+// packets when info->packet_size allows.
+inline void trace_samples(RenderInfo* info, const double* xs, const double* ys, int count, Sample* out) {
+    double epsx = 1.0/info->width;
+    double epsy = 1.0/info->height;
+    if (info->packet_size <= 1) {
+        for (int i = 0; i < count; i++) {
+            out[i].color = single_ray_cast(info, epsx*xs[i], epsy*ys[i], &out[i].depth, &out[i].world);
+        }
+        return;
+    }
+    int size = std::min(info->packet_size, MAX_PACKET);
+    RayCast casts[MAX_PACKET];
+    Color colors[MAX_PACKET];
+    int depths[MAX_PACKET];
+    World* worlds[MAX_PACKET];
+    for (int begin = 0; begin < count; begin += size) {
+        int n = std::min(size, count - begin);
+        for (int i = 0; i < n; i++) {
+            casts[i] = primary_cast(info, epsx*xs[begin+i], epsy*ys[begin+i]);
+        }
+        packet_ray_cast(info, casts, n, colors, depths, worlds);
+        for (int i = 0; i < n; i++) {
+            out[begin+i].color = colors[i];
+            out[begin+i].depth = depths[i];
+            out[begin+i].world = worlds[i];
+        }
+    }
+}
+
+// Whether the samples at a pixel's corners disagree enough to refine it.
+inline bool samples_differ(const Sample* corners[4], Real threshold) {
+    Real lo[3], hi[3];
+    for (int i = 0; i < 4; i++) {
+        const Color& c = corners[i]->color;
+        Real rgb[3] = { c.red, c.green, c.blue };
+        for (int k = 0; k < 3; k++) {
+            lo[k] = i == 0 || rgb[k] < lo[k] ? rgb[k] : lo[k];
+            hi[k] = i == 0 || rgb[k] > hi[k] ? rgb[k] : hi[k];
+        }
+        if (corners[i]->depth != corners[0]->depth || corners[i]->world != corners[0]->world) {
+            return true;
+        }
+    }
+    return hi[0] - lo[0] > threshold || hi[1] - lo[1] > threshold || hi[2] - lo[2] > threshold;
+}
+
+// Deterministic jitter in [0,1) for sample k of a pixel, so the image
+// doesn't depend on how tiles are split between threads.
+inline double stratum_jitter(int x, int y, int k) {
+    unsigned h = unsigned(x)*73856093u ^ unsigned(y)*19349663u ^ unsigned(k)*83492791u;
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return (h >> 8) / double(1 << 24);
+}
+
+// Adaptive anti-aliasing.  Rays go through the corners of every pixel,
+// each shared by up to four pixels, and a pixel whose corners differ in
+// colour, portal depth or final world gets info->adaptive_samples more
+// rays on a jittered grid.  Other pixels are the mean of their corners.
+inline long render_tile_adaptive(RenderInfo* info, PixelBuffer buffer, const Tile& tile) {
+    int tw = tile.x1 - tile.x0, th = tile.y1 - tile.y0;
+    int cw = tw + 1, ch = th + 1;
+
+    std::vector<double> xs, ys;
+    xs.reserve(cw*ch);
+    ys.reserve(cw*ch);
+    for (int j = 0; j < ch; j++) {
+        for (int i = 0; i < cw; i++) {
+            xs.push_back(tile.x0 + i - 0.5);
+            ys.push_back(info->height - (tile.y0 + j) + 0.5);
+        }
+    }
+    std::vector<Sample> corners(cw*ch);
+    trace_samples(info, &xs[0], &ys[0], cw*ch, &corners[0]);
+    long rays = cw*ch;
+
+    int strata = 1;
+    while ((strata+1)*(strata+1) <= info->adaptive_samples) { strata++; }
+    int per_pixel = strata*strata;
+
+    std::vector<int> refined;
+    xs.clear();
+    ys.clear();
+    for (int y = 0; y < th; y++) {
+        for (int x = 0; x < tw; x++) {
+            const Sample* c[4] = { &corners[y*cw + x], &corners[y*cw + x+1],
+                                   &corners[(y+1)*cw + x], &corners[(y+1)*cw + x+1] };
+            Color color = Real(0.25) * (c[0]->color + c[1]->color + c[2]->color + c[3]->color);
+            unsigned char* p = buffer.pixels + info->bpp*(tile.x0+x + info->width*(tile.y0+y));
+            color.to_bytes(p, p+1, p+2);
+            if (!samples_differ(c, info->adaptive_threshold)) { continue; }
+
+            int px = tile.x0 + x, py = tile.y0 + y;
+            refined.push_back(y*tw + x);
+            for (int k = 0; k < per_pixel; k++) {
+                double sx = (k % strata + stratum_jitter(px, py, 2*k)) / strata;
+                double sy = (k / strata + stratum_jitter(px, py, 2*k+1)) / strata;
+                xs.push_back(px - 0.5 + sx);
+                ys.push_back(info->height - py + 0.5 - sy);
+            }
+        }
+    }
+    if (refined.empty()) { return rays; }
+
+    std::vector<Sample> samples(xs.size());
+    trace_samples(info, &xs[0], &ys[0], xs.size(), &samples[0]);
+    rays += samples.size();
+
+    Real scale = Real(1) / (4 + per_pixel);
+    for (size_t r = 0; r < refined.size(); r++) {
+        int x = refined[r] % tw, y = refined[r] / tw;
+        Color sum = corners[y*cw + x].color + corners[y*cw + x+1].color
+                  + corners[(y+1)*cw + x].color + corners[(y+1)*cw + x+1].color;
+        for (int k = 0; k < per_pixel; k++) {
+            sum = sum + samples[r*per_pixel + k].color;
+        }
+        Color color = scale * sum;
+        unsigned char* p = buffer.pixels + info->bpp*(tile.x0+x + info->width*(tile.y0+y));
+        color.to_bytes(p, p+1, p+2);
+    }
+    return rays;
+}
+
+inline long render_tile(RenderInfo* info, PixelBuffer buffer, const Tile& tile) {
+    if (info->adaptive_samples > 0) {
+        return render_tile_adaptive(info, buffer, tile);
+    }
+    else if (info->packet_size > 1) {
+        return render_tile_packets(info, buffer, tile);
+    }
+    else {
+        return render_tile_scalar(info, buffer, tile);
+    }
+}
+
+// Renders the tiles of a frame in place of render_tile, for renderers that
+// keep state between frames or work over the whole frame.  begin_frame and
+// end_frame are called on the thread calling ThreadedRenderer::render,
+// before and after the region's tiles; render_tile is called for the tiles
+// concurrently.
+class TileRenderer {
+public:
+    virtual ~TileRenderer() { }
+    virtual void begin_frame(RenderInfo* info, const Tile& region) { }
+    virtual long render_tile(RenderInfo* info, PixelBuffer buffer, const Tile& tile) = 0;
+    virtual void end_frame(RenderInfo* info, PixelBuffer buffer, const Tile& region) { }
+};
+
+// Splits a region of the frame into tile_size x tile_size tiles (smaller at
+// the edges), in row-major tile order.
+inline void make_tiles(const Tile& region, int tile_size, std::vector<Tile>* tiles) {
+    tiles->clear();
+    for (int y = region.y0; y < region.y1; y += tile_size) {
+        for (int x = region.x0; x < region.x1; x += tile_size) {
+            tiles->push_back(Tile(x, y, std::min(x+tile_size, region.x1), std::min(y+tile_size, region.y1)));
+        }
+    }
+}
+
+// A worker's share of the frame.  The owner takes tiles from the front;
+// idle workers steal from the back, so the owner keeps its spatially
+// coherent run of tiles for as long as possible.
+class TileQueue {
+    Mutex mutex;
+    std::deque<Tile> tiles;
+public:
+    void push(const Tile& tile) {
+        Lock lock(mutex);
+        tiles.push_back(tile);
+    }
+
+    bool pop(Tile* tile) {
+        Lock lock(mutex);
+        if (tiles.empty()) { return false; }
+        *tile = tiles.front();
+        tiles.pop_front();
+        return true;
+    }
+
+    bool steal(Tile* tile) {
+        Lock lock(mutex);
+        if (tiles.empty()) { return false; }
+        *tile = tiles.back();
+        tiles.pop_back();
+        return true;
+    }
+};
+
 class RenderWorker {
     RenderInfo* info;
-    SDL_semaphore* go_mutex;
-    SDL_semaphore* done_mutex;
-    int ystart;
-    int yend;
+    TileRenderer* tile_renderer;
+    std::vector<TileQueue*>* queues;
+    int index;
+    Semaphore go_mutex;
+    Semaphore done_mutex;
     bool done;
+    long rays;
+    TraceStats stats;
 
     PixelBuffer buffer;
 
+    bool next_tile(Tile* tile) {
+        if ((*queues)[index]->pop(tile)) { return true; }
+        int count = queues->size();
+        for (int i = 1; i < count; i++) {
+            if ((*queues)[(index+i) % count]->steal(tile)) { return true; }
+        }
+        return false;
+    }
+
     void worker() {
-        unsigned char* pixels = buffer.pixels;
-        for (int x = 0; x < info->width; x++) {
-            for (int y = ystart; y < yend; y++) {
-                unsigned char* p = pixels + info->bpp*(x+info->width*y);
-                Color c = global_ray_cast(info, x, info->height-y);
-                c.to_bytes(p, p+1, p+2);
-            }
+        // Tiles are only queued before the workers are started, so once
+        // every queue is empty the frame is finished for this worker.
+        // The tiles see a copy of the frame's settings with this worker's
+        // own counters.
+        RenderInfo local = *info;
+        local.stats = &stats;
+        stats.clear();
+        shape_counters() = &stats.shapes;
+        Tile tile;
+        rays = 0;
+        while (next_tile(&tile)) {
+            rays += tile_renderer ? tile_renderer->render_tile(&local, buffer, tile)
+                                  : render_tile(&local, buffer, tile);
         }
+        shape_counters() = NULL;
     }
 
 public:
-    RenderWorker(RenderInfo* info, int ystart, int yend)
-        : info(info), ystart(ystart), yend(yend), done(false)
-    {
-        go_mutex = SDL_CreateSemaphore(0);
-        done_mutex = SDL_CreateSemaphore(0);
-    }
+    RenderWorker(RenderInfo* info, TileRenderer* tile_renderer, std::vector<TileQueue*>* queues, int index)
+        : info(info), tile_renderer(tile_renderer), queues(queues), index(index), done(false), rays(0)
+    { }
 
-    ~RenderWorker() {
-        SDL_DestroySemaphore(go_mutex);
-        SDL_DestroySemaphore(done_mutex);
-    }
+    // Primary rays traced in the last frame.
+    long primary_rays() const { return rays; }
+
+    void set_tile_renderer(TileRenderer* renderer) { tile_renderer = renderer; }
+
+    // What the rays traced in the last frame did.
+    const TraceStats& trace_stats() const { return stats; }
 
     static int worker_callback(void* data) {
         RenderWorker* worker = (RenderWorker*)data;
         while (true) {
-            SDL_SemWait(worker->go_mutex);
-            if (worker->done) { SDL_SemPost(worker->done_mutex); break; }
+            worker->go_mutex.wait();
+            if (worker->done) { worker->done_mutex.post(); break; }
             worker->worker();
-            SDL_SemPost(worker->done_mutex);
+            worker->done_mutex.post();
         }
         return 0;
     }
 
     void finish() {
         done = true;
-        SDL_SemPost(go_mutex);
-        SDL_SemWait(done_mutex);
+        go_mutex.post();
+        done_mutex.wait();
     }
 
     void start_render(PixelBuffer buffer) {
         this->buffer = buffer;
-        SDL_SemPost(go_mutex);
+        go_mutex.post();
     }
 
     void wait() {
-        SDL_SemWait(done_mutex);
+        done_mutex.wait();
     }
 
     void fork() {
-        SDL_CreateThread(worker_callback, this);
-    }
-
-    // render without forking a thread.
-    void render_synch(PixelBuffer buffer) {
-        this->buffer = buffer;
-        worker();
+        spawn_thread(worker_callback, this);
     }
 };
 
+// Renders with a pool of threads.  The frame is cut into tiles which are
+// dealt out in contiguous runs to per-worker queues; workers that run out
+// steal from the others, so expensive regions (deep portal chains) don't
+// leave the rest of the pool idle.
 class ThreadedRenderer : public BufRenderer {
+    RenderInfo* info;
+    int tile_size;
+    TileRenderer* tile_renderer;
+    std::vector<TileQueue*> queues;
     std::vector<RenderWorker*> workers;
+    std::vector<Tile> tiles;
 public:
     ~ThreadedRenderer() {
         for (std::vector<RenderWorker*>::iterator i = workers.begin(); i != workers.end(); ++i) {
             (*i)->finish();  // serial blocking termination -- can be done in parallel
             delete *i;
         }
+        for (std::vector<TileQueue*>::iterator i = queues.begin(); i != queues.end(); ++i) {
+            delete *i;
+        }
     }
-    ThreadedRenderer(RenderInfo* info, int threads) {
+    // Tiles are rendered by tile_renderer if given, and by render_tile
+    // otherwise.
+    ThreadedRenderer(RenderInfo* info, int threads, int tile_size = 32, TileRenderer* tile_renderer = NULL)
+        : info(info), tile_size(tile_size), tile_renderer(tile_renderer)
+    {
+        for (int t = 0; t < threads; t++) {
+            queues.push_back(new TileQueue);
+        }
         for (int t = 0; t < threads; t++) {
-            RenderWorker* worker = new RenderWorker(
-                info,
-                t*info->height/threads,
-                (t+1)*info->height/threads);
+            RenderWorker* worker = new RenderWorker(info, tile_renderer, &queues, t);
             worker->fork();
             workers.push_back(worker);
         }
     }
     void render(PixelBuffer buffer) {
+        render_region(buffer, Tile(0, 0, info->width, info->height));
+    }
+
+    // Changes what renders the tiles from the next frame on; NULL is
+    // render_tile.
+    void set_tile_renderer(TileRenderer* renderer) {
+        tile_renderer = renderer;
+        for (std::vector<RenderWorker*>::iterator i = workers.begin(); i != workers.end(); ++i) {
+            (*i)->set_tile_renderer(renderer);
+        }
+    }
+
+    // Renders only part of the frame, leaving the rest of the buffer as it
+    // was.
+    void render_region(PixelBuffer buffer, const Tile& region) {
+        // Tiles are rebuilt each frame, so info->width and height may change
+        // between frames (up to the size of the buffer).
+        make_tiles(region, tile_size, &tiles);
+        if (tile_renderer) { tile_renderer->begin_frame(info, region); }
+        int count = queues.size();
+        for (int t = 0; t < count; t++) {
+            int begin = t*tiles.size()/count;
+            int end = (t+1)*tiles.size()/count;
+            for (int i = begin; i < end; i++) {
+                queues[t]->push(tiles[i]);
+            }
+        }
         for (std::vector<RenderWorker*>::iterator i = workers.begin(); i != workers.end(); ++i) {
             (*i)->start_render(buffer);
         }
         for (std::vector<RenderWorker*>::iterator i = workers.begin(); i != workers.end(); ++i) {
             (*i)->wait();
         }
+        if (tile_renderer) { tile_renderer->end_frame(info, buffer, region); }
     }
-};
 
-class SerialRenderer : public BufRenderer {
-    RenderWorker worker;
-public:
-    SerialRenderer(RenderInfo* info) : worker(info, 0, info->height) { }
-    void render(PixelBuffer buffer) {
-        worker.render_synch(buffer);
+    // Primary rays traced in the last frame, over all workers.
+    long primary_rays() const {
+        long total = 0;
+        for (std::vector<RenderWorker*>::const_iterator i = workers.begin(); i != workers.end(); ++i) {
+            total += (*i)->primary_rays();
+        }
+        return total;
     }
-};
-
-inline void render_sdl(SDL_Surface* surface, BufRenderer* buf_renderer) {
-    PixelBuffer buffer;
-    buffer.pixels = (unsigned char*)surface->pixels;
-
-    SDL_LockSurface(surface);
-    buf_renderer->render(buffer);
-    SDL_UnlockSurface(surface);
-}
 
+    // What the rays traced in the last frame did, over all workers.
+    TraceStats trace_stats() const {
+        TraceStats total;
+        for (std::vector<RenderWorker*>::const_iterator i = workers.begin(); i != workers.end(); ++i) {
+            total.add((*i)->trace_stats());
+        }
+        return total;
+    }
+};
 
-class OpenGLTextureTarget {
+class SerialRenderer : public BufRenderer {
     RenderInfo* info;
-    GLuint tex_id;
-    PixelBuffer buffer;
 public:
-    OpenGLTextureTarget(RenderInfo* info) : info(info) {
-        glGenTextures(1, &tex_id);
-        buffer.pixels = new unsigned char [info->bpp*info->width*info->height];
-    }
-    ~OpenGLTextureTarget() {
-        delete buffer.pixels;
-        glDeleteTextures(1, &tex_id);
-    }
-
-    void render(BufRenderer* buf_renderer) {
-        buf_renderer->render(buffer);
-    };
-
-    PixelBuffer get_buffer() const { return buffer; }
-
-    void prepare() {
-        glBindTexture(GL_TEXTURE_2D, tex_id);
-        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, info->width, info->height,
-                     0, GL_RGB, GL_UNSIGNED_BYTE, buffer.pixels);
-    }
-
-    void draw(double alpha = 1) {
-        glBindTexture(GL_TEXTURE_2D, tex_id);
-        glColor4d(1,1,1,alpha);
-        glBegin(GL_QUADS);
-            glTexCoord2f(0, 0);
-            glVertex2f(-1, 1);
-            glTexCoord2f(1, 0);
-            glVertex2f(1, 1);
-            glTexCoord2f(1, 1);
-            glVertex2f(1, -1);
-            glTexCoord2f(0, 1);
-            glVertex2f(-1, -1);
-        glEnd();
+    SerialRenderer(RenderInfo* info) : info(info) { }
+    void render(PixelBuffer buffer) {
+        render_tile(info, buffer, Tile(0, 0, info->width, info->height));
     }
 };
 
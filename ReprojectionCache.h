@@ -0,0 +1,177 @@
+#ifndef __REPROJECTIONCACHE_H__
+#define __REPROJECTIONCACHE_H__
+
+#include <vector>
+#include <algorithm>
+#include "Render.h"
+
+// Reuses the previous frame's rays while the camera moves a little.  Each
+// pixel remembers where its primary ray first hit a portal and the ray that
+// came out the other side.  On the next frame those hit points are projected
+// under the new eye and frame, and every pixel casts its first segment as
+// usual; if that leaves the portal within a pixel's footprint of a
+// remembered ray, in nearly the same direction, the remembered colour is
+// reused instead of following the rest of the portal path.  Pixels with no
+// match (disoccluded, or the path changed) are traced in full.
+//
+// Only plain one-ray-per-pixel frames of the whole view use the cache; other
+// frames are passed to render_tile and drop the history.  It pays off for
+// turning on the spot, but walking rarely matches and costs a few percent,
+// so the game only uses it with --reproject.
+class ReprojectionCache : public TileRenderer {
+    struct Sample {
+        bool valid;             // the primary ray went through a portal
+        int age;                // frames the colour has been reused
+        Point hit;              // first hit, in the eye's world
+        Ray out;                // the ray leaving that portal
+        World* out_world;
+        Color color;
+        // How far the traced ray went, counted again when it's reused.
+        int depth;
+        TraceStats::Ending ending;
+    };
+
+    // Reused colours are retraced after this many frames, so errors can't
+    // build up.
+    static const int MAX_AGE = 8;
+
+    std::vector<Sample> history, current;
+    std::vector<int> sources;   // per pixel, the history sample landing there
+    std::vector<Real> depths;
+
+    bool active;
+    World* world;
+    int width, height, cast_limit;
+    Mutex reused_mutex;
+    long reused;
+
+    // Projects the history's hit points into the new view, keeping the
+    // nearest where several land on one pixel.
+    void reproject(RenderInfo* info) {
+        sources.assign(info->width*info->height, -1);
+        depths.assign(info->width*info->height, Real(HUGE_VAL));
+        const Frame& frame = info->frame;
+        for (size_t i = 0; i < history.size(); i++) {
+            const Sample& s = history[i];
+            if (!s.valid) { continue; }
+            Vec v = s.hit - info->eye;
+            Real z = v * frame.forward;
+            if (!(z > 0)) { continue; }
+            // Inverse of primary_cast.
+            double xloc = 0.5*((v * frame.right)/z + 1);
+            double yloc = 0.5*((v * frame.up)/z + 1);
+            int x = int(std::floor(xloc*info->width + 0.5));
+            int y = info->height - int(std::floor(yloc*info->height + 0.5));
+            if (x < 0 || x >= info->width || y < 0 || y >= info->height) { continue; }
+            int p = y*info->width + x;
+            if (z < depths[p]) {
+                depths[p] = z;
+                sources[p] = i;
+            }
+        }
+    }
+
+    static bool close(const Sample& s, const RayCast& out, Real tolerance, Real angle) {
+        return s.out_world == out.world
+            && (s.out.origin - out.ray.origin).norm2() <= tolerance*tolerance
+            && (s.out.direction.unit() - out.ray.direction.unit()).norm2() <= angle*angle;
+    }
+
+public:
+    ReprojectionCache()
+        : active(false), world(NULL), width(0), height(0), cast_limit(0), reused(0)
+    { }
+
+    // Drops the history, e.g. when the eye jumps through a portal.
+    void invalidate() {
+        history.clear();
+    }
+
+    // Pixels whose colour was reused in the last frame.
+    long reused_pixels() const { return reused; }
+
+    void begin_frame(RenderInfo* info, const Tile& region) {
+        active = region.x0 == 0 && region.y0 == 0 && region.x1 == info->width && region.y1 == info->height
+              && !info->anti_alias && info->adaptive_samples == 0;
+        reused = 0;
+        if (!active || info->world != world || info->width != width || info->height != height
+                || info->cast_limit != cast_limit) {
+            invalidate();
+        }
+        if (!active) { return; }
+        reproject(info);
+        current.resize(info->width*info->height);
+    }
+
+    long render_tile(RenderInfo* info, PixelBuffer buffer, const Tile& tile) {
+        if (!active) { return ::render_tile(info, buffer, tile); }
+
+        double epsx = 1.0/info->width;
+        double epsy = 1.0/info->height;
+        Real angle = info->sample_angle();
+        long tile_reused = 0;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            unsigned char* p = buffer.pixels + info->bpp*(tile.x0+info->width*y);
+            for (int x = tile.x0; x < tile.x1; x++) {
+                int index = y*info->width + x;
+                Sample& sample = current[index];
+                RayCast cast = primary_cast(info, epsx*x, epsy*(info->height-y));
+                RayHit hit;
+                cast.world->scene->ray_cast(cast, &hit);
+                if (info->stats) { info->stats->cast(hit); }
+                RayCone cone = primary_cone(info);
+                if (hit.type == RayHit::TYPE_MISS) {
+                    sample.valid = false;
+                    sample.color = compute_skybox(cast, cone);
+                    if (info->stats) { info->stats->record(0, TraceStats::ESCAPED); }
+                }
+                else if (hit.type != RayHit::TYPE_PORTAL) {
+                    abort();
+                }
+                else if (!follow_portal(info, &cone, hit)) {
+                    sample.valid = false;
+                    sample.color = compute_skybox(hit.portal.new_cast, cone);
+                    if (info->stats) { info->stats->record(1, TraceStats::FOOTPRINT); }
+                }
+                else {
+                    const RayCast& out = hit.portal.new_cast;
+                    int source = sources[index];
+                    Real tolerance = angle * std::sqrt(hit.distance2);
+                    if (source >= 0 && history[source].age < MAX_AGE
+                            && close(history[source], out, tolerance, angle)) {
+                        // Keep the traced ray, so later frames are compared
+                        // against it rather than against this approximation.
+                        sample = history[source];
+                        sample.age++;
+                        tile_reused++;
+                        if (info->stats) { info->stats->record_reused(sample.depth, sample.ending); }
+                    }
+                    else {
+                        sample.valid = true;
+                        sample.age = 0;
+                        sample.hit = cast.ray.origin + std::sqrt(hit.distance2 / cast.ray.direction.norm2()) * cast.ray.direction;
+                        sample.out = out.ray;
+                        sample.out_world = out.world;
+                        sample.color = trace_cast(info, out, 1, cone, &sample.depth, NULL, &sample.ending);
+                    }
+                }
+                sample.color.to_bytes(p, p+1, p+2);
+                p += info->bpp;
+            }
+        }
+        Lock lock(reused_mutex);
+        reused += tile_reused;
+        return long(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    }
+
+    void end_frame(RenderInfo* info, PixelBuffer buffer, const Tile& region) {
+        if (!active) { return; }
+        history.swap(current);
+        world = info->world;
+        width = info->width;
+        height = info->height;
+        cast_limit = info->cast_limit;
+    }
+};
+
+#endif
@@ -0,0 +1,393 @@
+#ifndef __SCENECACHE_H__
+#define __SCENECACHE_H__
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdint.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "Render.h"
+#include "Skybox.h"
+#include "SceneFile.h"
+#include "Shapes/CompiledScene.h"
+
+// A compiled scene saved next to its scene file, so later runs start without
+// parsing the scene, building its BVHs or decoding its skybox images.  The
+// file is the compiled scene's arrays and the skyboxes' texels, each
+// section 16-byte aligned, and is mapped and used in place.  It records the
+// files it was built from with a hash of each, and is rebuilt when any of
+// them changes.  It's only readable on machines like the one that wrote it,
+// and with the same Real.
+
+const uint32_t SCENE_CACHE_VERSION = 2;
+
+// The largest skybox face a cache may hold, which keeps its mip chain's
+// texel count within an int.
+const int MAX_SKYBOX_FACE = 8192;
+
+struct SceneCacheHeader {
+    char magic[8];              // "RTSCENE"
+    uint32_t version;
+    uint32_t byte_order;        // 0x01020304 as written
+    uint32_t real_size, node_size, portal_size;
+    uint32_t source_count, world_count, node_count, portal_count, skybox_count, target_count;
+    // Byte offsets of the sections.
+    uint64_t sources, worlds, world_skyboxes, world_targets, nodes, portals, skyboxes;
+};
+
+struct SceneCacheSource {
+    char path[256];
+    uint64_t size, hash;
+};
+
+struct SceneCacheSkybox {
+    int32_t face_size, pad;
+    uint64_t texels, bytes;
+};
+
+// FNV-1a over a file's bytes.  Returns false if it can't be read.
+inline bool hash_file(const char* path, uint64_t* size, uint64_t* hash) {
+    FILE* file = fopen(path, "rb");
+    if (!file) { return false; }
+    uint64_t h = 14695981039346656037ULL;
+    uint64_t total = 0;
+    unsigned char chunk[65536];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            h = (h ^ chunk[i]) * 1099511628211ULL;
+        }
+        total += count;
+    }
+    fclose(file);
+    *size = total;
+    *hash = h;
+    return true;
+}
+
+// A read-only view of a whole file: mapped where there's mmap, read into
+// memory otherwise.
+class MappedFile {
+    const char* bytes;
+    size_t length;
+    std::vector<char> copy;
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator= (const MappedFile&);
+public:
+    MappedFile() : bytes(NULL), length(0) { }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (bytes && copy.empty()) { munmap((void*)bytes, length); }
+#endif
+    }
+
+    bool open(const char* path) {
+#ifndef _WIN32
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) { return false; }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) { return false; }
+        bytes = (const char*)map;
+        length = st.st_size;
+        return true;
+#else
+        FILE* file = fopen(path, "rb");
+        if (!file) { return false; }
+        char chunk[65536];
+        size_t count;
+        while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            copy.insert(copy.end(), chunk, chunk + count);
+        }
+        fclose(file);
+        if (copy.empty()) { return false; }
+        bytes = &copy[0];
+        length = copy.size();
+        return true;
+#endif
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Whether the nodes [first, end) of a cached world can be cast without
+// reading outside the arrays or looping: each box's contents, and the halves
+// of a split box, end within what holds them, no deeper than the casts'
+// stacks allow, and each portal is one of the world's `target_count`
+// targets or reflects.
+inline bool scene_cache_nodes_valid(const CompiledNode* nodes, int first, int end,
+                                    const CompiledPortal* portals, int portal_count, int target_count) {
+    // Where the contents of the boxes round node i end, innermost last, and
+    // whether each is a box's end rather than its first half's.
+    int ends[2*SceneCompiler::MAX_BOX_DEPTH];
+    bool box_end[2*SceneCompiler::MAX_BOX_DEPTH];
+    int top = 0, depth = 0;
+    for (int i = first; i < end; i++) {
+        while (top > 0 && i >= ends[top-1]) {
+            if (box_end[--top]) { depth--; }
+        }
+        int limit = top > 0 ? ends[top-1] : end;
+        const CompiledNode& node = nodes[i];
+        switch (node.kind) {
+        case CompiledNode::BOX:
+            if (node.next <= i || node.next > limit || node.axis < 0 || node.axis > 2
+                    || (node.second != -1 && (node.second <= i || node.second > node.next))
+                    || depth == SceneCompiler::MAX_BOX_DEPTH) {
+                return false;
+            }
+            depth++;
+            ends[top] = node.next;
+            box_end[top++] = true;
+            if (node.second >= 0) {
+                ends[top] = node.second;
+                box_end[top++] = false;
+            }
+            break;
+        case CompiledNode::SPHERE:
+        case CompiledNode::PLANE:
+            if (node.portal < 0 || node.portal >= portal_count
+                    || portals[node.portal].world < -1 || portals[node.portal].world >= target_count) {
+                return false;
+            }
+            break;
+        default:
+            // Shapes can't be cached.
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether a mapped cache is complete, current and readable here.
+inline bool scene_cache_valid(const MappedFile& file) {
+    const char* base = file.data();
+    size_t size = file.size();
+    if (size < sizeof(SceneCacheHeader)) { return false; }
+    const SceneCacheHeader& h = *(const SceneCacheHeader*)base;
+    if (memcmp(h.magic, "RTSCENE", 8) || h.version != SCENE_CACHE_VERSION || h.byte_order != 0x01020304
+            || h.real_size != sizeof(Real) || h.node_size != sizeof(CompiledNode)
+            || h.portal_size != sizeof(CompiledPortal) || h.world_count == 0) {
+        return false;
+    }
+    struct Section { uint64_t offset, bytes; } sections[] = {
+        { h.sources, h.source_count * sizeof(SceneCacheSource) },
+        { h.worlds, h.world_count * sizeof(CompiledWorld) },
+        { h.world_skyboxes, h.world_count * sizeof(int32_t) },
+        { h.world_targets, h.target_count * sizeof(int) },
+        { h.nodes, h.node_count * sizeof(CompiledNode) },
+        { h.portals, h.portal_count * sizeof(CompiledPortal) },
+        { h.skyboxes, h.skybox_count * sizeof(SceneCacheSkybox) },
+    };
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+        if (sections[i].offset % 16 || sections[i].offset > size || sections[i].bytes > size - sections[i].offset) {
+            return false;
+        }
+    }
+    const SceneCacheSkybox* skyboxes = (const SceneCacheSkybox*)(base + h.skyboxes);
+    for (uint32_t i = 0; i < h.skybox_count; i++) {
+        if (skyboxes[i].texels % 16 || skyboxes[i].texels > size || skyboxes[i].bytes > size - skyboxes[i].texels
+                || skyboxes[i].face_size < 1 || skyboxes[i].face_size > MAX_SKYBOX_FACE
+                || skyboxes[i].bytes != Skybox(skyboxes[i].face_size, NULL).texel_bytes()) {
+            return false;
+        }
+    }
+    const int32_t* world_skyboxes = (const int32_t*)(base + h.world_skyboxes);
+    const CompiledWorld* worlds = (const CompiledWorld*)(base + h.worlds);
+    for (uint32_t w = 0; w < h.world_count; w++) {
+        if (world_skyboxes[w] < 0 || world_skyboxes[w] >= (int32_t)h.skybox_count) { return false; }
+        if (worlds[w].targets < 0 || worlds[w].target_count < 0
+                || uint32_t(worlds[w].targets) > h.target_count
+                || uint32_t(worlds[w].target_count) > h.target_count - worlds[w].targets) {
+            return false;
+        }
+        if (worlds[w].first < 0 || worlds[w].first > worlds[w].end || uint32_t(worlds[w].end) > h.node_count
+                || !scene_cache_nodes_valid((const CompiledNode*)(base + h.nodes), worlds[w].first, worlds[w].end,
+                                            (const CompiledPortal*)(base + h.portals), h.portal_count,
+                                            worlds[w].target_count)) {
+            return false;
+        }
+    }
+    const int* world_targets = (const int*)(base + h.world_targets);
+    for (uint32_t i = 0; i < h.target_count; i++) {
+        if (world_targets[i] < 0 || world_targets[i] >= (int)h.world_count) { return false; }
+    }
+
+    const SceneCacheSource* sources = (const SceneCacheSource*)(base + h.sources);
+    for (uint32_t i = 0; i < h.source_count; i++) {
+        uint64_t source_size, hash;
+        if (!hash_file(sources[i].path, &source_size, &hash)
+                || source_size != sources[i].size || hash != sources[i].hash) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Makes the worlds of a valid cache, using its arrays in place.  Returns the
+// root world.
+inline World* use_scene_cache(const MappedFile& file) {
+    const char* base = file.data();
+    const SceneCacheHeader& h = *(const SceneCacheHeader*)base;
+    const SceneCacheSkybox* records = (const SceneCacheSkybox*)(base + h.skyboxes);
+    std::vector<Skybox*> skyboxes;
+    for (uint32_t i = 0; i < h.skybox_count; i++) {
+        skyboxes.push_back(new Skybox(records[i].face_size, base + records[i].texels));
+    }
+    const int32_t* world_skyboxes = (const int32_t*)(base + h.world_skyboxes);
+    std::vector<Skybox*> by_world;
+    for (uint32_t w = 0; w < h.world_count; w++) {
+        by_world.push_back(skyboxes[world_skyboxes[w]]);
+    }
+    CompiledScene* scene = CompiledScene::use(
+        (const CompiledNode*)(base + h.nodes), h.node_count,
+        (const CompiledPortal*)(base + h.portals), h.portal_count,
+        (const CompiledWorld*)(base + h.worlds), (const int*)(base + h.world_targets), h.target_count,
+        by_world);
+    return scene->root();
+}
+
+// Places a section of `bytes` at the next 16-byte boundary from *offset,
+// and queues it for writing.  Returns where it goes.
+inline uint64_t scene_cache_section(std::vector<const void*>* data, std::vector<uint64_t>* lengths,
+                                    uint64_t* offset, const void* p, uint64_t bytes) {
+    *offset = (*offset + 15) & ~uint64_t(15);
+    uint64_t at = *offset;
+    data->push_back(p);
+    lengths->push_back(bytes);
+    *offset += bytes;
+    return at;
+}
+
+// Writes a self-contained compiled scene to `path`, recording `sources` as
+// the files it was built from.  Written to a temporary file and renamed, so
+// readers never see half a cache.
+inline bool write_scene_cache(const char* path, const CompiledScene& scene,
+                              const std::vector<std::string>& sources) {
+    if (!scene.self_contained()) { return false; }
+
+    std::vector<SceneCacheSource> source_records;
+    for (size_t i = 0; i < sources.size(); i++) {
+        SceneCacheSource record;
+        memset(&record, 0, sizeof(record));
+        if (sources[i].size() >= sizeof(record.path)) { return false; }
+        strcpy(record.path, sources[i].c_str());
+        if (!hash_file(record.path, &record.size, &record.hash)) { return false; }
+        source_records.push_back(record);
+    }
+
+    std::vector<const Skybox*> skyboxes;
+    std::vector<int32_t> world_skyboxes;
+    for (int w = 0; w < scene.world_count(); w++) {
+        const Skybox* skybox = scene.world(w)->skybox;
+        size_t index = std::find(skyboxes.begin(), skyboxes.end(), skybox) - skyboxes.begin();
+        if (index == skyboxes.size()) { skyboxes.push_back(skybox); }
+        world_skyboxes.push_back(index);
+    }
+
+    // Lay the sections out, then write them in the same order.
+    SceneCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "RTSCENE", 8);
+    h.version = SCENE_CACHE_VERSION;
+    h.byte_order = 0x01020304;
+    h.real_size = sizeof(Real);
+    h.node_size = sizeof(CompiledNode);
+    h.portal_size = sizeof(CompiledPortal);
+    h.source_count = source_records.size();
+    h.world_count = scene.world_count();
+    h.node_count = scene.node_count();
+    h.portal_count = scene.portal_count();
+    h.skybox_count = skyboxes.size();
+    h.target_count = scene.world_target_count();
+
+    std::vector<const void*> data;
+    std::vector<uint64_t> lengths;
+    uint64_t offset = sizeof(h);
+    h.sources = scene_cache_section(&data, &lengths, &offset, &source_records[0], h.source_count * sizeof(SceneCacheSource));
+    h.worlds = scene_cache_section(&data, &lengths, &offset, scene.world_node_ranges(), h.world_count * sizeof(CompiledWorld));
+    h.world_skyboxes = scene_cache_section(&data, &lengths, &offset, &world_skyboxes[0], h.world_count * sizeof(int32_t));
+    h.world_targets = scene_cache_section(&data, &lengths, &offset, scene.world_target_array(), h.target_count * sizeof(int));
+    h.nodes = scene_cache_section(&data, &lengths, &offset, scene.node_array(), h.node_count * sizeof(CompiledNode));
+    h.portals = scene_cache_section(&data, &lengths, &offset, scene.portal_array(), h.portal_count * sizeof(CompiledPortal));
+    std::vector<SceneCacheSkybox> skybox_records(skyboxes.size());
+    h.skyboxes = scene_cache_section(&data, &lengths, &offset, skybox_records.empty() ? NULL : &skybox_records[0],
+                                     h.skybox_count * sizeof(SceneCacheSkybox));
+    for (size_t i = 0; i < skyboxes.size(); i++) {
+        memset(&skybox_records[i], 0, sizeof(SceneCacheSkybox));
+        skybox_records[i].face_size = skyboxes[i]->face_size();
+        skybox_records[i].bytes = skyboxes[i]->texel_bytes();
+        skybox_records[i].texels = scene_cache_section(&data, &lengths, &offset, skyboxes[i]->texel_data(),
+                                                       skybox_records[i].bytes);
+    }
+
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) { return false; }
+    bool ok = fwrite(&h, sizeof(h), 1, file) == 1;
+    uint64_t written = sizeof(h);
+    static const char zeros[16] = { 0 };
+    for (size_t i = 0; i < data.size() && ok; i++) {
+        uint64_t padding = ((written + 15) & ~uint64_t(15)) - written;
+        ok = fwrite(zeros, 1, padding, file) == padding
+             && (lengths[i] == 0 || fwrite(data[i], 1, lengths[i], file) == lengths[i]);
+        written += padding + lengths[i];
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Loads a scene file and compiles it, through a cache of the result beside
+// it (FILE.cache): a current cache is used in place, and otherwise the scene
+// is loaded from its source and the cache rewritten.  The cache stays mapped
+// for as long as the program runs.  Prints what's wrong and returns NULL if
+// the scene can't be loaded; a cache that can't be written is only skipped.
+inline World* load_scene_cached(const char* filename, bool* cached = NULL) {
+    std::string cache_path = std::string(filename) + ".cache";
+    if (cached) { *cached = false; }
+
+    MappedFile* file = new MappedFile;
+    if (file->open(cache_path.c_str()) && scene_cache_valid(*file)) {
+        if (cached) { *cached = true; }
+        return use_scene_cache(*file);
+    }
+    delete file;
+
+    SceneLoader loader(filename);
+    World* world = loader.load();
+    if (!world) {
+        std::cerr << loader.error_message() << std::endl;
+        return NULL;
+    }
+    CompiledScene* scene = CompiledScene::compile(world);
+
+    std::vector<std::string> sources;
+    sources.push_back(filename);
+    const std::map<std::string, Skybox*>& skyboxes = loader.skybox_files();
+    for (std::map<std::string, Skybox*>::const_iterator i = skyboxes.begin(); i != skyboxes.end(); ++i) {
+        sources.push_back(i->first);
+    }
+    write_scene_cache(cache_path.c_str(), *scene, sources);
+    return world;
+}
+
+#endif
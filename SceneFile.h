@@ -0,0 +1,458 @@
+#ifndef __SCENEFILE_H__
+#define __SCENEFILE_H__
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+#include "Skybox.h"
+#include "Render.h"
+#include "Levels.h"
+#include "Shapes/Instance.h"
+
+// Loads a World graph from a scene file.  A scene file is a list of worlds,
+// one statement per line; '#' starts a comment.
+//
+//   start NAME                    the world to start in (default: the first)
+//   world NAME                    begins a world, up to its `end`
+//     skybox FILE                 required, shared between worlds by file name
+//     sphere X Y Z R [portal WORLD X Y Z R]
+//     plane X Y Z  NX NY NZ  UX UY UZ [size S] [portal WORLD X Y Z  NX NY NZ  UX UY UZ]
+//     box X0 Y0 Z0  X1 Y1 Z1      a bounding box round the shapes up to its `end`
+//   end
+//   template NAME                 shapes shared by worlds, as in a world, up to its `end`
+//     skybox FILE                 optional, for instances that don't give one
+//     ... portal $K ...           portals lead to each instance's K'th target
+//   end
+//   instance NAME TEMPLATE [skybox FILE] WORLD...
+//                                 a world of the template's shapes, its portals
+//                                 leading to the WORLDs, one for each $K
+//
+// A plane is given by its origin, its normal and an up direction, as for
+// Frame::from_normal_up, and `size` is as for Plane.  Shapes without a
+// portal reflect.  Worlds can be named before they're defined; templates
+// must be defined before their instances.  Every instance of a template
+// shares its shapes (see Instance), so a grid of identical cells costs one
+// cell and a table of portal targets for each.
+//
+// Within a world or box, the planes become one PlaneSet, and untargeted
+// spheres, if there are many, SphereSet clusters; the rest are kept in file
+// order and grouped as make_compound does.
+class SceneLoader {
+    const char* filename;
+    const char* pos;
+    const char* line_end;
+    const char* file_end;
+    int line;
+    std::string error;
+
+    struct WorldEntry {
+        World* world;
+        int defined;            // the line it's defined on, or 0
+        int referenced;         // the first line it's named on
+    };
+    std::map<std::string, WorldEntry> worlds;
+    std::map<std::string, Skybox*> skyboxes;
+
+    // The most portal targets a template can have, $0 to $(MAX-1).
+    static const int MAX_TEMPLATE_SLOTS = 1024;
+    struct TemplateEntry {
+        Shape* body;            // NULL until its `end`
+        Skybox* skybox;
+        std::vector<World*> slots;
+    };
+    std::map<std::string, TemplateEntry> templates;
+    World* first_world;
+    std::string start;
+    int start_line;
+
+    // The shapes of an open world or box.
+    struct Group {
+        World* world;           // NULL for a box or template
+        TemplateEntry* tmpl;    // the template, if it is one
+        Bounds box;
+        int opened;             // the line it starts on
+        std::vector<Shape*> shapes;
+        PlaneSet* planes;
+        std::vector<SphereSpec> spheres;
+    };
+    std::vector<Group> groups;
+
+    bool fail(const std::string& message) {
+        if (error.empty()) {
+            std::ostringstream out;
+            out << filename << ":" << line << ": " << message;
+            error = out.str();
+        }
+        return false;
+    }
+
+    void skip_space() {
+        while (pos < line_end && (*pos == ' ' || *pos == '\t' || *pos == '\r')) { pos++; }
+        if (pos < line_end && *pos == '#') { pos = line_end; }
+    }
+
+    bool at_line_end() {
+        skip_space();
+        return pos == line_end;
+    }
+
+    bool word(std::string* out) {
+        skip_space();
+        const char* start = pos;
+        while (pos < line_end && *pos != ' ' && *pos != '\t' && *pos != '\r' && *pos != '#') { pos++; }
+        out->assign(start, pos);
+        return pos > start;
+    }
+
+    bool number(Real* out) {
+        skip_space();
+        char* end;
+        double value = strtod(pos, &end);
+        if (end == pos || end > line_end || (end < line_end && !strchr(" \t\r#", *end))) {
+            return fail("expected a number");
+        }
+        pos = end;
+        *out = value;
+        return true;
+    }
+
+    bool vec(Vec* out) {
+        Real x = 0, y = 0, z = 0;
+        if (!number(&x) || !number(&y) || !number(&z)) { return false; }
+        *out = Vec(x, y, z);
+        return true;
+    }
+
+    bool point(Point* out) {
+        Vec v;
+        if (!vec(&v)) { return false; }
+        *out = Point(v);
+        return true;
+    }
+
+    bool frame(Frame* out) {
+        Vec normal, up;
+        if (!vec(&normal) || !vec(&up)) { return false; }
+        *out = Frame::from_normal_up(normal, up);
+        return true;
+    }
+
+    World* world_named(const std::string& name) {
+        std::map<std::string, WorldEntry>::iterator i = worlds.find(name);
+        if (i != worlds.end()) { return i->second.world; }
+        WorldEntry entry = { new World, 0, line };
+        entry.world->scene = NULL;
+        entry.world->skybox = NULL;
+        worlds[name] = entry;
+        return entry.world;
+    }
+
+    // Starts defining a world, which must be new.
+    bool define_world(const std::string& name, World** world) {
+        *world = world_named(name);
+        WorldEntry& entry = worlds[name];
+        if (entry.defined) {
+            std::ostringstream message;
+            message << "world '" << name << "' already defined on line " << entry.defined;
+            return fail(message.str());
+        }
+        entry.defined = line;
+        if (!first_world) { first_world = *world; }
+        return true;
+    }
+
+    // The skybox from an image file, loaded once for every world naming it.
+    bool skybox_file(const std::string& file, Skybox** skybox) {
+        std::map<std::string, Skybox*>::iterator loaded = skyboxes.find(file);
+        if (loaded == skyboxes.end()) {
+            Image image(file.c_str());
+            if (!image.loaded()) { return fail("can't read skybox '" + file + "'"); }
+            loaded = skyboxes.insert(std::make_pair(file, new Skybox(image))).first;
+        }
+        *skybox = loaded->second;
+        return true;
+    }
+
+    // Parses an optional "portal WORLD", leaving the target's position to
+    // the caller.  In a template, the target is a slot, "$K".
+    bool portal(World** target, bool* has_target) {
+        std::string keyword, name;
+        *has_target = false;
+        if (at_line_end()) { return true; }
+        word(&keyword);
+        if (keyword != "portal") { return fail("unexpected '" + keyword + "'"); }
+        if (!word(&name)) { return fail("expected a world name"); }
+        TemplateEntry* tmpl = groups.front().tmpl;
+        if (tmpl || name[0] == '$') {
+            char* end;
+            long k = strtol(name.c_str() + 1, &end, 10);
+            if (!tmpl) { return fail("'" + name + "' outside a template"); }
+            if (name[0] != '$' || name.size() == 1 || *end || k < 0 || k >= MAX_TEMPLATE_SLOTS) {
+                return fail("portals in a template lead to $0, $1, ...");
+            }
+            while ((int)tmpl->slots.size() <= k) {
+                World* slot = new World;
+                slot->scene = NULL;
+                slot->skybox = NULL;
+                tmpl->slots.push_back(slot);
+            }
+            *target = tmpl->slots[k];
+        }
+        else {
+            *target = world_named(name);
+        }
+        *has_target = true;
+        return true;
+    }
+
+    Group& open_group(World* world) {
+        groups.push_back(Group());
+        Group& group = groups.back();
+        group.world = world;
+        group.tmpl = NULL;
+        group.planes = NULL;
+        group.opened = line;
+        return group;
+    }
+
+    // The shape of a closed group.
+    static Shape* group_shape(Group& group) {
+        std::vector<Shape*> shapes;
+        if (group.planes) { shapes.push_back(group.planes); }
+        shapes.insert(shapes.end(), group.shapes.begin(), group.shapes.end());
+        if ((int)group.spheres.size() >= BVH_MIN_SHAPES) {
+            make_sphere_clusters(group.spheres, 0, group.spheres.size(), FIELD_CLUSTER, &shapes);
+        }
+        else {
+            for (size_t i = 0; i < group.spheres.size(); i++) {
+                shapes.push_back(new Sphere(group.spheres[i].center, group.spheres[i].radius));
+            }
+        }
+        if (shapes.empty()) { return new EmptyShape; }
+        if (shapes.size() == 1) { return shapes[0]; }
+        return make_compound(shapes);
+    }
+
+    bool statement() {
+        std::string keyword;
+        if (!word(&keyword)) { return true; }
+        Group* group = groups.empty() ? NULL : &groups.back();
+
+        if (keyword == "world") {
+            std::string name;
+            World* world;
+            if (group) { return fail("world inside a world"); }
+            if (!word(&name)) { return fail("expected a world name"); }
+            if (!define_world(name, &world)) { return false; }
+            open_group(world);
+        }
+        else if (keyword == "template") {
+            std::string name;
+            if (group) { return fail("template inside a world"); }
+            if (!word(&name)) { return fail("expected a template name"); }
+            if (templates.count(name)) { return fail("template '" + name + "' already defined"); }
+            TemplateEntry& entry = templates[name];
+            entry.body = NULL;
+            entry.skybox = NULL;
+            open_group(NULL).tmpl = &entry;
+        }
+        else if (keyword == "instance") {
+            std::string name, template_name, target;
+            World* world;
+            if (group) { return fail("instance inside a world"); }
+            if (!word(&name)) { return fail("expected a world name"); }
+            if (!word(&template_name)) { return fail("expected a template name"); }
+            std::map<std::string, TemplateEntry>::iterator entry = templates.find(template_name);
+            if (entry == templates.end() || !entry->second.body) {
+                return fail("template '" + template_name + "' isn't defined");
+            }
+            const TemplateEntry& tmpl = entry->second;
+            if (!define_world(name, &world)) { return false; }
+            world->skybox = tmpl.skybox;
+            std::vector<World*> targets;
+            while (word(&target)) {
+                if (target == "skybox" && targets.empty()) {
+                    std::string file;
+                    if (!word(&file)) { return fail("expected a file name"); }
+                    if (!skybox_file(file, &world->skybox)) { return false; }
+                }
+                else {
+                    targets.push_back(world_named(target));
+                }
+            }
+            if (targets.size() != tmpl.slots.size()) {
+                std::ostringstream message;
+                message << "template '" << template_name << "' needs " << tmpl.slots.size() << " target worlds";
+                return fail(message.str());
+            }
+            if (!world->skybox) { return fail("world has no skybox"); }
+            world->scene = new Instance(tmpl.body, tmpl.slots, targets);
+        }
+        else if (keyword == "start") {
+            if (group) { return fail("start inside a world"); }
+            if (!word(&start)) { return fail("expected a world name"); }
+            start_line = line;
+        }
+        else if (!group) {
+            return fail("'" + keyword + "' outside a world");
+        }
+        else if (keyword == "end") {
+            Group closed = groups.back();
+            groups.pop_back();
+            Shape* shape = group_shape(closed);
+            if (closed.world) {
+                if (!closed.world->skybox) { return fail("world has no skybox"); }
+                closed.world->scene = shape;
+            }
+            else if (closed.tmpl) {
+                closed.tmpl->body = shape;
+            }
+            else {
+                groups.back().shapes.push_back(new BoundingBox(closed.box.min, closed.box.max, shape));
+            }
+        }
+        else if (keyword == "skybox") {
+            std::string file;
+            if (!group->world && !group->tmpl) { return fail("skybox inside a box"); }
+            if (!word(&file)) { return fail("expected a file name"); }
+            if (!skybox_file(file, group->world ? &group->world->skybox : &group->tmpl->skybox)) { return false; }
+        }
+        else if (keyword == "box") {
+            Point min, max;
+            if (!point(&min) || !point(&max)) { return false; }
+            open_group(NULL).box = Bounds(min, max);
+        }
+        else if (keyword == "sphere") {
+            Point center, target_center;
+            Real radius = 0, target_radius = 0;
+            World* target;
+            bool has_target;
+            if (!point(&center) || !number(&radius) || !portal(&target, &has_target)) { return false; }
+            if (!(radius > 0)) { return fail("sphere radius must be positive"); }
+            if (!has_target) {
+                group->spheres.push_back(SphereSpec(center, radius));
+            }
+            else {
+                if (!point(&target_center) || !number(&target_radius)) { return false; }
+                Sphere* sphere = new Sphere(center, radius);
+                sphere->set_target(target, target_center, target_radius);
+                group->shapes.push_back(sphere);
+            }
+        }
+        else if (keyword == "plane") {
+            Point origin, target_origin;
+            Frame plane_frame, target_frame;
+            Real size = HUGE_VAL;
+            if (!point(&origin) || !frame(&plane_frame)) { return false; }
+            const char* before = pos;
+            std::string option;
+            if (word(&option) && option == "size") {
+                if (!number(&size)) { return false; }
+            }
+            else {
+                pos = before;
+            }
+            World* target;
+            bool has_target;
+            if (!portal(&target, &has_target)) { return false; }
+            if (!group->planes) { group->planes = new PlaneSet; }
+            int index = group->planes->add(origin, plane_frame, size);
+            if (has_target) {
+                if (!point(&target_origin) || !frame(&target_frame)) { return false; }
+                group->planes->set_target(index, target, target_origin, target_frame);
+            }
+        }
+        else {
+            return fail("unknown statement '" + keyword + "'");
+        }
+
+        if (!at_line_end()) {
+            std::string extra;
+            word(&extra);
+            return fail("unexpected '" + extra + "'");
+        }
+        return true;
+    }
+
+    bool parse() {
+        line = 0;
+        while (pos < file_end) {
+            line++;
+            line_end = (const char*)memchr(pos, '\n', file_end - pos);
+            if (!line_end) { line_end = file_end; }
+            if (!statement()) { return false; }
+            pos = line_end + 1;
+        }
+        if (!groups.empty()) {
+            line = groups.back().opened;
+            return fail("missing 'end'");
+        }
+        for (std::map<std::string, WorldEntry>::iterator i = worlds.begin(); i != worlds.end(); ++i) {
+            if (!i->second.defined) {
+                line = i->second.referenced;
+                return fail("world '" + i->first + "' is never defined");
+            }
+        }
+        if (!first_world) { return fail("no worlds"); }
+        if (!start.empty() && !worlds.count(start)) {
+            line = start_line;
+            return fail("world '" + start + "' is never defined");
+        }
+        return true;
+    }
+
+public:
+    SceneLoader(const char* filename)
+        : filename(filename), pos(NULL), line_end(NULL), file_end(NULL), line(0),
+          first_world(NULL), start_line(0)
+    { }
+
+    // Loads the scene and returns its starting world, or NULL with a message
+    // saying what's wrong, and where, in error_message().
+    World* load() {
+        FILE* file = fopen(filename, "rb");
+        if (!file) {
+            error = std::string(filename) + ": cannot open file";
+            return NULL;
+        }
+        std::vector<char> text;
+        char chunk[65536];
+        size_t count;
+        while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            text.insert(text.end(), chunk, chunk + count);
+        }
+        fclose(file);
+        // A terminator, so strtod stops at the end of the last line.
+        text.push_back('\0');
+        pos = &text[0];
+        file_end = pos + text.size() - 1;
+
+        if (!parse()) { return NULL; }
+        return start.empty() ? first_world : worlds[start].world;
+    }
+
+    const std::string& error_message() const { return error; }
+
+    // The skyboxes loaded, by file name.
+    const std::map<std::string, Skybox*>& skybox_files() const { return skyboxes; }
+};
+
+// Loads a scene file, printing what's wrong and returning NULL if it can't.
+inline World* load_scene(const char* filename) {
+    SceneLoader loader(filename);
+    World* world = loader.load();
+    if (!world) {
+        std::cerr << loader.error_message() << std::endl;
+    }
+    return world;
+}
+
+#endif
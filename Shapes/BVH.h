@@ -0,0 +1,315 @@
+#ifndef __SHAPES_BVH_H__
+#define __SHAPES_BVH_H__
+
+#include <vector>
+#include <algorithm>
+#include "Shapes/Shape.h"
+#include "Shapes/LinearCompound.h"
+#include "Shapes/SceneCompiler.h"
+#include "Vec.h"
+#include "Point.h"
+
+// Bounding volume hierarchy over an arbitrary list of shapes, built with the
+// surface area heuristic and flattened into a contiguous node array.  Shapes
+// with unbounded extent (e.g. planes) are kept aside and tested linearly.
+class BVH : public Shape {
+    // Interior nodes store their first child immediately after themselves
+    // and the second at `first`; leaves own shapes[first .. first+count).
+    struct Node {
+        Bounds bounds;
+        int first;
+        int count;
+        int axis;
+    };
+
+    struct Ref {
+        Shape* shape;
+        Bounds bounds;
+        Point center;
+    };
+
+    static const int BINS = 16;
+    static const int MAX_LEAF = 4;
+    static const int MAX_DEPTH = 48;
+    static const int STACK_SIZE = 2*MAX_DEPTH + 2;
+
+    std::vector<Node> nodes;
+    std::vector<Shape*> shapes;
+    std::vector<Shape*> unbounded;
+
+    static Real axis_of(const Vec& v, int axis) {
+        return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+    }
+
+    struct BinLess {
+        int axis, bin;
+        Real lo, scale;
+        bool operator() (const Ref& ref) const {
+            return bin_of(ref, axis, lo, scale) < bin;
+        }
+    };
+
+    static int bin_of(const Ref& ref, int axis, Real lo, Real scale) {
+        int b = int((axis_of(ref.center.v, axis) - lo) * scale);
+        return std::min(std::max(b, 0), BINS-1);
+    }
+
+    void make_leaf(int index, std::vector<Ref>& refs, int begin, int end) {
+        nodes[index].first = shapes.size();
+        nodes[index].count = end - begin;
+        for (int i = begin; i < end; i++) {
+            shapes.push_back(refs[i].shape);
+        }
+    }
+
+    int build(std::vector<Ref>& refs, int begin, int end, int depth) {
+        int index = nodes.size();
+        nodes.push_back(Node());
+
+        Bounds bounds, centers;
+        for (int i = begin; i < end; i++) {
+            bounds.extend(refs[i].bounds);
+            centers.extend(refs[i].center);
+        }
+        nodes[index].bounds = bounds;
+        nodes[index].axis = 0;
+
+        int count = end - begin;
+        if (count <= 1 || depth >= MAX_DEPTH) {
+            make_leaf(index, refs, begin, end);
+            return index;
+        }
+
+        // Binned SAH: costs are in units of one shape test, with a node
+        // traversal costing about the same.
+        Real best_cost = HUGE_VAL;
+        int best_axis = -1, best_bin = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            Real lo = axis_of(centers.min.v, axis);
+            Real extent = axis_of(centers.max.v, axis) - lo;
+            if (extent <= 0) { continue; }
+            Real scale = BINS / extent;
+
+            Bounds bin_bounds[BINS];
+            int bin_count[BINS] = { 0 };
+            for (int i = begin; i < end; i++) {
+                int b = bin_of(refs[i], axis, lo, scale);
+                bin_bounds[b].extend(refs[i].bounds);
+                bin_count[b]++;
+            }
+
+            Real right_area[BINS];
+            int right_count[BINS];
+            Bounds acc;
+            int n = 0;
+            for (int b = BINS-1; b > 0; b--) {
+                acc.extend(bin_bounds[b]);
+                n += bin_count[b];
+                right_area[b] = acc.surface_area();
+                right_count[b] = n;
+            }
+
+            acc = Bounds();
+            n = 0;
+            for (int b = 1; b < BINS; b++) {
+                acc.extend(bin_bounds[b-1]);
+                n += bin_count[b-1];
+                if (n == 0 || right_count[b] == 0) { continue; }
+                Real cost = acc.surface_area()*n + right_area[b]*right_count[b];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        Real area = bounds.surface_area();
+        Real split_cost = area > 0 ? 1 + best_cost / area : HUGE_VAL;
+        if (best_axis < 0 || (count <= MAX_LEAF && split_cost >= count)) {
+            make_leaf(index, refs, begin, end);
+            return index;
+        }
+
+        BinLess less;
+        less.axis = best_axis;
+        less.bin = best_bin;
+        less.lo = axis_of(centers.min.v, best_axis);
+        less.scale = BINS / (axis_of(centers.max.v, best_axis) - less.lo);
+        int mid = std::partition(refs.begin() + begin, refs.begin() + end, less) - refs.begin();
+
+        build(refs, begin, mid, depth+1);
+        int second = build(refs, mid, end, depth+1);
+        nodes[index].first = second;
+        nodes[index].count = 0;
+        nodes[index].axis = best_axis;
+        return index;
+    }
+
+    void compile_node(SceneCompiler* compiler, int index) const {
+        const Node& node = nodes[index];
+        int box = compiler->begin_box(node.bounds);
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                compiler->add(shapes[i]);
+            }
+        }
+        else {
+            compile_node(compiler, index + 1);
+            compiler->split_box(box, node.axis);
+            compile_node(compiler, node.first);
+        }
+        compiler->end_box(box);
+    }
+
+public:
+    BVH(const std::vector<Shape*>& in_shapes) {
+        std::vector<Ref> refs;
+        for (std::vector<Shape*>::const_iterator i = in_shapes.begin(); i != in_shapes.end(); ++i) {
+            Bounds b = (*i)->bounds();
+            if (b.is_empty()) {
+                delete *i;  // can never be hit
+            }
+            else if (!b.is_finite()) {
+                unbounded.push_back(*i);
+            }
+            else {
+                Ref ref;
+                ref.shape = *i;
+                ref.bounds = b;
+                ref.center = b.center();
+                refs.push_back(ref);
+            }
+        }
+        if (!refs.empty()) {
+            build(refs, 0, refs.size(), 0);
+        }
+    }
+
+    ~BVH() {
+        for (std::vector<Shape*>::const_iterator i = shapes.begin(); i != shapes.end(); ++i) {
+            delete *i;
+        }
+        for (std::vector<Shape*>::const_iterator i = unbounded.begin(); i != unbounded.end(); ++i) {
+            delete *i;
+        }
+    }
+
+    Bounds bounds() const {
+        if (!unbounded.empty()) { return Bounds::infinite(); }
+        return nodes.empty() ? Bounds() : nodes[0].bounds;
+    }
+
+    // The tree becomes nested split boxes.
+    bool compile(SceneCompiler* compiler) const {
+        for (std::vector<Shape*>::const_iterator i = unbounded.begin(); i != unbounded.end(); ++i) {
+            compiler->add(*i);
+        }
+        if (!nodes.empty()) { compile_node(compiler, 0); }
+        return true;
+    }
+
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        for (std::vector<Shape*>::const_iterator i = unbounded.begin(); i != unbounded.end(); ++i) {
+            (*i)->packet_cast(packet, mask, hit);
+        }
+        if (nodes.empty()) { return; }
+
+        int stack[STACK_SIZE];
+        PacketMask masks[STACK_SIZE];
+        int top = 0;
+        stack[top] = 0;
+        masks[top++] = mask;
+        while (top > 0) {
+            --top;
+            int index = stack[top];
+            PacketMask active = masks[top];
+            const Node& node = nodes[index];
+
+            PacketMask inside = box_packet_cull(packet, node.bounds, active, hit->distance2);
+            count_packet_box_test(active, inside);
+            active = inside;
+            if (!active) { continue; }
+
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    shapes[i]->packet_cast(packet, active, hit);
+                }
+            }
+            else {
+                // Order the children for the first active ray; coherent
+                // packets mostly agree with it.
+                int lead = 0;
+                while (!(active & (1u << lead))) { lead++; }
+                int near_child = index + 1;
+                int far_child = node.first;
+                Real lead_direction = node.axis == 0 ? packet.dx[lead] : node.axis == 1 ? packet.dy[lead] : packet.dz[lead];
+                if (lead_direction < 0) { std::swap(near_child, far_child); }
+                stack[top] = far_child;
+                masks[top++] = active;
+                stack[top] = near_child;
+                masks[top++] = active;
+            }
+        }
+    }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        bool found = false;
+        for (std::vector<Shape*>::const_iterator i = unbounded.begin(); i != unbounded.end(); ++i) {
+            found = (*i)->nearest_hit(cast, best) || found;
+        }
+
+        long tests = 0, rejections = 0, shape_tests = unbounded.size();
+        if (!nodes.empty()) {
+            const Ray& ray = cast.ray;
+            int stack[STACK_SIZE];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0) {
+                int index = stack[--top];
+                const Node& node = nodes[index];
+                Real tnear, tfar;
+                tests++;
+                // Nothing in this node can beat the closest hit so far.
+                if (!node.bounds.intersect(ray, &tnear, &tfar) || best->beyond(tnear, ray.direction)) {
+                    rejections++;
+                    continue;
+                }
+
+                if (node.count > 0) {
+                    for (int i = node.first; i < node.first + node.count; i++) {
+                        found = shapes[i]->nearest_hit(cast, best) || found;
+                    }
+                    shape_tests += node.count;
+                }
+                else {
+                    // Push the far child first so the near one is visited first.
+                    int near_child = index + 1;
+                    int far_child = node.first;
+                    if (axis_of(ray.direction, node.axis) < 0) { std::swap(near_child, far_child); }
+                    stack[top++] = far_child;
+                    stack[top++] = near_child;
+                }
+            }
+        }
+        count_shape_tests(tests, rejections, shape_tests);
+        return found;
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
+    }
+};
+
+// Groups shapes in a LinearCompound when there are few of them, and in a
+// BVH otherwise.
+const int BVH_MIN_SHAPES = 8;
+
+inline Shape* make_compound(const std::vector<Shape*>& shapes) {
+    if ((int)shapes.size() < BVH_MIN_SHAPES) {
+        return new LinearCompound(shapes);
+    }
+    return new BVH(shapes);
+}
+
+#endif
@@ -2,56 +2,86 @@
 #define __SHAPES_BOUNDINGBOX_H__
 
 #include "Shapes/Shape.h"
+#include "Shapes/SceneCompiler.h"
 
 class BoundingBox : public Shape {
-    Point bounds[2];
+    Point corners[2];
     Shape* child;
 public:
     BoundingBox(const Point& min, const Point& max, Shape* child) : child(child)
     {
-        bounds[0] = min;
-        bounds[1] = max;
+        corners[0] = min;
+        corners[1] = max;
     }
     ~BoundingBox() {
         delete child;
     }
 
-    void ray_cast(const RayCast& cast, RayHit* hit) const {
+    Bounds bounds() const {
+        return Bounds(corners[0], corners[1]);
+    }
+
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        PacketMask inside = box_packet_cull(packet, bounds(), mask, hit->distance2);
+        count_packet_box_test(mask, inside);
+        if (inside) {
+            child->packet_cast(packet, inside, hit);
+        }
+    }
+
+    bool compile(SceneCompiler* compiler) const {
+        int box = compiler->begin_box(bounds());
+        compiler->add(child);
+        compiler->end_box(box);
+        return true;
+    }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
         // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-7-intersecting-simple-shapes/ray-box-intersection/
         const Ray& ray = cast.ray;
 
-        int signx = ray.direction.x < 0;
-        int signy = ray.direction.y < 0;
-
-        double invx = 1/ray.direction.x;
-        double invy = 1/ray.direction.y;
+        // Slabs are picked by the reciprocals' signs, as in Bounds::intersect,
+        // so a direction of -0 sees the box the compiled scene does.
+        Real invx = 1/ray.direction.x;
+        Real invy = 1/ray.direction.y;
+        int signx = invx < 0;
+        int signy = invy < 0;
 
-        double tmin = (bounds[signx].v.x - ray.origin.v.x) * invx;
-        double tmax = (bounds[1-signx].v.x - ray.origin.v.x) * invx;
-        double tymin = (bounds[signy].v.y - ray.origin.v.y) * invy;
-        double tymax = (bounds[1-signy].v.y - ray.origin.v.y) * invy;
+        Real tmin = (corners[signx].v.x - ray.origin.v.x) * invx;
+        Real tmax = (corners[1-signx].v.x - ray.origin.v.x) * invx;
+        Real tymin = (corners[signy].v.y - ray.origin.v.y) * invy;
+        Real tymax = (corners[1-signy].v.y - ray.origin.v.y) * invy;
         if ((tmin > tymax) || (tymin > tmax)) { 
-            hit->type = RayHit::TYPE_MISS;
-            return;
+            count_shape_tests(1, 1, 0);
+            return false;
         }
         if (tymin > tmin) { tmin = tymin; }
         if (tymax < tmax) { tmax = tymax; }
 
-        int signz = ray.direction.z < 0;
-        double invz = 1/ray.direction.z;
-        double tzmin = (bounds[signz].v.z - ray.origin.v.z) * invz;
-        double tzmax = (bounds[1-signz].v.z - ray.origin.v.z) * invz;
-
+        Real invz = 1/ray.direction.z;
+        int signz = invz < 0;
+        Real tzmin = (corners[signz].v.z - ray.origin.v.z) * invz;
+        Real tzmax = (corners[1-signz].v.z - ray.origin.v.z) * invz;
         if ((tmin > tzmax) || (tzmin > tmax)) { 
-            hit->type = RayHit::TYPE_MISS;
-            return;
+            count_shape_tests(1, 1, 0);
+            return false;
         }
-        //if (tzmin > tmin) { tmin = tzmin; }
-        //if (tzmax < tmax) { tmax = tzmax; }
-        // tmin and tmax now correspond to the two intersections with the AABB,
-        // should we need them.
+        if (tzmin > tmin) { tmin = tzmin; }
+        if (tzmax < tmax) { tmax = tzmax; }
 
-        child->ray_cast(cast, hit);
+        // [tmin, tmax] is the ray's interval in the box.  Skip the box if
+        // it's behind the ray, or the ray only reaches it beyond the nearest
+        // hit so far.
+        if (tmax < 0 || best->beyond(tmin, ray.direction)) {
+            count_shape_tests(1, 1, 0);
+            return false;
+        }
+        count_shape_tests(1, 0, 0);
+        return child->nearest_hit(cast, best);
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
     }
 };
 
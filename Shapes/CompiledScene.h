@@ -0,0 +1,436 @@
+#ifndef __SHAPES_COMPILEDSCENE_H__
+#define __SHAPES_COMPILEDSCENE_H__
+
+#include <vector>
+#include "Shapes/Shape.h"
+#include "Shapes/SceneCompiler.h"
+#include "Shapes/Sphere.h"
+#include "Shapes/Plane.h"
+#include "Render.h"
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+
+// The worlds reachable from a root, flattened by SceneCompiler into one
+// array of nodes each.  A cast walks its world's nodes in a single loop
+// switching on the node kind, with no virtual calls but for shapes the
+// compiler doesn't know, and only the nearest hit looks at its portal.
+// Hits are the same as casting the original shapes.  Instances of one body
+// share its nodes, and differ only in their tables of portal targets.
+//
+// compile() installs a CompiledShape as each world's scene, so the renderer
+// is unchanged; the shapes the worlds were built from stay as they were.
+// use() makes worlds for nodes compiled earlier, without the shapes.
+class CompiledScene {
+    SceneCompiler ir;           // empty if the nodes came from elsewhere
+    const CompiledNode* nodes;
+    const CompiledPortal* portals;
+    const CompiledWorld* world_nodes;
+    const int* world_targets;
+    int nodes_size, portals_size, targets_size;
+    std::vector<World*> worlds;
+    std::vector<World> own_worlds;
+
+    class CompiledShape;
+    class CompiledPrimitive;
+    std::vector<CompiledShape> shapes;
+    // One per node, recorded as a packet lane's hit so it can be recast.
+    std::vector<CompiledPrimitive> primitives;
+
+    // A world's scene, cast through its nodes.
+    class CompiledShape : public Shape {
+        const CompiledScene* scene;
+        int world;
+        const Shape* source;
+    public:
+        CompiledShape(const CompiledScene* scene, int world, const Shape* source)
+            : scene(scene), world(world), source(source)
+        { }
+
+        void ray_cast(const RayCast& cast, RayHit* hit) const {
+            const CompiledWorld& w = scene->world_nodes[world];
+            scene->cast_nodes(w, w.first, w.end, cast, hit);
+        }
+
+        void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+            const CompiledWorld& w = scene->world_nodes[world];
+            scene->packet_cast_nodes(w.first, w.end, packet, mask, hit);
+        }
+
+        Bounds bounds() const { return source ? source->bounds() : Bounds::infinite(); }
+
+        const CompiledScene* compiled_scene() const { return scene; }
+        int world_index() const { return world; }
+    };
+
+    // A single node, for the packet traversal to record as a lane's hit.
+    // Nodes may be shared by worlds, so it's recast in the lane's world,
+    // whose scene is the CompiledShape that recorded it.
+    class CompiledPrimitive : public Shape {
+        const CompiledScene* scene;
+        int node;
+    public:
+        CompiledPrimitive(const CompiledScene* scene, int node) : scene(scene), node(node) { }
+
+        void ray_cast(const RayCast& cast, RayHit* hit) const {
+            int world = static_cast<const CompiledShape*>(cast.world->scene)->world_index();
+            scene->cast_nodes(scene->world_nodes[world], node, node + 1, cast, hit);
+        }
+    };
+
+    CompiledScene(const CompiledScene&);
+    CompiledScene& operator= (const CompiledScene&);
+
+    CompiledScene()
+        : nodes(NULL), portals(NULL), world_nodes(NULL), world_targets(NULL),
+          nodes_size(0), portals_size(0), targets_size(0)
+    { }
+
+    // Where a portal leads from world w, or NULL if it reflects.
+    World* target(const CompiledWorld& w, const CompiledPortal& portal) const {
+        return portal.world < 0 ? NULL : worlds[world_targets[w.targets + portal.world]];
+    }
+
+    // Makes the per-world and per-node shapes once the arrays are set.
+    void install() {
+        primitives.reserve(nodes_size);
+        for (int i = 0; i < nodes_size; i++) {
+            primitives.push_back(CompiledPrimitive(this, i));
+        }
+        shapes.reserve(worlds.size());
+        for (size_t w = 0; w < worlds.size(); w++) {
+            shapes.push_back(CompiledShape(this, w, worlds[w]->scene));
+        }
+        for (size_t w = 0; w < worlds.size(); w++) {
+            worlds[w]->scene = &shapes[w];
+        }
+    }
+
+    // Nodes still to visit, and for packets the lanes to cast them with.  A
+    // box split in two is visited nearest half first: the rest of the
+    // enclosing range and the far half are stacked, and the near half is
+    // visited now.
+    struct Range { int begin, end; PacketMask mask; };
+
+    // Casts against nodes [first, end) of world w, like a LinearCompound of
+    // them: the nearest hit wins, and ties go to the earlier node.
+    void cast_nodes(const CompiledWorld& w, int first, int end, const RayCast& cast, RayHit* hit) const {
+        const Ray& ray = cast.ray;
+        const Vec& o = ray.origin.v;
+        const Vec& d = ray.direction;
+        Real direction2 = d.norm2();
+        Real inv[3] = { 1/d.x, 1/d.y, 1/d.z };
+        Real origin[3] = { o.x, o.y, o.z };
+        Real best = HUGE_VAL;
+        int best_node = -1;
+        Point best_location;
+        Real best_t = 0;
+        HitRecord shape_hit;
+        Range stack[2*SceneCompiler::MAX_BOX_DEPTH];
+        int top = 0;
+        // Counted here and added to shape_counters() once per cast.
+        long tests = 0, rejections = 0, shape_tests = 0;
+
+        int i = first;
+        for (;;) {
+            if (i >= end) {
+                if (top == 0) { break; }
+                --top;
+                i = stack[top].begin;
+                end = stack[top].end;
+                continue;
+            }
+            const CompiledNode& node = nodes[i];
+            switch (node.kind) {
+            case CompiledNode::BOX: {
+                // The slab test of Bounds::intersect, with the reciprocals
+                // shared by every box.
+                Real tnear = -HUGE_VAL, tfar = HUGE_VAL;
+                for (int a = 0; a < 3; a++) {
+                    Real t0 = ((inv[a] < 0 ? node.data[a+3] : node.data[a]) - origin[a]) * inv[a];
+                    Real t1 = ((inv[a] < 0 ? node.data[a] : node.data[a+3]) - origin[a]) * inv[a];
+                    if (t0 > tnear) { tnear = t0; }
+                    if (t1 < tfar) { tfar = t1; }
+                }
+                tests++;
+                if (tnear > tfar || tfar < 0 || (tnear > 0 && tnear*tnear*direction2 > best)) {
+                    rejections++;
+                    i = node.next;
+                    continue;
+                }
+                if (node.second >= 0 && inv[node.axis] < 0) {
+                    Range after = { node.next, end, 0 };
+                    Range far = { i + 1, node.second, 0 };
+                    stack[top++] = after;
+                    stack[top++] = far;
+                    i = node.second;
+                    end = node.next;
+                    continue;
+                }
+                break;
+            }
+            case CompiledNode::SPHERE: {
+                shape_tests++;
+                Point center(node.data[0], node.data[1], node.data[2]);
+                Real radius = node.data[3];
+                Point location;
+                Real dist;
+                if (Sphere::intersect(center, radius, ray, &location, &dist) && dist < best
+                        && !((location - center) / radius * d > 0)) {
+                    best = dist;
+                    best_node = i;
+                    best_location = location;
+                }
+                break;
+            }
+            case CompiledNode::PLANE: {
+                shape_tests++;
+                Vec normal(node.data[3], node.data[4], node.data[5]);
+                Real facing = d * normal;
+                if (facing > 0) { break; }
+                Real t = (Vec(node.data[0], node.data[1], node.data[2]) - o) * normal / facing;
+                if (t > CAST_EPSILON) {
+                    Real dist = ((ray.origin + t * d) - ray.origin).norm2();
+                    if (dist < best) {
+                        best = dist;
+                        best_node = i;
+                        best_t = t;
+                    }
+                }
+                break;
+            }
+            case CompiledNode::SHAPE: {
+                // Only the nearest shape hit is resolved, at the end.
+                shape_tests++;
+                HitRecord record;
+                record.distance2 = best;
+                if (node.shape->nearest_hit(cast, &record)) {
+                    best = record.distance2;
+                    best_node = i;
+                    shape_hit = record;
+                }
+                break;
+            }
+            }
+            i++;
+        }
+        count_shape_tests(tests, rejections, shape_tests);
+
+        if (best_node < 0) {
+            hit->type = RayHit::TYPE_MISS;
+            return;
+        }
+        const CompiledNode& node = nodes[best_node];
+        if (node.kind == CompiledNode::SPHERE) {
+            const CompiledPortal& portal = portals[node.portal];
+            Sphere::portal_hit(Point(node.data[0], node.data[1], node.data[2]), node.data[3],
+                               target(w, portal), portal.target_center, portal.target_radius,
+                               best_location, best, cast, hit);
+        }
+        else if (node.kind == CompiledNode::PLANE) {
+            plane_portal(w, node, best_t, best, cast, hit);
+        }
+        else {
+            shape_hit.resolver()->resolve_hit(cast, shape_hit, hit);
+        }
+    }
+
+    // The portal hit for a cast crossing a plane node at parameter t, as
+    // Plane::portal_hit but with the transform composed beforehand.
+    void plane_portal(const CompiledWorld& w, const CompiledNode& node, Real t, Real dist2, const RayCast& cast,
+                      RayHit* hit) const {
+        const CompiledPortal& portal = portals[node.portal];
+        Point hit_point = cast.ray.origin + t * cast.ray.direction;
+        hit->type = RayHit::TYPE_PORTAL;
+        hit->distance2 = dist2;
+        hit->portal.size = portal.size;
+        hit->portal.scale = 1;
+        hit->portal.curvature = 0;
+        if (portal.world < 0) {
+            hit->portal.new_cast = cast.rebase(hit_point, Vec(node.data[3], node.data[4], node.data[5]));
+            return;
+        }
+        RayCast& out = hit->portal.new_cast;
+        VecT<double> offset = VecT<double>(hit_point.v) - VecT<double>(portal.source[0], portal.source[1], portal.source[2]);
+        out.ray.origin = Point(Vec(VecT<double>(portal.target[0], portal.target[1], portal.target[2])
+                                   + transform(portal, offset)));
+        out.ray.direction = Vec(transform(portal, VecT<double>(cast.ray.direction)));
+        out.world = target(w, portal);
+        out.frame_enabled = false;
+        if (cast.frame_enabled) {
+            out.set_frame(Frame(Vec(transform(portal, VecT<double>(cast.frame.right))),
+                                Vec(transform(portal, VecT<double>(cast.frame.up))),
+                                Vec(transform(portal, VecT<double>(cast.frame.forward)))));
+        }
+    }
+
+    static VecT<double> transform(const CompiledPortal& portal, const VecT<double>& v) {
+        const double (*m)[3] = portal.linear;
+        return VecT<double>(m[0][0]*v.x + m[0][1]*v.y + m[0][2]*v.z,
+                            m[1][0]*v.x + m[1][1]*v.y + m[1][2]*v.z,
+                            m[2][0]*v.x + m[2][1]*v.y + m[2][2]*v.z);
+    }
+
+    // Casts the lanes of `mask` against nodes [first, end), updating each
+    // lane's closest hit.  A box narrows the mask for its contents, and the
+    // outer mask is restored after them.  Split boxes are ordered for the
+    // first active lane; coherent packets mostly agree with it.
+    void packet_cast_nodes(int first, int end, const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        Range stack[2*SceneCompiler::MAX_BOX_DEPTH];
+        int top = 0;
+        Real dist2[MAX_PACKET];
+        long tests = 0, rejections = 0, shape_tests = 0;
+
+        int i = first;
+        for (;;) {
+            if (i >= end) {
+                if (top == 0) { break; }
+                --top;
+                i = stack[top].begin;
+                end = stack[top].end;
+                mask = stack[top].mask;
+                continue;
+            }
+            const CompiledNode& node = nodes[i];
+            switch (node.kind) {
+            case CompiledNode::BOX: {
+                Bounds box(Point(node.data[0], node.data[1], node.data[2]),
+                           Point(node.data[3], node.data[4], node.data[5]));
+                PacketMask inside = box_packet_cull(packet, box, mask, hit->distance2);
+                tests += mask_count(mask);
+                rejections += mask_count(mask & ~inside);
+                if (!inside) {
+                    i = node.next;
+                    continue;
+                }
+                Range after = { node.next, end, mask };
+                stack[top++] = after;
+                mask = inside;
+                end = node.next;
+                if (node.second >= 0) {
+                    int lead = 0;
+                    while (!(inside & (1u << lead))) { lead++; }
+                    Real lead_direction = node.axis == 0 ? packet.dx[lead] : node.axis == 1 ? packet.dy[lead] : packet.dz[lead];
+                    if (lead_direction < 0) {
+                        Range far = { i + 1, node.second, inside };
+                        stack[top++] = far;
+                        i = node.second;
+                        continue;
+                    }
+                }
+                break;
+            }
+            case CompiledNode::SPHERE:
+                shape_tests += mask_count(mask);
+                Sphere::packet_kernel(packet, node.data[0], node.data[1], node.data[2], node.data[3], dist2);
+                update(packet, mask, dist2, &primitives[i], hit);
+                break;
+            case CompiledNode::PLANE:
+                shape_tests += mask_count(mask);
+                Plane::packet_kernel(packet, Vec(node.data[0], node.data[1], node.data[2]),
+                                     Vec(node.data[3], node.data[4], node.data[5]), dist2);
+                update(packet, mask, dist2, &primitives[i], hit);
+                break;
+            case CompiledNode::SHAPE:
+                shape_tests += mask_count(mask);
+                node.shape->packet_cast(packet, mask, hit);
+                break;
+            }
+            i++;
+        }
+        count_shape_tests(tests, rejections, shape_tests);
+    }
+
+    static void update(const RayPacket& packet, PacketMask mask, const Real* dist2,
+                       const Shape* shape, PacketHit* hit) {
+        for (int i = 0; i < packet.size; i++) {
+            if (mask & (1u << i)) { hit->update(i, dist2[i], shape); }
+        }
+    }
+
+public:
+    // Compiles `root` and every world reachable from it through portals,
+    // and makes each world's scene its compiled nodes.  The scene must
+    // outlive the worlds' use.
+    static CompiledScene* compile(World* root) {
+        CompiledScene* scene = new CompiledScene;
+        SceneCompiler& ir = scene->ir;
+        ir.world_id(root);
+        // Compiling a world numbers the worlds its portals lead to.
+        for (size_t w = 0; w < ir.worlds.size(); w++) {
+            ir.compile_world(w, ir.worlds[w]->scene);
+        }
+        scene->nodes = ir.nodes.empty() ? NULL : &ir.nodes[0];
+        scene->portals = ir.portals.empty() ? NULL : &ir.portals[0];
+        scene->world_nodes = &ir.world_nodes[0];
+        scene->world_targets = ir.world_targets.empty() ? NULL : &ir.world_targets[0];
+        scene->nodes_size = ir.nodes.size();
+        scene->portals_size = ir.portals.size();
+        scene->targets_size = ir.world_targets.size();
+        scene->worlds = ir.worlds;
+        scene->install();
+        return scene;
+    }
+
+    // Makes worlds for nodes compiled earlier, using the arrays in place,
+    // with a skybox for each world.  World 0 is the root.  The arrays must
+    // outlive the scene, and must have no SHAPE nodes.
+    static CompiledScene* use(const CompiledNode* nodes, int node_count,
+                              const CompiledPortal* portals, int portal_count,
+                              const CompiledWorld* world_nodes, const int* world_targets, int target_count,
+                              const std::vector<Skybox*>& skyboxes) {
+        CompiledScene* scene = new CompiledScene;
+        scene->nodes = nodes;
+        scene->portals = portals;
+        scene->world_nodes = world_nodes;
+        scene->world_targets = world_targets;
+        scene->nodes_size = node_count;
+        scene->portals_size = portal_count;
+        scene->targets_size = target_count;
+        scene->own_worlds.resize(skyboxes.size());
+        for (size_t w = 0; w < skyboxes.size(); w++) {
+            scene->own_worlds[w].skybox = skyboxes[w];
+            scene->own_worlds[w].scene = NULL;
+            scene->worlds.push_back(&scene->own_worlds[w]);
+        }
+        scene->install();
+        return scene;
+    }
+
+    // The scene a world was compiled into, or NULL if it wasn't.
+    static const CompiledScene* of(const World* world) {
+        const CompiledShape* shape = dynamic_cast<const CompiledShape*>(world->scene);
+        return shape ? shape->compiled_scene() : NULL;
+    }
+
+    World* root() const { return worlds[0]; }
+    World* world(int id) const { return worlds[id]; }
+    int world_count() const { return worlds.size(); }
+
+    // A world's id, numbered from 0 at the root in the order portals reach
+    // them, so the same scene file always numbers its worlds the same way.
+    // -1 if the world isn't in this scene.
+    int world_id(const World* world) const {
+        for (size_t w = 0; w < worlds.size(); w++) {
+            if (worlds[w] == world) { return w; }
+        }
+        return -1;
+    }
+    const CompiledWorld* world_node_ranges() const { return world_nodes; }
+    int world_target_count() const { return targets_size; }
+    const int* world_target_array() const { return world_targets; }
+    int node_count() const { return nodes_size; }
+    const CompiledNode* node_array() const { return nodes; }
+    int portal_count() const { return portals_size; }
+    const CompiledPortal* portal_array() const { return portals; }
+
+    // Whether every node is flattened, so the arrays stand on their own.
+    bool self_contained() const {
+        for (int i = 0; i < nodes_size; i++) {
+            if (nodes[i].kind == CompiledNode::SHAPE) { return false; }
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __SHAPES_INSTANCE_H__
+#define __SHAPES_INSTANCE_H__
+
+#include <vector>
+#include "Shapes/Shape.h"
+#include "Shapes/SceneCompiler.h"
+
+// A world's scene made from a body shared with other worlds, with its own
+// portal targets.  The body's portals lead to placeholder worlds, its slots,
+// which are never cast in; an instance maps slot k to targets[k].  So a grid
+// of identical cells is one body, BVHs and all, and a table per cell.
+//
+// Compiled, the body's nodes are compiled once for every instance of it (see
+// SceneCompiler::instance), as long as all its portals lead to slots; if not,
+// the instance is cast through this interface.  Only the outermost instance
+// maps a hit's portal, so a body mustn't hold instances of its own.  The
+// instance doesn't own the body.
+class Instance : public Shape {
+    const Shape* body;
+    std::vector<World*> slots;
+    std::vector<World*> targets;
+public:
+    Instance(const Shape* body, const std::vector<World*>& slots, const std::vector<World*>& targets)
+        : body(body), slots(slots), targets(targets)
+    { }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        if (!body->nearest_hit(cast, best)) { return false; }
+        best->instance = this;
+        return true;
+    }
+
+    void resolve_hit(const RayCast& cast, const HitRecord& record, RayHit* hit) const {
+        record.shape->resolve_hit(cast, record, hit);
+        if (hit->type != RayHit::TYPE_PORTAL) { return; }
+        World*& world = hit->portal.new_cast.world;
+        for (size_t k = 0; k < slots.size(); k++) {
+            if (world == slots[k]) {
+                world = targets[k];
+                break;
+            }
+        }
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
+    }
+
+    Bounds bounds() const { return body->bounds(); }
+
+    bool compile(SceneCompiler* compiler) const {
+        return compiler->instance(this, body, slots, targets);
+    }
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "Shapes/Shape.h"
+#include "Shapes/SceneCompiler.h"
 #include "Vec.h"
 #include "Point.h"
 
@@ -16,19 +17,38 @@ public:
     }
     LinearCompound(const std::vector<Shape*>& shapes) : shapes(shapes) { }
 
-    void ray_cast(const RayCast& cast, RayHit* hit) const {
-        RayHit try_ray;
-        RayHit best_ray;
-        best_ray.type = RayHit::TYPE_MISS;
-        best_ray.distance2 = HUGE_VAL;
+    Bounds bounds() const {
+        Bounds ret;
+        for (std::vector<Shape*>::const_iterator i = shapes.begin(); i != shapes.end(); ++i) {
+            ret.extend((*i)->bounds());
+        }
+        return ret;
+    }
+
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        for (std::vector<Shape*>::const_iterator i = shapes.begin(); i != shapes.end(); ++i) {
+            (*i)->packet_cast(packet, mask, hit);
+        }
+    }
 
+    bool compile(SceneCompiler* compiler) const {
         for (std::vector<Shape*>::const_iterator i = shapes.begin(); i != shapes.end(); ++i) {
-            (*i)->ray_cast(cast, &try_ray);
-            if (try_ray.type != RayHit::TYPE_MISS && try_ray.distance2 < best_ray.distance2) {
-                best_ray = try_ray;
-            }
+            compiler->add(*i);
         }
-        *hit = best_ray;
+        return true;
+    }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        bool found = false;
+        for (std::vector<Shape*>::const_iterator i = shapes.begin(); i != shapes.end(); ++i) {
+            found = (*i)->nearest_hit(cast, best) || found;
+        }
+        count_shape_tests(0, 0, shapes.size());
+        return found;
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
     }
 };
 
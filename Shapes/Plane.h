@@ -1,6 +1,9 @@
 #ifndef __SHAPES_PLANE_H__
 #define __SHAPES_PLANE_H__
 
+#include "Shapes/Shape.h"
+#include "Shapes/SceneCompiler.h"
+#include "Simd.h"
 #include "Vec.h"
 #include "Point.h"
 
@@ -10,10 +13,14 @@ class Plane : public Shape {
 	World* target_world;
 	Point target_origin;
     Frame target_frame;
+    Real size;
 
 public:
-    Plane(const Point& origin, const Frame& frame) 
-        : origin(origin), frame(frame)
+    // `size` is how wide the part of the plane that matters is, if it's
+    // bounded by other walls; rays ending at portals smaller than their
+    // footprint use it.
+    Plane(const Point& origin, const Frame& frame, Real size = HUGE_VAL) 
+        : origin(origin), frame(frame), size(size)
     {
 		target_world = NULL;
 	}
@@ -29,12 +36,75 @@ public:
 		target_frame = frame;
     }
 
-    void ray_cast(const RayCast& cast, RayHit* hit) const {
+    // Fills in the portal hit for a cast crossing a plane at parameter t.
+    // Shared with PlaneSet, which keeps the same fields in arrays.
+    static void portal_hit(const Point& origin, const Frame& frame, World* target_world,
+                           const Point& target_origin, const Frame& target_frame, Real size,
+                           Real t, const RayCast& cast, RayHit* hit) {
+        const Ray& ray = cast.ray;
+        hit->type = RayHit::TYPE_PORTAL;
+        Point hit_point = ray.origin + t * ray.direction;
+        hit->distance2 = (hit_point - ray.origin).norm2();
+        hit->portal.size = size;
+        hit->portal.scale = 1;
+        hit->portal.curvature = 0;
+        if (!target_world) {
+            hit->portal.new_cast = cast.rebase(hit_point, frame.forward);
+        }
+        else {
+            hit->portal.new_cast = cast.rebase(hit_point, origin, frame, target_origin, target_frame);
+            hit->portal.new_cast.world = target_world;
+        }
+    }
+
+    // Same arithmetic as ray_cast, one lane per ray: the distance^2 to the
+    // hit, or HUGE_VAL for a miss.
+    PACKET_KERNEL
+    static void packet_kernel(const RayPacket& p, const Vec& origin, const Vec& normal, Real* out) {
+        for (int i = 0; i < p.size; i++) {
+            Real facing = p.dx[i]*normal.x + p.dy[i]*normal.y + p.dz[i]*normal.z;
+            Real t = ((origin.x - p.ox[i])*normal.x + (origin.y - p.oy[i])*normal.y
+                        + (origin.z - p.oz[i])*normal.z) / facing;
+            Real ex = (p.ox[i] + t*p.dx[i]) - p.ox[i];
+            Real ey = (p.oy[i] + t*p.dy[i]) - p.oy[i];
+            Real ez = (p.oz[i] + t*p.dz[i]) - p.oz[i];
+            bool hit = !(facing > 0) & (t > CAST_EPSILON);
+            out[i] = hit ? ex*ex + ey*ey + ez*ez : Real(HUGE_VAL);
+        }
+    }
+
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        Real dist2[MAX_PACKET];
+        packet_kernel(packet, origin.v, normal(), dist2);
+        for (int i = 0; i < packet.size; i++) {
+            if (mask & (1u << i)) { hit->update(i, dist2[i], this); }
+        }
+    }
+
+    bool compile(SceneCompiler* compiler) const {
+        compiler->plane(origin, frame, target_world, target_origin, target_frame, size);
+        return true;
+    }
+
+    // Records a crossing at parameter t if it's nearer than best, with the
+    // distance portal_hit would find.  Shared with PlaneSet.
+    static bool record_hit(const Ray& ray, Real t, const Shape* shape, int index, HitRecord* best) {
+        Point hit_point = ray.origin + t * ray.direction;
+        Real dist = (hit_point - ray.origin).norm2();
+        if (!(dist < best->distance2)) { return false; }
+        best->distance2 = dist;
+        best->shape = shape;
+        best->t = t;
+        best->index = index;
+        best->instance = NULL;
+        return true;
+    }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
         const Ray& ray = cast.ray;
         // This is a unidirectional plane
         if (ray.direction * normal() > 0) {
-            hit->type = RayHit::TYPE_MISS;
-            return;
+            return false;
         }
 
         // (cast.origin + t * cast.direction - origin) * normal = 0
@@ -42,23 +112,16 @@ public:
         // (cast.origin - origin) * normal = - t * cast.direction * normal
         // -(cast.origin - origin) * normal / (cast.direction * normal) = t
         // (origin - cast.origin) * normal / (cast.direction * normal) = t
-        double t = (origin - ray.origin) * normal() / (ray.direction * normal());
-        if (t > CAST_EPSILON) {
-            hit->type = RayHit::TYPE_PORTAL;
-            Point hit_point = ray.origin + t * ray.direction;
-			hit->distance2 = (hit_point - ray.origin).norm2();
-			if (!target_world)
-			{
-				hit->portal.new_cast = cast.rebase(hit_point, normal());
-			}
-			else {
-				hit->portal.new_cast = cast.rebase(hit_point, origin, frame, target_origin, target_frame);
-				hit->portal.new_cast.world = target_world;
-            }
-        }
-        else {
-            hit->type = RayHit::TYPE_MISS;
-        }
+        Real t = (origin - ray.origin) * normal() / (ray.direction * normal());
+        return t > CAST_EPSILON && record_hit(ray, t, this, 0, best);
+    }
+
+    void resolve_hit(const RayCast& cast, const HitRecord& record, RayHit* hit) const {
+        portal_hit(origin, frame, target_world, target_origin, target_frame, size, record.t, cast, hit);
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
     }
 };
 
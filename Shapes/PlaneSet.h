@@ -0,0 +1,142 @@
+#ifndef __SHAPES_PLANESET_H__
+#define __SHAPES_PLANESET_H__
+
+#include <vector>
+#include "Shapes/Shape.h"
+#include "Shapes/Plane.h"
+#include "Shapes/SceneCompiler.h"
+#include "Simd.h"
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+
+// Many one-sided planes stored as structure-of-arrays.  A cast tests every
+// plane in one vectorized pass over the origins and normals, and only the
+// nearest hit looks at its frame and portal target.  Hits are the same as a
+// LinearCompound of the equivalent Planes.
+class PlaneSet : public Shape {
+    std::vector<Real> px, py, pz;
+    std::vector<Real> nx, ny, nz;
+
+    // Only read for the winning plane.
+    struct Target {
+        Frame frame;
+        World* world;
+        Point origin;
+        Frame target_frame;
+        Real size;
+    };
+    std::vector<Target> targets;
+
+    // Distance^2 from the ray to each plane's hit, or HUGE_VAL; the same
+    // arithmetic as Plane::ray_cast, without branches.  The outputs are
+    // restrict so the loop needs no runtime alias checks, which would stop
+    // it vectorizing.
+    PACKET_KERNEL
+    static void kernel(const Ray& ray, const Real* px, const Real* py, const Real* pz,
+                       const Real* nx, const Real* ny, const Real* nz, int count,
+                       Real* __restrict out, Real* __restrict ts) {
+        Real ox = ray.origin.v.x, oy = ray.origin.v.y, oz = ray.origin.v.z;
+        Real dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+        for (int i = 0; i < count; i++) {
+            Real facing = dx*nx[i] + dy*ny[i] + dz*nz[i];
+            Real t = ((px[i] - ox)*nx[i] + (py[i] - oy)*ny[i] + (pz[i] - oz)*nz[i]) / facing;
+            Real ex = (ox + t*dx) - ox;
+            Real ey = (oy + t*dy) - oy;
+            Real ez = (oz + t*dz) - oz;
+            bool hit = !(facing > 0) & (t > CAST_EPSILON);
+            out[i] = hit ? ex*ex + ey*ey + ez*ez : Real(HUGE_VAL);
+            ts[i] = t;
+        }
+    }
+
+    static const int BLOCK = 64;
+
+    // Index of the nearest plane hit by the ray, or -1, with the hit's ray
+    // parameter.  Ties go to the plane added first.
+    int nearest(const Ray& ray, Real* dist2, Real* t) const {
+        Real dists[BLOCK], ts[BLOCK];
+        int best = -1;
+        *dist2 = HUGE_VAL;
+        int count = px.size();
+        for (int begin = 0; begin < count; begin += BLOCK) {
+            int n = std::min(BLOCK, count - begin);
+            kernel(ray, &px[begin], &py[begin], &pz[begin], &nx[begin], &ny[begin], &nz[begin],
+                   n, dists, ts);
+            for (int i = 0; i < n; i++) {
+                if (dists[i] < *dist2) {
+                    *dist2 = dists[i];
+                    *t = ts[i];
+                    best = begin + i;
+                }
+            }
+        }
+        return best;
+    }
+
+public:
+    // Adds a plane and returns its index in the set.  `size` is as for
+    // Plane.
+    int add(const Point& origin, const Frame& frame, Real size = HUGE_VAL) {
+        px.push_back(origin.v.x);
+        py.push_back(origin.v.y);
+        pz.push_back(origin.v.z);
+        nx.push_back(frame.forward.x);
+        ny.push_back(frame.forward.y);
+        nz.push_back(frame.forward.z);
+        Target target;
+        target.frame = frame;
+        target.world = NULL;
+        target.size = size;
+        targets.push_back(target);
+        return px.size() - 1;
+    }
+
+    void set_target(int index, World* world, const Point& origin, const Frame& frame) {
+        targets[index].world = world;
+        targets[index].origin = origin;
+        targets[index].target_frame = frame;
+    }
+
+    int size() const { return px.size(); }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        Real dist2, t;
+        int i = nearest(cast.ray, &dist2, &t);
+        return i >= 0 && Plane::record_hit(cast.ray, t, this, i, best);
+    }
+
+    void resolve_hit(const RayCast& cast, const HitRecord& record, RayHit* hit) const {
+        int i = record.index;
+        const Target& target = targets[i];
+        Plane::portal_hit(Point(px[i], py[i], pz[i]), target.frame, target.world,
+                          target.origin, target.target_frame, target.size, record.t, cast, hit);
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
+    }
+
+    bool compile(SceneCompiler* compiler) const {
+        for (size_t i = 0; i < targets.size(); i++) {
+            const Target& target = targets[i];
+            compiler->plane(Point(px[i], py[i], pz[i]), target.frame, target.world,
+                            target.origin, target.target_frame, target.size);
+        }
+        return true;
+    }
+
+    // The packet goes through the planes one at a time, a lane of the
+    // kernel per ray, as a LinearCompound of Planes would cast it.
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        Real dist2[MAX_PACKET];
+        for (int s = 0; s < size(); s++) {
+            Plane::packet_kernel(packet, Vec(px[s], py[s], pz[s]), Vec(nx[s], ny[s], nz[s]), dist2);
+            for (int i = 0; i < packet.size; i++) {
+                if (mask & (1u << i)) { hit->update(i, dist2[i], this); }
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef __SHAPES_SCENECOMPILER_H__
+#define __SHAPES_SCENECOMPILER_H__
+
+#include <vector>
+#include <map>
+#include "Shapes/Shape.h"
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+
+// One entry of a compiled world: a box, a primitive, or a Shape the compiler
+// doesn't know, which is cast through its virtual interface.  Nodes are
+// tested in order; a box's contents follow it, and a ray missing the box
+// skips to `next`.  A box split in two like a BVH node has its contents
+// visited nearest half first.
+//
+// Nodes, portals, world ranges and target tables hold no pointers but for
+// SHAPE nodes, so a compiled scene without them can be saved and used in
+// place (see SceneCache.h).
+struct CompiledNode {
+    enum Kind { BOX, SPHERE, PLANE, SHAPE };
+    Kind kind;
+    int next;                   // BOX: the node after its contents
+    int portal;                 // SPHERE, PLANE: index into the portals
+    // BOX: where the second half of a split box's contents starts, or -1,
+    // and the axis it's split along.
+    int second, axis;
+    // BOX: min x,y,z, max x,y,z; SPHERE: center x,y,z, radius;
+    // PLANE: origin x,y,z, normal x,y,z.
+    Real data[6];
+    const Shape* shape;         // SHAPE
+};
+
+// Where a primitive's portal leads, only read for the nearest hit.  Worlds
+// sharing nodes share their portals, so the target is looked up in the
+// casting world's table.
+struct CompiledPortal {
+    int world;                  // index into the world's targets, or -1 to reflect in place
+    Real size, curvature;       // as for RayHit::Portal
+    // SPHERE
+    Point target_center;
+    Real target_radius;
+    // PLANE: the transform from the plane's frame to the target's, composed
+    // at compile time, in double like RayCast::rebase.
+    double linear[3][3];
+    double source[3], target[3];
+};
+
+// The nodes of one world, which instances of a body share, and where its
+// table of target world ids starts in SceneCompiler::world_targets.
+struct CompiledWorld {
+    int first, end;
+    int targets, target_count;
+};
+
+// Builds the node lists of a set of worlds.  Shapes add themselves through
+// Shape::compile; worlds reached through portals are numbered as they're
+// found, so the caller can compile them in turn (see CompiledScene).
+class SceneCompiler {
+public:
+    std::vector<CompiledNode> nodes;
+    std::vector<CompiledPortal> portals;
+    // By world id.
+    std::vector<World*> worlds;
+    std::vector<CompiledWorld> world_nodes;
+    // The worlds' target tables, one after another.
+    std::vector<int> world_targets;
+
+private:
+    std::map<World*, int> ids;
+    int box_depth;
+    int current;                // the world being compiled
+    const Shape* current_scene; // and its scene
+    // While compiling an instance's body, the slot of each placeholder, and
+    // whether everything in it has leant on the slots so far.
+    bool in_body, body_shared;
+    std::map<World*, int> slot_ids;
+    // The nodes of each body compiled, for its other instances; first is -1
+    // for a body that can't be shared.
+    std::map<const Shape*, CompiledWorld> bodies;
+
+    CompiledNode& push(CompiledNode::Kind kind) {
+        nodes.push_back(CompiledNode());
+        CompiledNode& node = nodes.back();
+        node.kind = kind;
+        node.next = nodes.size();
+        node.portal = -1;
+        node.second = -1;
+        node.axis = 0;
+        node.shape = NULL;
+        return node;
+    }
+
+    int push_portal(World* target, Real size, Real curvature) {
+        portals.push_back(CompiledPortal());
+        CompiledPortal& portal = portals.back();
+        portal.world = target ? target_index(target) : -1;
+        portal.size = size;
+        portal.curvature = curvature;
+        return portals.size() - 1;
+    }
+
+    // Where a portal to `target` looks in the current world's table: its
+    // slot in an instance's body, and otherwise its own entry.  A body's
+    // portal to anything but a slot has no entry in its instances' tables,
+    // but its world is still numbered, to be compiled for the instances
+    // cast through the Shape interface.
+    int target_index(World* target) {
+        if (in_body) {
+            std::map<World*, int>::iterator slot = slot_ids.find(target);
+            if (slot != slot_ids.end()) { return slot->second; }
+            world_id(target);
+            body_shared = false;
+            return -1;
+        }
+        int id = world_id(target);
+        int first = world_nodes[current].targets;
+        for (int i = first; i < (int)world_targets.size(); i++) {
+            if (world_targets[i] == id) { return i - first; }
+        }
+        world_targets.push_back(id);
+        return world_targets.size() - 1 - first;
+    }
+
+public:
+    // Deepest nesting of boxes; traversals keep a stack twice this deep.  Boxes nested deeper are left out, which only costs culling.
+    static const int MAX_BOX_DEPTH = 64;
+
+    SceneCompiler() : box_depth(0), current(0), current_scene(NULL), in_body(false), body_shared(false) { }
+
+    // The id of a world, numbering it if it's new.
+    int world_id(World* world) {
+        std::map<World*, int>::iterator i = ids.find(world);
+        if (i != ids.end()) { return i->second; }
+        CompiledWorld w = { 0, 0, 0, 0 };
+        worlds.push_back(world);
+        world_nodes.push_back(w);
+        ids[world] = worlds.size() - 1;
+        return worlds.size() - 1;
+    }
+
+    // Compiles `scene`, the scene of the world numbered w by world_id, into
+    // its nodes and target table.  Worlds are compiled one at a time.
+    void compile_world(int w, const Shape* scene) {
+        current = w;
+        current_scene = scene;
+        int first = nodes.size();
+        world_nodes[w].first = -1;
+        world_nodes[w].targets = world_targets.size();
+        add(scene);
+        if (world_nodes[w].first < 0) {
+            world_nodes[w].first = first;
+            world_nodes[w].end = nodes.size();
+        }
+        world_nodes[w].target_count = world_targets.size() - world_nodes[w].targets;
+    }
+
+    // Compiles `shape`, an instance of `body` whose portals lead to `slots`,
+    // as the current world's scene: the world's table is `targets`, and its
+    // nodes are the body's, compiled by its first instance.  Returns false,
+    // to be cast through the Shape interface, if the instance is only part
+    // of the world's scene, or if the body can't be shared: it has a portal
+    // to something other than a slot, or a shape the compiler doesn't know,
+    // such as another instance, whose portals the tables can't map.
+    // Either way, the targets are numbered, so they're compiled in turn;
+    // within a body, targets that are its slots are placeholders and aren't.
+    bool instance(const Shape* shape, const Shape* body, const std::vector<World*>& slots,
+                  const std::vector<World*>& targets) {
+        for (size_t k = 0; k < targets.size(); k++) {
+            if (!in_body || !slot_ids.count(targets[k])) { world_id(targets[k]); }
+        }
+        if (shape != current_scene || in_body) { return false; }
+        std::map<const Shape*, CompiledWorld>::iterator shared = bodies.find(body);
+        if (shared == bodies.end()) {
+            CompiledWorld range = { (int)nodes.size(), 0, 0, 0 };
+            int first_portal = portals.size();
+            for (size_t k = 0; k < slots.size(); k++) {
+                slot_ids[slots[k]] = k;
+            }
+            in_body = body_shared = true;
+            add(body);
+            in_body = false;
+            slot_ids.clear();
+            if (!body_shared) {
+                nodes.resize(range.first);
+                portals.resize(first_portal);
+                range.first = -1;
+            }
+            range.end = nodes.size();
+            shared = bodies.insert(std::make_pair(body, range)).first;
+        }
+        if (shared->second.first < 0) { return false; }
+        for (size_t k = 0; k < targets.size(); k++) {
+            world_targets.push_back(world_id(targets[k]));
+        }
+        world_nodes[current].first = shared->second.first;
+        world_nodes[current].end = shared->second.end;
+        return true;
+    }
+
+    // Adds a shape, flattened if it knows how.
+    void add(const Shape* shape) {
+        if (!shape->compile(this)) {
+            if (in_body) { body_shared = false; }
+            push(CompiledNode::SHAPE).shape = shape;
+        }
+    }
+
+    // Opens a box; the nodes added until end_box are its contents.
+    int begin_box(const Bounds& bounds) {
+        if (box_depth++ >= MAX_BOX_DEPTH) { return -1; }
+        CompiledNode& node = push(CompiledNode::BOX);
+        node.data[0] = bounds.min.v.x; node.data[1] = bounds.min.v.y; node.data[2] = bounds.min.v.z;
+        node.data[3] = bounds.max.v.x; node.data[4] = bounds.max.v.y; node.data[5] = bounds.max.v.z;
+        return nodes.size() - 1;
+    }
+
+    // Marks where the second half of a box's contents starts, so casts
+    // visit whichever half is nearer along `axis` first.
+    void split_box(int box, int axis) {
+        if (box >= 0) {
+            nodes[box].second = nodes.size();
+            nodes[box].axis = axis;
+        }
+    }
+
+    void end_box(int box) {
+        box_depth--;
+        if (box >= 0) { nodes[box].next = nodes.size(); }
+    }
+
+    void sphere(const Point& center, Real radius, World* target, const Point& target_center, Real target_radius) {
+        int portal = push_portal(target, 2*radius, 1/radius);
+        portals[portal].target_center = target_center;
+        portals[portal].target_radius = target_radius;
+        CompiledNode& node = push(CompiledNode::SPHERE);
+        node.portal = portal;
+        node.data[0] = center.v.x; node.data[1] = center.v.y; node.data[2] = center.v.z;
+        node.data[3] = radius;
+    }
+
+    void plane(const Point& origin, const Frame& frame, World* target,
+               const Point& target_origin, const Frame& target_frame, Real size) {
+        int portal = push_portal(target, size, 0);
+        // RayCast::rebase maps v to dst.to_global(src.to_local(v)), the sum
+        // over k of dst_k (src_k . v).
+        FrameT<double> src(frame), dst(target_frame);
+        const VecT<double>* s[3] = { &src.right, &src.up, &src.forward };
+        const VecT<double>* d[3] = { &dst.right, &dst.up, &dst.forward };
+        CompiledPortal& p = portals[portal];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                p.linear[i][j] = 0;
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            double dk[3] = { d[k]->x, d[k]->y, d[k]->z };
+            double sk[3] = { s[k]->x, s[k]->y, s[k]->z };
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    p.linear[i][j] += dk[i] * sk[j];
+                }
+            }
+        }
+        p.source[0] = origin.v.x; p.source[1] = origin.v.y; p.source[2] = origin.v.z;
+        p.target[0] = target_origin.v.x; p.target[1] = target_origin.v.y; p.target[2] = target_origin.v.z;
+        CompiledNode& node = push(CompiledNode::PLANE);
+        node.portal = portal;
+        node.data[0] = origin.v.x; node.data[1] = origin.v.y; node.data[2] = origin.v.z;
+        node.data[3] = frame.forward.x; node.data[4] = frame.forward.y; node.data[5] = frame.forward.z;
+    }
+
+};
+
+#endif
@@ -1,8 +1,13 @@
 #ifndef __SHAPES_SHAPE_H__
 #define __SHAPES_SHAPE_H__
 
+#include <cmath>
+#include <algorithm>
+#include <cstddef>
+#include "Simd.h"
 #include "Vec.h"
 #include "Point.h"
+#include "Frame.h"
 
 struct World;
 
@@ -42,13 +47,19 @@ struct RayCast {
         return ret;
     }
 
+	// The portal transform is always done in double: its error compounds
+	// along a chain of portals, and single precision visibly drifts.
 	RayCast rebase(Point base, Point source_origin, Frame source_frame, Point dest_origin, Frame dest_frame) const {
+		typedef PointT<double> PointD;
+		typedef VecT<double> VecD;
+		typedef FrameT<double> FrameD;
+		FrameD src(source_frame), dst(dest_frame);
 		RayCast ret;
-		ret.ray.origin = dest_origin + dest_frame.to_global(source_frame.to_local(base - source_origin));
-		ret.ray.direction = dest_frame.to_global(source_frame.to_local(ray.direction));
+		ret.ray.origin = Point(PointD(dest_origin) + dst.to_global(src.to_local(PointD(base) - PointD(source_origin))));
+		ret.ray.direction = Vec(dst.to_global(src.to_local(VecD(ray.direction))));
 		ret.world = world;
 		if (frame_enabled) {
-			ret.set_frame(dest_frame.to_global(source_frame.to_local(frame)));
+			ret.set_frame(Frame(dst.to_global(src.to_local(FrameD(frame)))));
 		}
         return ret;
     }
@@ -60,12 +71,19 @@ struct RayCast {
 };
 
 struct RayHit {
-    double distance2;
+    Real distance2;
 
     enum Type { TYPE_MISS, TYPE_PORTAL, TYPE_OPAQUE } type;
 
     struct Portal {
         RayCast new_cast; 
+        // How the portal changes a bundle of neighbouring rays: the size of
+        // the portal surface, below which the bundle no longer resolves it;
+        // the factor lengths are scaled by on the way through; and the
+        // surface's curvature, which spreads a bundle reflected off it.
+        Real size;
+        Real scale;
+        Real curvature;
     } portal;
     
     struct Opaque {
@@ -73,19 +91,314 @@ struct RayHit {
     } opaque;
 };
 
+// Axis-aligned box.  An empty box has min > max; an unbounded one has
+// infinite extent.
+struct Bounds {
+    Point min, max;
+
+    Bounds() : min(HUGE_VAL, HUGE_VAL, HUGE_VAL), max(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL) { }
+    Bounds(const Point& min, const Point& max) : min(min), max(max) { }
+
+    static Bounds infinite() {
+        return Bounds(Point(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL), Point(HUGE_VAL, HUGE_VAL, HUGE_VAL));
+    }
+
+    bool is_empty() const {
+        return min.v.x > max.v.x || min.v.y > max.v.y || min.v.z > max.v.z;
+    }
+
+    bool is_finite() const {
+        return max.v.x - min.v.x < HUGE_VAL && max.v.y - min.v.y < HUGE_VAL && max.v.z - min.v.z < HUGE_VAL;
+    }
+
+    void extend(const Point& p) {
+        min = Point(std::min(min.v.x, p.v.x), std::min(min.v.y, p.v.y), std::min(min.v.z, p.v.z));
+        max = Point(std::max(max.v.x, p.v.x), std::max(max.v.y, p.v.y), std::max(max.v.z, p.v.z));
+    }
+
+    void extend(const Bounds& b) {
+        if (b.is_empty()) { return; }
+        extend(b.min);
+        extend(b.max);
+    }
+
+    Point center() const {
+        return Point(0.5*(min.v + max.v));
+    }
+
+    Real surface_area() const {
+        if (is_empty()) { return 0; }
+        Vec d = max - min;
+        return 2*(d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+
+    // Slab test.  On a hit, [*tnear, *tfar] is the parameter interval along
+    // the ray inside the box (tnear may be negative if the origin is inside).
+    bool intersect(const Ray& ray, Real* tnear, Real* tfar) const {
+        // http://www.scratchapixel.com/lessons/3d-basic-lessons/lesson-7-intersecting-simple-shapes/ray-box-intersection/
+        const Vec& lo = min.v;
+        const Vec& hi = max.v;
+        const Vec& o = ray.origin.v;
+        Real invx = 1/ray.direction.x;
+        Real invy = 1/ray.direction.y;
+        Real invz = 1/ray.direction.z;
+
+        Real tmin = ((invx < 0 ? hi.x : lo.x) - o.x) * invx;
+        Real tmax = ((invx < 0 ? lo.x : hi.x) - o.x) * invx;
+        Real tymin = ((invy < 0 ? hi.y : lo.y) - o.y) * invy;
+        Real tymax = ((invy < 0 ? lo.y : hi.y) - o.y) * invy;
+        if ((tmin > tymax) || (tymin > tmax)) { return false; }
+        if (tymin > tmin) { tmin = tymin; }
+        if (tymax < tmax) { tmax = tymax; }
+
+        Real tzmin = ((invz < 0 ? hi.z : lo.z) - o.z) * invz;
+        Real tzmax = ((invz < 0 ? lo.z : hi.z) - o.z) * invz;
+        if ((tmin > tzmax) || (tzmin > tmax)) { return false; }
+        if (tzmin > tmin) { tmin = tzmin; }
+        if (tzmax < tmax) { tmax = tzmax; }
+
+        *tnear = tmin;
+        *tfar = tmax;
+        return tmax >= 0;
+    }
+};
+
+const int MAX_PACKET = 16;
+
+// Bit i is set if lane i of a packet is active.
+typedef unsigned int PacketMask;
+
+// Up to MAX_PACKET rays in structure-of-arrays layout, so the packet kernels
+// can process one lane per vector element.
+struct RayPacket {
+    int size;
+    Real ox[MAX_PACKET], oy[MAX_PACKET], oz[MAX_PACKET];
+    Real dx[MAX_PACKET], dy[MAX_PACKET], dz[MAX_PACKET];
+    // Reciprocal directions for box tests, and squared direction lengths.
+    Real ix[MAX_PACKET], iy[MAX_PACKET], iz[MAX_PACKET];
+    Real direction2[MAX_PACKET];
+
+    void set(int i, const Ray& ray) {
+        ox[i] = ray.origin.v.x; oy[i] = ray.origin.v.y; oz[i] = ray.origin.v.z;
+        dx[i] = ray.direction.x; dy[i] = ray.direction.y; dz[i] = ray.direction.z;
+        ix[i] = 1/dx[i]; iy[i] = 1/dy[i]; iz[i] = 1/dz[i];
+        direction2[i] = ray.direction.norm2();
+    }
+
+    Ray ray(int i) const {
+        return Ray(Point(ox[i], oy[i], oz[i]), Vec(dx[i], dy[i], dz[i]));
+    }
+};
+
+// The closest hit so far of a cast through the Shape interface, before its
+// portal is worked out: the primitive hit, which resolves it into a RayHit
+// once the cast is over (Shape::resolve_hit), and what it needs to do so.
+// Compounds pass one record down to everything they hold, so only the
+// winning hit ever has its portal rebased.
+class Shape;
+struct HitRecord {
+    Real distance2;             // HUGE_VAL until something is hit
+    const Shape* shape;
+    Real t;                     // ray parameter of the hit, for primitives
+    int index;                  // which primitive of a set
+    // The Instance the hit was made in, which maps its portal to the
+    // instance's own target; NULL if none.  Whatever records a hit clears it.
+    const Shape* instance;
+
+    HitRecord() : distance2(HUGE_VAL), shape(NULL), t(0), index(0), instance(NULL) { }
+
+    // The shape that turns this record into a RayHit.
+    const Shape* resolver() const { return instance ? instance : shape; }
+
+    // Whether nothing a ray along `direction` reaches at parameter t or
+    // later can be nearer than this hit, so a box it enters at t can be
+    // skipped.  With CAST_EPSILON, this bounds the interval of the ray still
+    // worth casting, which shrinks as nearer hits are found.
+    bool beyond(Real t, const Vec& direction) const {
+        return t > 0 && t*t*direction.norm2() > distance2;
+    }
+};
+
+// Closest hit so far for each lane of a packet.  Only the distance and the
+// primitive are recorded; the caller recasts the winning primitive with the
+// scalar ray_cast to get the portal.
+class SceneCompiler;
+struct PacketHit {
+    Real distance2[MAX_PACKET];
+    const Shape* shape[MAX_PACKET];
+
+    void clear(int size) {
+        for (int i = 0; i < size; i++) {
+            distance2[i] = HUGE_VAL;
+            shape[i] = NULL;
+        }
+    }
+
+    void update(int i, Real dist2, const Shape* s) {
+        if (dist2 < distance2[i]) {
+            distance2[i] = dist2;
+            shape[i] = s;
+        }
+    }
+};
+
+// Slab test of the lanes of `mask` against a box.  Returns the lanes whose
+// ray enters the box in front of the origin and no further than the lane's
+// closest hit so far.  Hit distances are squared, so the entry distance is
+// compared scaled by the squared length of the direction.
+PACKET_KERNEL
+static PacketMask box_packet_cull(const RayPacket& p, const Bounds& box, PacketMask mask,
+                                  const Real* closest2) {
+    const Vec& lo = box.min.v;
+    const Vec& hi = box.max.v;
+    // Kept lanes as Reals, 1 or 0: an array of bools can't share a vector
+    // layout with the Reals, and stops the loop vectorizing.
+    Real keep[MAX_PACKET];
+    for (int i = 0; i < p.size; i++) {
+        Real tx0 = ((p.ix[i] < 0 ? hi.x : lo.x) - p.ox[i]) * p.ix[i];
+        Real tx1 = ((p.ix[i] < 0 ? lo.x : hi.x) - p.ox[i]) * p.ix[i];
+        Real ty0 = ((p.iy[i] < 0 ? hi.y : lo.y) - p.oy[i]) * p.iy[i];
+        Real ty1 = ((p.iy[i] < 0 ? lo.y : hi.y) - p.oy[i]) * p.iy[i];
+        Real tz0 = ((p.iz[i] < 0 ? hi.z : lo.z) - p.oz[i]) * p.iz[i];
+        Real tz1 = ((p.iz[i] < 0 ? lo.z : hi.z) - p.oz[i]) * p.iz[i];
+        // Plain selects rather than std::min/max: library calls can't be
+        // inlined into a target-cloned kernel.
+        Real t0 = tx0 > ty0 ? tx0 : ty0;
+        Real t1 = tx1 < ty1 ? tx1 : ty1;
+        Real tnear = t0 > tz0 ? t0 : tz0;
+        Real tfar = t1 < tz1 ? t1 : tz1;
+        // & rather than &&, so every comparison is made in every lane and
+        // the loop has no branches to stop it vectorizing.
+        bool inside = (tnear <= tfar) & (tfar >= 0) &
+                      !((tnear > 0) & (tnear*tnear*p.direction2[i] > closest2[i]));
+        keep[i] = inside ? 1 : 0;
+    }
+    PacketMask out = 0;
+    for (int i = 0; i < p.size; i++) {
+        out |= PacketMask(keep[i] != 0) << i;
+    }
+    return out & mask;
+}
+
+// Bounding box tests, how many of them culled the ray, and tests of the
+// shapes inside, counted per thread.  Render threads point shape_counters()
+// at their own counters while tracing (see TraceStats); elsewhere it's NULL
+// and nothing is counted.  Packet tests count one per active lane.  Shape
+// tests are of compiled primitives, and of the children of compounds cast
+// through the Shape interface, where a PlaneSet or SphereSet counts once.
+struct ShapeCounters {
+    long box_tests, box_rejections;
+    long shape_tests;
+    ShapeCounters() : box_tests(0), box_rejections(0), shape_tests(0) { }
+};
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+inline ShapeCounters*& shape_counters() {
+    static THREAD_LOCAL ShapeCounters* counters = NULL;
+    return counters;
+}
+
+inline void count_shape_tests(long box_tests, long box_rejections, long shape_tests) {
+    if (ShapeCounters* counters = shape_counters()) {
+        counters->box_tests += box_tests;
+        counters->box_rejections += box_rejections;
+        counters->shape_tests += shape_tests;
+    }
+}
+
+inline int mask_count(PacketMask mask) {
+    int count = 0;
+    for (; mask; mask &= mask - 1) { count++; }
+    return count;
+}
+
+// Counts a packet box test of the lanes of `mask`, `inside` of which went on.
+inline void count_packet_box_test(PacketMask mask, PacketMask inside) {
+    if (ShapeCounters* counters = shape_counters()) {
+        counters->box_tests += mask_count(mask);
+        counters->box_rejections += mask_count(mask & ~inside);
+    }
+}
+
 class Shape {
 public:
     virtual ~Shape() {}
 
     virtual void ray_cast(const RayCast& cast, RayHit* hit) const = 0;
+
+    // Records a hit nearer than best->distance2, if there is one, and
+    // returns whether there was; ties keep the earlier hit.  The default
+    // casts with ray_cast and has resolve_hit cast again, which is always
+    // correct; primitives record the hit without its portal, and compounds
+    // pass `best` to their contents, so boxes farther than it are culled.
+    virtual bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        RayHit hit;
+        ray_cast(cast, &hit);
+        if (hit.type == RayHit::TYPE_MISS || !(hit.distance2 < best->distance2)) { return false; }
+        best->distance2 = hit.distance2;
+        best->shape = this;
+        best->instance = NULL;
+        return true;
+    }
+
+    // Fills in the whole hit for a record this shape made in nearest_hit.
+    virtual void resolve_hit(const RayCast& cast, const HitRecord& record, RayHit* hit) const {
+        ray_cast(cast, hit);
+    }
+
+    // Casts the active lanes of a packet, updating each lane's closest hit.
+    // The default casts one lane at a time and records this shape as the hit,
+    // which is always correct but gains nothing from the packet.
+    virtual void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        RayHit lane_hit;
+        for (int i = 0; i < packet.size; i++) {
+            if (!(mask & (1u << i))) { continue; }
+            ray_cast(RayCast(packet.ray(i), NULL), &lane_hit);
+            if (lane_hit.type != RayHit::TYPE_MISS) {
+                hit->update(i, lane_hit.distance2, this);
+            }
+        }
+    }
+
+    // A box containing everything this shape can hit.  Shapes that don't
+    // know their extent are treated as unbounded.
+    virtual Bounds bounds() const { return Bounds::infinite(); }
+
+    // Adds this shape's nodes to a compiled scene and returns true, or
+    // returns false to be cast through this interface from the scene.
+    virtual bool compile(SceneCompiler* compiler) const { return false; }
+
+protected:
+    // ray_cast for shapes that implement nearest_hit.
+    void cast_nearest(const RayCast& cast, RayHit* hit) const {
+        HitRecord best;
+        if (nearest_hit(cast, &best)) { best.resolver()->resolve_hit(cast, best, hit); }
+        else { hit->type = RayHit::TYPE_MISS; }
+    }
 };
 
 class EmptyShape : public Shape {
 public:
 	void ray_cast(const RayCast& cast, RayHit* hit) const
 	{ hit->type = RayHit::TYPE_MISS; }
+
+	bool nearest_hit(const RayCast& cast, HitRecord* best) const
+	{ return false; }
+
+	Bounds bounds() const { return Bounds(); }
+
+	void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const
+	{ }
+
+	bool compile(SceneCompiler* compiler) const
+	{ return true; }
 };
 
-const double CAST_EPSILON = 0.001;
+const Real CAST_EPSILON = 0.001;
 
 #endif
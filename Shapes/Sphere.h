@@ -3,31 +3,38 @@
 
 #include <cmath>
 #include "Shapes/Shape.h"
+#include "Shapes/SceneCompiler.h"
+#include "Simd.h"
 #include "Vec.h"
 #include "Point.h"
 
 class Sphere : public Shape {
     Point center;
-    double radius;
+    Real radius;
 
     World* target_world;
     Point target_center;
-    double target_radius;
+    Real target_radius;
 public:
-    Sphere(const Point& center, double radius)
+    Sphere(const Point& center, Real radius)
         : center(center), radius(radius), target_world(NULL)
     {
 		target_world = NULL;
 	}
 
-    void set_target(World* world, Point c, double r) {
+    void set_target(World* world, Point c, Real r) {
         target_world = world;
         target_center = c;
         target_radius = r;
     }
 
-    void compute_reflect(const Point& location, double dist, const RayCast cast, RayHit* hit) const {
-        Vec normal = normal_at(location);
+    // Fills in the portal hit for a cast reaching the surface of a sphere at
+    // `location`, or a miss if the cast arrives from inside.  Shared with
+    // SphereSet, which keeps the same fields in arrays.
+    static void portal_hit(const Point& center, Real radius, World* target_world,
+                           const Point& target_center, Real target_radius,
+                           const Point& location, Real dist, const RayCast& cast, RayHit* hit) {
+        Vec normal = (location - center) / radius;
         // This check orients the sphere outward, so it's invisible from the inside,
         // and so we don't get trapped inside it.
         if (normal * cast.ray.direction > 0) { 
@@ -37,42 +44,138 @@ public:
             hit->type = RayHit::TYPE_PORTAL;
             hit->distance2 = dist;
             hit->portal.new_cast = cast.rebase(location, normal);
+            hit->portal.size = 2*radius;
+            hit->portal.scale = 1;
+            hit->portal.curvature = 1/radius;
             if (target_world) {
                 hit->portal.new_cast.world = target_world;
                 hit->portal.new_cast.ray.origin = target_center + target_radius * normal;
+                hit->portal.scale = target_radius / radius;
             }
         }
     }
 
-    void ray_cast(const RayCast& cast, RayHit* hit) const {
-        const Ray& ray = cast.ray;
-        double A = ray.direction.norm2();
-        double B = 2*(ray.origin - center) * ray.direction;
-        double C = (ray.origin - center).norm2() - radius*radius;
+    // The intersection of a ray with a sphere that ray_cast uses, if any,
+    // and its ray parameter.
+    static bool intersect(const Point& center, Real radius, const Ray& ray, Point* location, Real* dist,
+                          Real* t = NULL) {
+        Real A = ray.direction.norm2();
+        Real B = 2*(ray.origin - center) * ray.direction;
+        Real C = (ray.origin - center).norm2() - radius*radius;
 
-        double disc = B*B - 4*A*C;
+        Real disc = B*B - 4*A*C;
         if (disc < 0) {
-            hit->type = RayHit::TYPE_MISS;
+            return false;
         }
-        else {
-            double sqrt_disc = std::sqrt(disc);
-            double denom = 1/(2*A);
-            double t1 = (-B + sqrt_disc) * denom;
-            double t2 = (-B - sqrt_disc) * denom;
-            Point hit1 = ray.origin + t1*ray.direction;
-            Point hit2 = ray.origin + t2*ray.direction;
-            double dist1 = (hit1 - ray.origin).norm2();
-            double dist2 = (hit2 - ray.origin).norm2();
-            if (t1 > CAST_EPSILON && dist1 <= dist2) {
-                compute_reflect(hit1, dist1, cast, hit);
-            }
-            else if (t2 > CAST_EPSILON) {
-                compute_reflect(hit2, dist2, cast, hit);
-            }
-            else {
-                hit->type = RayHit::TYPE_MISS;
-            }
+        Real sqrt_disc = std::sqrt(disc);
+        Real denom = 1/(2*A);
+        Real t1 = (-B + sqrt_disc) * denom;
+        Real t2 = (-B - sqrt_disc) * denom;
+        Point hit1 = ray.origin + t1*ray.direction;
+        Point hit2 = ray.origin + t2*ray.direction;
+        Real dist1 = (hit1 - ray.origin).norm2();
+        Real dist2 = (hit2 - ray.origin).norm2();
+        if (t1 > CAST_EPSILON && dist1 <= dist2) {
+            *location = hit1;
+            *dist = dist1;
+            if (t) { *t = t1; }
+            return true;
+        }
+        else if (t2 > CAST_EPSILON) {
+            *location = hit2;
+            *dist = dist2;
+            if (t) { *t = t2; }
+            return true;
         }
+        return false;
+    }
+
+    // Records the hit of a ray on a sphere if it's nearer than best and
+    // the sphere faces the ray there, as portal_hit would find it.  Shared
+    // with SphereSet.
+    static bool record_hit(const Point& center, Real radius, const Ray& ray, const Shape* shape, int index,
+                           HitRecord* best) {
+        Point location;
+        Real dist, t;
+        if (!intersect(center, radius, ray, &location, &dist, &t) || !(dist < best->distance2)
+                || (location - center) / radius * ray.direction > 0) {
+            return false;
+        }
+        best->distance2 = dist;
+        best->shape = shape;
+        best->t = t;
+        best->index = index;
+        best->instance = NULL;
+        return true;
+    }
+
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        return record_hit(center, radius, cast.ray, this, 0, best);
+    }
+
+    // The hit point is found again from the ray parameter the way intersect
+    // found it, so it's the same point.
+    void resolve_hit(const RayCast& cast, const HitRecord& record, RayHit* hit) const {
+        Point location = cast.ray.origin + record.t*cast.ray.direction;
+        portal_hit(center, radius, target_world, target_center, target_radius, location, record.distance2, cast, hit);
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
+    }
+
+    // Same arithmetic as ray_cast, one lane per ray: the distance^2 to the
+    // front-facing hit, or HUGE_VAL for a miss.
+    PACKET_KERNEL
+    static void packet_kernel(const RayPacket& p, Real cx, Real cy, Real cz, Real radius, Real* out) {
+        Real r2 = radius*radius;
+        Real inv_radius = 1/radius;
+        for (int i = 0; i < p.size; i++) {
+            Real ocx = p.ox[i] - cx;
+            Real ocy = p.oy[i] - cy;
+            Real ocz = p.oz[i] - cz;
+            Real A = p.dx[i]*p.dx[i] + p.dy[i]*p.dy[i] + p.dz[i]*p.dz[i];
+            Real B = 2*ocx*p.dx[i] + 2*ocy*p.dy[i] + 2*ocz*p.dz[i];
+            Real C = ocx*ocx + ocy*ocy + ocz*ocz - r2;
+            Real disc = B*B - 4*A*C;
+            Real sqrt_disc = KERNEL_SQRT(disc < 0 ? 0 : disc);
+            Real denom = 1/(2*A);
+            Real t1 = (-B + sqrt_disc) * denom;
+            Real t2 = (-B - sqrt_disc) * denom;
+            Real x1 = p.ox[i] + t1*p.dx[i], y1 = p.oy[i] + t1*p.dy[i], z1 = p.oz[i] + t1*p.dz[i];
+            Real x2 = p.ox[i] + t2*p.dx[i], y2 = p.oy[i] + t2*p.dy[i], z2 = p.oz[i] + t2*p.dz[i];
+            Real ex1 = x1 - p.ox[i], ey1 = y1 - p.oy[i], ez1 = z1 - p.oz[i];
+            Real ex2 = x2 - p.ox[i], ey2 = y2 - p.oy[i], ez2 = z2 - p.oz[i];
+            Real dist1 = ex1*ex1 + ey1*ey1 + ez1*ez1;
+            Real dist2 = ex2*ex2 + ey2*ey2 + ez2*ez2;
+            // Both roots are worked out in every lane and the front one
+            // selected, with no branches, so the loop vectorizes.
+            bool first = (t1 > CAST_EPSILON) & (dist1 <= dist2);
+            bool hit = (disc >= 0) & (first | (t2 > CAST_EPSILON));
+            Real nx = inv_radius*((first ? x1 : x2) - cx);
+            Real ny = inv_radius*((first ? y1 : y2) - cy);
+            Real nz = inv_radius*((first ? z1 : z2) - cz);
+            bool facing = nx*p.dx[i] + ny*p.dy[i] + nz*p.dz[i] > 0;
+            out[i] = hit & !facing ? (first ? dist1 : dist2) : Real(HUGE_VAL);
+        }
+    }
+
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        Real dist2[MAX_PACKET];
+        packet_kernel(packet, center.v.x, center.v.y, center.v.z, radius, dist2);
+        for (int i = 0; i < packet.size; i++) {
+            if (mask & (1u << i)) { hit->update(i, dist2[i], this); }
+        }
+    }
+
+    Bounds bounds() const {
+        Vec r(radius, radius, radius);
+        return Bounds(center - r, center + r);
+    }
+
+    bool compile(SceneCompiler* compiler) const {
+        compiler->sphere(center, radius, target_world, target_center, target_radius);
+        return true;
     }
 
     Vec normal_at(const Point& p) const {
@@ -0,0 +1,202 @@
+#ifndef __SHAPES_SPHERESET_H__
+#define __SHAPES_SPHERESET_H__
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "Shapes/Shape.h"
+#include "Shapes/Sphere.h"
+#include "Shapes/SceneCompiler.h"
+#include "Simd.h"
+#include "Vec.h"
+#include "Point.h"
+
+// Many spheres stored as structure-of-arrays.  A cast tests every sphere in
+// one vectorized pass over the centers and radii, and only the nearest hit
+// looks at its portal target.  Hits are the same as a LinearCompound of the
+// equivalent Spheres.
+class SphereSet : public Shape {
+    std::vector<Real> cx, cy, cz, radii;
+
+    // Only read for the winning sphere.
+    struct Target {
+        World* world;
+        Point center;
+        Real radius;
+    };
+    std::vector<Target> targets;
+
+    static const int BLOCK = 64;
+
+    // Distance^2 from the ray to each sphere's front-facing hit, or
+    // HUGE_VAL; the same arithmetic as Sphere::ray_cast, without branches
+    // as Sphere::packet_kernel.  `out` is restrict so the loop needs no
+    // runtime alias checks, which would stop it vectorizing.
+    PACKET_KERNEL
+    static void kernel(const Ray& ray, const Real* cx, const Real* cy, const Real* cz,
+                       const Real* radii, int count, Real* __restrict out) {
+        Real ox = ray.origin.v.x, oy = ray.origin.v.y, oz = ray.origin.v.z;
+        Real dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+        Real A = dx*dx + dy*dy + dz*dz;
+        Real denom = 1/(2*A);
+        for (int i = 0; i < count; i++) {
+            Real ocx = ox - cx[i];
+            Real ocy = oy - cy[i];
+            Real ocz = oz - cz[i];
+            Real B = 2*ocx*dx + 2*ocy*dy + 2*ocz*dz;
+            Real C = ocx*ocx + ocy*ocy + ocz*ocz - radii[i]*radii[i];
+            Real disc = B*B - 4*A*C;
+            Real sqrt_disc = KERNEL_SQRT(disc < 0 ? 0 : disc);
+            Real t1 = (-B + sqrt_disc) * denom;
+            Real t2 = (-B - sqrt_disc) * denom;
+            Real x1 = ox + t1*dx, y1 = oy + t1*dy, z1 = oz + t1*dz;
+            Real x2 = ox + t2*dx, y2 = oy + t2*dy, z2 = oz + t2*dz;
+            Real ex1 = x1 - ox, ey1 = y1 - oy, ez1 = z1 - oz;
+            Real ex2 = x2 - ox, ey2 = y2 - oy, ez2 = z2 - oz;
+            Real dist1 = ex1*ex1 + ey1*ey1 + ez1*ez1;
+            Real dist2 = ex2*ex2 + ey2*ey2 + ez2*ez2;
+            bool first = (t1 > CAST_EPSILON) & (dist1 <= dist2);
+            bool hit = (disc >= 0) & (first | (t2 > CAST_EPSILON));
+            Real inv_radius = 1/radii[i];
+            Real nx = inv_radius*((first ? x1 : x2) - cx[i]);
+            Real ny = inv_radius*((first ? y1 : y2) - cy[i]);
+            Real nz = inv_radius*((first ? z1 : z2) - cz[i]);
+            bool facing = nx*dx + ny*dy + nz*dz > 0;
+            out[i] = hit & !facing ? (first ? dist1 : dist2) : Real(HUGE_VAL);
+        }
+    }
+
+    // Index of the nearest sphere hit by the ray, or -1.  Ties go to the
+    // sphere added first.
+    int nearest(const Ray& ray, Real* dist2) const {
+        Real dists[BLOCK];
+        int best = -1;
+        *dist2 = HUGE_VAL;
+        int count = radii.size();
+        for (int begin = 0; begin < count; begin += BLOCK) {
+            int n = std::min(BLOCK, count - begin);
+            kernel(ray, &cx[begin], &cy[begin], &cz[begin], &radii[begin], n, dists);
+            for (int i = 0; i < n; i++) {
+                if (dists[i] < *dist2) {
+                    *dist2 = dists[i];
+                    best = begin + i;
+                }
+            }
+        }
+        return best;
+    }
+
+public:
+    // Adds a sphere and returns its index in the set.
+    int add(const Point& center, Real radius) {
+        cx.push_back(center.v.x);
+        cy.push_back(center.v.y);
+        cz.push_back(center.v.z);
+        radii.push_back(radius);
+        Target target;
+        target.world = NULL;
+        target.radius = 0;
+        targets.push_back(target);
+        return radii.size() - 1;
+    }
+
+    void set_target(int index, World* world, Point c, Real r) {
+        targets[index].world = world;
+        targets[index].center = c;
+        targets[index].radius = r;
+    }
+
+    int size() const { return radii.size(); }
+
+    Bounds bounds() const {
+        Bounds ret;
+        for (int i = 0; i < size(); i++) {
+            Vec r(radii[i], radii[i], radii[i]);
+            Point center(cx[i], cy[i], cz[i]);
+            ret.extend(Bounds(center - r, center + r));
+        }
+        return ret;
+    }
+
+    // The winner is intersected again singly, so its distance is exactly
+    // what a Sphere would record.
+    bool nearest_hit(const RayCast& cast, HitRecord* best) const {
+        Real dist2;
+        int i = nearest(cast.ray, &dist2);
+        return i >= 0 && Sphere::record_hit(Point(cx[i], cy[i], cz[i]), radii[i], cast.ray, this, i, best);
+    }
+
+    void resolve_hit(const RayCast& cast, const HitRecord& record, RayHit* hit) const {
+        int i = record.index;
+        const Target& target = targets[i];
+        Sphere::portal_hit(Point(cx[i], cy[i], cz[i]), radii[i], target.world, target.center, target.radius,
+                           cast.ray.origin + record.t*cast.ray.direction, record.distance2, cast, hit);
+    }
+
+    void ray_cast(const RayCast& cast, RayHit* hit) const {
+        cast_nearest(cast, hit);
+    }
+
+    bool compile(SceneCompiler* compiler) const {
+        for (int i = 0; i < size(); i++) {
+            compiler->sphere(Point(cx[i], cy[i], cz[i]), radii[i], targets[i].world,
+                             targets[i].center, targets[i].radius);
+        }
+        return true;
+    }
+
+    // The packet goes through the spheres one at a time, a lane of the
+    // kernel per ray, as a LinearCompound of Spheres would cast it.
+    void packet_cast(const RayPacket& packet, PacketMask mask, PacketHit* hit) const {
+        Real dist2[MAX_PACKET];
+        for (int s = 0; s < size(); s++) {
+            Sphere::packet_kernel(packet, cx[s], cy[s], cz[s], radii[s], dist2);
+            for (int i = 0; i < packet.size; i++) {
+                if (mask & (1u << i)) { hit->update(i, dist2[i], this); }
+            }
+        }
+    }
+};
+
+// A sphere waiting to be grouped by make_sphere_clusters.
+struct SphereSpec {
+    Point center;
+    Real radius;
+    SphereSpec(const Point& center, Real radius) : center(center), radius(radius) { }
+};
+
+struct SphereSpecLess {
+    int axis;
+    bool operator() (const SphereSpec& a, const SphereSpec& b) const {
+        return axis == 0 ? a.center.v.x < b.center.v.x :
+               axis == 1 ? a.center.v.y < b.center.v.y : a.center.v.z < b.center.v.z;
+    }
+};
+
+// Groups untargeted spheres into spatially tight SphereSets of at most
+// `cluster` spheres, by recursive median splits along the widest axis.
+// The sets are appended to `out`, ready to go under a BVH.
+inline void make_sphere_clusters(std::vector<SphereSpec>& spheres, int begin, int end, int cluster,
+                                 std::vector<Shape*>* out) {
+    if (end - begin <= cluster) {
+        SphereSet* set = new SphereSet;
+        for (int i = begin; i < end; i++) {
+            set->add(spheres[i].center, spheres[i].radius);
+        }
+        out->push_back(set);
+        return;
+    }
+    Bounds centers;
+    for (int i = begin; i < end; i++) {
+        centers.extend(spheres[i].center);
+    }
+    Vec extent = centers.max - centers.min;
+    SphereSpecLess less;
+    less.axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : extent.y >= extent.z ? 1 : 2;
+    int mid = begin + (end - begin)/2;
+    std::nth_element(spheres.begin() + begin, spheres.begin() + mid, spheres.begin() + end, less);
+    make_sphere_clusters(spheres, begin, mid, cluster, out);
+    make_sphere_clusters(spheres, mid, end, cluster, out);
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "Vec.h"
+
+// Runtime instruction set selection for the ray packet kernels.  With GCC on
+// x86-64 Linux each PACKET_KERNEL function is compiled for AVX-512, AVX2 and
+// the SSE2 baseline, and the loader picks the best version for the CPU.
+// Elsewhere the kernels are plain loops compiled for the build's target.
+//
+// A kernel's loop only vectorizes if it has no branches: every lane does all
+// the arithmetic, conditions are combined with & and |, and results are
+// chosen with selects.  Comparisons may then be made on lanes whose values
+// are meaningless, so kernels ignore floating-point traps; and they don't
+// contract into FMAs, so they produce the same results as the scalar path.
+// sqrt vectorizes only without errno, which the optimize attribute can't turn
+// off in GCC 12, so the Makefile builds with -fno-math-errno.  Check what
+// vectorizes with -fopt-info-vec.
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+#define PACKET_DISPATCH 1
+#define PACKET_KERNEL __attribute__((target_clones("avx512f", "avx2", "default"), \
+                                     optimize("no-trapping-math", "fp-contract=off", \
+                                              "vect-cost-model=dynamic")))
+// Square root of a Real in a kernel.  std::sqrt(float) is a library inline
+// that can't be inlined into a target clone, so the builtin is called.
+#ifdef RAYTRACE_FLOAT
+#define KERNEL_SQRT __builtin_sqrtf
+#else
+#define KERNEL_SQRT __builtin_sqrt
+#endif
+#else
+#define PACKET_DISPATCH 0
+#define PACKET_KERNEL
+#define KERNEL_SQRT std::sqrt
+#endif
+
+// Rays per packet that fill two vector registers of Reals on this CPU, up
+// to MAX_PACKET: in double 16 for AVX-512, 8 for AVX2, 4 for SSE2, and
+// twice that (capped at 16) in float.
+inline int native_packet_size() {
+    int register_bytes = 16;
+#if PACKET_DISPATCH
+    if (__builtin_cpu_supports("avx512f")) { register_bytes = 64; }
+    else if (__builtin_cpu_supports("avx2")) { register_bytes = 32; }
+#endif
+    int size = 2*register_bytes / int(sizeof(Real));
+    return size < 16 ? size : 16;
+}
+
+inline const char* native_simd_name() {
+#if PACKET_DISPATCH
+    if (__builtin_cpu_supports("avx512f")) { return "AVX-512"; }
+    if (__builtin_cpu_supports("avx2")) { return "AVX2"; }
+#endif
+    return "SSE2";
+}
+
+#endif
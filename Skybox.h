@@ -0,0 +1,279 @@
+#ifndef __SKYBOX_H__
+#define __SKYBOX_H__
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "Image.h"
+#include "Vec.h"
+#include "Color.h"
+
+const double PI = 3.14159265358979323846264338327950288;
+
+// A skybox resampled at load time from an equirectangular Image into a mip
+// mapped cube map of packed 8-bit texels.  Lookups pick the face from the
+// direction's major axis, so they need no trig, and filter bilinearly within
+// a level and linearly between levels.  Every face is stored with a one
+// texel border copied from its neighbours, so bilinear taps never need to
+// cross a face edge.
+class Skybox {
+    struct Texel {
+        unsigned char r, g, b, pad;
+    };
+
+    // Faces +X, -X, +Y, -Y, +Z, -Z: the face's major axis, and the axes that
+    // face coordinates s and t increase along.
+    struct Face {
+        Vec major, s, t;
+    };
+
+    int size;                   // texels along a level 0 face edge
+    int levels;
+    std::vector<int> offsets;   // first texel of each level
+    int texel_count;            // of all the levels
+    std::vector<Texel> texels;  // when built here
+    const Texel* data;          // the texels, built here or held elsewhere
+
+    static Face face(int f) {
+        static const Real table[6][9] = {
+            {  1, 0, 0,   0, 0,-1,   0,-1, 0 },
+            { -1, 0, 0,   0, 0, 1,   0,-1, 0 },
+            {  0, 1, 0,   1, 0, 0,   0, 0, 1 },
+            {  0,-1, 0,   1, 0, 0,   0, 0,-1 },
+            {  0, 0, 1,   1, 0, 0,   0,-1, 0 },
+            {  0, 0,-1,  -1, 0, 0,   0,-1, 0 },
+        };
+        const Real* r = table[f];
+        Face ret = { Vec(r[0], r[1], r[2]), Vec(r[3], r[4], r[5]), Vec(r[6], r[7], r[8]) };
+        return ret;
+    }
+
+    // Face and coordinates in [0,1] of a direction.
+    static int project(const Vec& d, Real* u, Real* v) {
+        Real ax = std::fabs(d.x), ay = std::fabs(d.y), az = std::fabs(d.z);
+        int f;
+        Real major, s, t;
+        if (ax >= ay && ax >= az) {
+            f = d.x > 0 ? 0 : 1;
+            major = ax;
+            s = d.x > 0 ? -d.z : d.z;
+            t = -d.y;
+        }
+        else if (ay >= az) {
+            f = d.y > 0 ? 2 : 3;
+            major = ay;
+            s = d.x;
+            t = d.y > 0 ? d.z : -d.z;
+        }
+        else {
+            f = d.z > 0 ? 4 : 5;
+            major = az;
+            s = d.z > 0 ? d.x : -d.x;
+            t = -d.y;
+        }
+        Real scale = Real(0.5) / major;
+        *u = s*scale + Real(0.5);
+        *v = t*scale + Real(0.5);
+        return f;
+    }
+
+    // Direction through the centre of texel (x, y) of a face n texels wide;
+    // x and y may be -1 or n to reach into the border.
+    static Vec direction(int f, int n, int x, int y) {
+        Face fc = face(f);
+        Real s = (2*x + 1) / Real(n) - 1;
+        Real t = (2*y + 1) / Real(n) - 1;
+        return fc.major + s*fc.s + t*fc.t;
+    }
+
+    int level_size(int level) const { return size >> level; }
+
+    Texel* at(int level, int f, int x, int y) {
+        int stride = level_size(level) + 2;
+        return &texels[offsets[level] + (f*stride + y + 1)*stride + x + 1];
+    }
+
+    const Texel* at(int level, int f, int x, int y) const {
+        int stride = level_size(level) + 2;
+        return &data[offsets[level] + (f*stride + y + 1)*stride + x + 1];
+    }
+
+    static Texel pack(Real r, Real g, Real b) {
+        Texel t;
+        t.r = (unsigned char)(clamp<Real>(r, 0, 1)*255 + Real(0.5));
+        t.g = (unsigned char)(clamp<Real>(g, 0, 1)*255 + Real(0.5));
+        t.b = (unsigned char)(clamp<Real>(b, 0, 1)*255 + Real(0.5));
+        t.pad = 0;
+        return t;
+    }
+
+    // Bilinear sample of the equirectangular source, wrapping around the
+    // horizon and clamping at the poles.
+    static Color sample_source(const Image& image, const Vec& dir) {
+        Vec d = dir.unit();
+        Real x = (Real(0.5) + Real(1/(2*PI)) * std::atan2(d.x, d.z)) * image.width() - Real(0.5);
+        Real y = (Real(0.5) + Real(1/PI) * std::asin(-d.y)) * image.height() - Real(0.5);
+        y = clamp<Real>(y, 0, Real(image.height() - 1));
+        int x0 = int(std::floor(x)), y0 = int(y);
+        Real fx = x - x0, fy = y - y0;
+        int y1 = std::min(y0 + 1, image.height() - 1);
+        int w = image.width();
+        int xa = ((x0 % w) + w) % w, xb = (xa + 1) % w;
+        Color c00 = image.texel(xa, y0), c10 = image.texel(xb, y0);
+        Color c01 = image.texel(xa, y1), c11 = image.texel(xb, y1);
+        return (1-fy) * ((1-fx)*c00 + fx*c10) + fy * ((1-fx)*c01 + fx*c11);
+    }
+
+    // Border texels of a level, copied from the interior of the faces their
+    // directions fall in.
+    void fill_borders(int level) {
+        int n = level_size(level);
+        for (int f = 0; f < 6; f++) {
+            for (int y = -1; y <= n; y++) {
+                for (int x = -1; x <= n; x++) {
+                    if (x >= 0 && x < n && y >= 0 && y < n) { continue; }
+                    Real u, v;
+                    int g = project(direction(f, n, x, y), &u, &v);
+                    int gx = std::min(int(u*n), n-1), gy = std::min(int(v*n), n-1);
+                    *at(level, f, x, y) = *at(level, g, gx, gy);
+                }
+            }
+        }
+    }
+
+    Color bilinear(int level, int f, Real u, Real v) const {
+        int n = level_size(level);
+        // u, v in [0,1] put x, y in [-0.5, n-0.5], so the taps stay within
+        // the border.
+        Real x = u*n - Real(0.5), y = v*n - Real(0.5);
+        int x0 = int(x + 1) - 1, y0 = int(y + 1) - 1;
+        // 8-bit fixed point weights keep the blend in integers.
+        int wx = int((x - x0) * 256), wy = int((y - y0) * 256);
+        int w00 = (256-wx)*(256-wy), w10 = wx*(256-wy), w01 = (256-wx)*wy, w11 = wx*wy;
+        const Texel* t0 = at(level, f, x0, y0);
+        const Texel* t1 = t0 + n + 2;
+        int r = w00*t0[0].r + w10*t0[1].r + w01*t1[0].r + w11*t1[1].r;
+        int g = w00*t0[0].g + w10*t0[1].g + w01*t1[0].g + w11*t1[1].g;
+        int b = w00*t0[0].b + w10*t0[1].b + w01*t1[0].b + w11*t1[1].b;
+        Real scale = Real(1/(255.0*65536));
+        return Color(scale*r, scale*g, scale*b);
+    }
+
+    // Fractional mip level for samples `footprint` radians apart.  A level
+    // 0 texel at the centre of a face subtends about 2/size radians.
+    Real level_of(Real footprint) const {
+        if (!(footprint > 0)) { return 0; }
+        Real level = std::log(footprint * size / 2) * Real(1/std::log(2.0));
+        return clamp<Real>(level, 0, Real(levels - 1));
+    }
+
+    Color sample_level(const Vec& direction, Real level) const {
+        Real u, v;
+        int f = project(direction, &u, &v);
+        int lo = int(level);
+        Real blend = level - lo;
+        Color c = bilinear(lo, f, u, v);
+        if (blend > 0 && lo + 1 < levels) {
+            c = (1 - blend) * c + blend * bilinear(lo + 1, f, u, v);
+        }
+        return c;
+    }
+
+    // The mip chain's size and offsets for level 0 faces `face_size` texels
+    // wide.  Returns the number of texels.
+    int layout(int face_size) {
+        size = face_size;
+        levels = 0;
+        offsets.clear();
+        int total = 0;
+        for (int n = size; n >= 1; n /= 2) {
+            offsets.push_back(total);
+            total += 6*(n+2)*(n+2);
+            levels++;
+        }
+        texel_count = total;
+        return total;
+    }
+
+    // Not copyable: data may point into texels.
+    Skybox(const Skybox&);
+    Skybox& operator= (const Skybox&);
+public:
+    explicit Skybox(const char* filename) {
+        build(Image(filename));
+    }
+
+    explicit Skybox(const Image& image) {
+        build(image);
+    }
+
+    // Uses texels built earlier, in place; they must outlive the skybox.
+    Skybox(int face_size, const void* texels) {
+        layout(face_size);
+        data = (const Texel*)texels;
+    }
+
+    // What it takes to rebuild the skybox with the constructor above.
+    int face_size() const { return size; }
+    size_t texel_bytes() const { return texel_count * sizeof(Texel); }
+    const void* texel_data() const { return data; }
+
+    void build(const Image& image) {
+        // Level 0 faces get about the equator's resolution: a face covers a
+        // quarter of the horizon.  Sizes are powers of two so every level
+        // halves exactly.
+        int target = std::max(image.width() / 4, 1);
+        int face_size = 1;
+        while (face_size*2 <= target) { face_size *= 2; }
+        if (face_size*3 < target*2) { face_size *= 2; }
+
+        texels.assign(layout(face_size), Texel());
+        data = &texels[0];
+
+        // Level 0: one bilinear sample of the source per texel, which is
+        // about a source pixel wide at the equator.  Nearer the poles
+        // source rows are squeezed and some pixels are skipped.
+        for (int f = 0; f < 6; f++) {
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    Color c = sample_source(image, direction(f, size, x, y));
+                    *at(0, f, x, y) = pack(c.red, c.green, c.blue);
+                }
+            }
+        }
+        fill_borders(0);
+
+        // Each further level box filters the one above it.
+        for (int level = 1; level < levels; level++) {
+            int n = level_size(level);
+            for (int f = 0; f < 6; f++) {
+                for (int y = 0; y < n; y++) {
+                    for (int x = 0; x < n; x++) {
+                        const Texel* a = at(level-1, f, 2*x, 2*y);
+                        const Texel* b = a + 2*n + 2;
+                        *at(level, f, x, y) = pack((a[0].r + a[1].r + b[0].r + b[1].r) / Real(4*255),
+                                                   (a[0].g + a[1].g + b[0].g + b[1].g) / Real(4*255),
+                                                   (a[0].b + a[1].b + b[0].b + b[1].b) / Real(4*255));
+                    }
+                }
+            }
+            fill_borders(level);
+        }
+    }
+
+    // Colour seen along `direction`, which needn't be unit length, for
+    // samples `footprint` radians apart; 0 samples the full resolution.
+    Color sample(const Vec& direction, Real footprint) const {
+        return sample_level(direction, level_of(footprint));
+    }
+
+    // Samples several directions, each with its own footprint.
+    void sample(const Vec* directions, const Real* footprints, int count, Color* out) const {
+        for (int i = 0; i < count; i++) {
+            out[i] = sample_level(directions[i], level_of(footprints[i]));
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <ostream>
+#include "Render.h"
+#include "Thread.h"
+#include "Timer.h"
+
+// Writes what a frame's rays did, on one line.
+inline void print_trace_stats(std::ostream& out, const TraceStats& stats) {
+    long rays = std::max(stats.rays(), 1L);
+    out << stats.rays() << " rays, " << double(stats.casts) / rays << " casts/ray, portals "
+        << stats.curved_portals << " curved " << stats.flat_portals << " flat, boxes " << stats.shapes.box_tests
+        << " (" << 100.0 * stats.shapes.box_rejections / std::max(stats.shapes.box_tests, 1L) << "% culled), "
+        << stats.shapes.shape_tests << " shape tests, " << stats.skybox_lookups() << " skybox, " << stats.reused << " reused, "
+        << 100.0 * stats.footprint_ended / rays << "% ended by footprint, "
+        << 100.0 * stats.cast_limited / rays << "% at cast limit";
+}
+
+// The last `capacity` values of a quantity, for percentiles.
+class SampleWindow {
+    std::vector<double> samples;
+    size_t capacity, next;
+public:
+    SampleWindow(size_t capacity = 256) : capacity(capacity), next(0) { }
+
+    void add(double value) {
+        if (samples.size() < capacity) { samples.push_back(value); }
+        else { samples[next] = value; }
+        next = (next + 1) % capacity;
+    }
+
+    size_t size() const { return samples.size(); }
+
+    // The value p (0 to 1) of the way through the window when sorted, by
+    // nearest rank; 0 if there are none.
+    double percentile(double p) const {
+        if (samples.empty()) { return 0; }
+        std::vector<double> sorted(samples);
+        size_t rank = std::min(size_t(p * sorted.size()), sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return sorted[rank];
+    }
+};
+
+// Frame times and ray statistics for the interactive view.  The render
+// thread reports each frame's render time and what its rays did, and the
+// display thread its upload and present times; either can read them back.
+// dump writes a summary of the frames since the last dump, including how
+// deep the slowest renders went through portals, so a spike can be told
+// apart from a view down a long chain of portals.
+class FrameTelemetry {
+public:
+    enum Phase { RENDER, UPLOAD, PRESENT, PHASES };
+
+private:
+    // A rendered frame, for relating render time to portal depth.
+    struct RenderRecord {
+        double seconds;
+        double mean_depth;
+        int max_depth;
+    };
+
+    mutable Mutex mutex;
+    SampleWindow times[PHASES];
+    std::deque<RenderRecord> renders;
+    size_t capacity;
+    TraceStats last, period;
+    int period_frames;
+    double period_start;
+
+public:
+    FrameTelemetry(size_t capacity = 256)
+        : capacity(capacity), period_frames(0), period_start(wall_seconds())
+    {
+        for (int i = 0; i < PHASES; i++) { times[i] = SampleWindow(capacity); }
+    }
+
+    void frame_rendered(double seconds, const TraceStats& stats) {
+        Lock lock(mutex);
+        times[RENDER].add(seconds);
+        RenderRecord record = { seconds, stats.mean_depth(), stats.max_depth() };
+        renders.push_back(record);
+        if (renders.size() > capacity) { renders.pop_front(); }
+        last = stats;
+        period.add(stats);
+    }
+
+    void frame_uploaded(double seconds) {
+        Lock lock(mutex);
+        times[UPLOAD].add(seconds);
+    }
+
+    // Counts a frame shown, taking `seconds` to draw and swap.
+    void frame_presented(double seconds) {
+        Lock lock(mutex);
+        times[PRESENT].add(seconds);
+        period_frames++;
+    }
+
+    // Percentile p (0 to 1) of the recent times of a phase, in seconds.
+    double percentile(Phase phase, double p) const {
+        Lock lock(mutex);
+        return times[phase].percentile(p);
+    }
+
+    // The counters of the last frame rendered.
+    TraceStats last_frame() const {
+        Lock lock(mutex);
+        return last;
+    }
+
+    // The counters of the frames rendered since the last dump.
+    TraceStats period_stats() const {
+        Lock lock(mutex);
+        return period;
+    }
+
+    // Writes frames per second and the phase percentiles since the last
+    // dump, and with `counters` the period's ray statistics and the depth
+    // of the slowest renders.  Starts a new period.
+    void dump(std::ostream& out, bool counters) {
+        Lock lock(mutex);
+        double now = wall_seconds();
+        static const char* names[PHASES] = { "render", "upload", "present" };
+        out << "FPS: " << period_frames / std::max(now - period_start, 1e-6) << " ms p50/p95/p99:";
+        for (int i = 0; i < PHASES; i++) {
+            out << " " << names[i] << " " << 1000 * times[i].percentile(0.5) << "/"
+                << 1000 * times[i].percentile(0.95) << "/" << 1000 * times[i].percentile(0.99);
+        }
+        out << "\n";
+        if (counters && !renders.empty()) {
+            out << "  ";
+            print_trace_stats(out, period);
+            out << "\n";
+
+            // Mean portal depth of the renders at or above the 95th
+            // percentile, against all of them.
+            double slow = times[RENDER].percentile(0.95);
+            double slow_depth = 0, all_depth = 0;
+            int slow_count = 0, slow_max = 0;
+            for (size_t i = 0; i < renders.size(); i++) {
+                all_depth += renders[i].mean_depth;
+                if (renders[i].seconds >= slow) {
+                    slow_depth += renders[i].mean_depth;
+                    slow_max = std::max(slow_max, renders[i].max_depth);
+                    slow_count++;
+                }
+            }
+            out << "  portal depth: mean " << all_depth / renders.size() << ", slowest 5% of renders "
+                << slow_depth / std::max(slow_count, 1) << " (max " << slow_max << ")\n";
+        }
+        period.clear();
+        period_frames = 0;
+        period_start = now;
+    }
+};
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+// Minimal threading primitives.  The interactive build uses SDL's threads;
+// headless builds (-DHEADLESS) use POSIX threads so they don't need SDL.
+
+#include <deque>
+
+#ifdef HEADLESS
+#include <pthread.h>
+#include <semaphore.h>
+#else
+#include "SDL.h"
+#include "SDL_thread.h"
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+class Semaphore {
+#ifdef HEADLESS
+    sem_t sem;
+#else
+    SDL_semaphore* sem;
+#endif
+
+    Semaphore(const Semaphore&);
+    Semaphore& operator= (const Semaphore&);
+public:
+    Semaphore(unsigned int value = 0) {
+#ifdef HEADLESS
+        sem_init(&sem, 0, value);
+#else
+        sem = SDL_CreateSemaphore(value);
+#endif
+    }
+
+    ~Semaphore() {
+#ifdef HEADLESS
+        sem_destroy(&sem);
+#else
+        SDL_DestroySemaphore(sem);
+#endif
+    }
+
+    void post() {
+#ifdef HEADLESS
+        sem_post(&sem);
+#else
+        SDL_SemPost(sem);
+#endif
+    }
+
+    void wait() {
+#ifdef HEADLESS
+        while (sem_wait(&sem) != 0) { }  // retry on EINTR
+#else
+        SDL_SemWait(sem);
+#endif
+    }
+
+    // Decrements the count if it's positive, without blocking.  Returns
+    // whether it did.
+    bool try_wait() {
+#ifdef HEADLESS
+        return sem_trywait(&sem) == 0;
+#else
+        return SDL_SemTryWait(sem) == 0;
+#endif
+    }
+};
+
+class Mutex {
+#ifdef HEADLESS
+    pthread_mutex_t mutex;
+#else
+    SDL_mutex* mutex;
+#endif
+
+    Mutex(const Mutex&);
+    Mutex& operator= (const Mutex&);
+public:
+    Mutex() {
+#ifdef HEADLESS
+        pthread_mutex_init(&mutex, NULL);
+#else
+        mutex = SDL_CreateMutex();
+#endif
+    }
+
+    ~Mutex() {
+#ifdef HEADLESS
+        pthread_mutex_destroy(&mutex);
+#else
+        SDL_DestroyMutex(mutex);
+#endif
+    }
+
+    void lock() {
+#ifdef HEADLESS
+        pthread_mutex_lock(&mutex);
+#else
+        SDL_mutexP(mutex);
+#endif
+    }
+
+    void unlock() {
+#ifdef HEADLESS
+        pthread_mutex_unlock(&mutex);
+#else
+        SDL_mutexV(mutex);
+#endif
+    }
+};
+
+// Holds a mutex for the lifetime of the scope.
+class Lock {
+    Mutex& mutex;
+    Lock(const Lock&);
+    Lock& operator= (const Lock&);
+public:
+    Lock(Mutex& mutex) : mutex(mutex) { mutex.lock(); }
+    ~Lock() { mutex.unlock(); }
+};
+
+// A fixed capacity FIFO between threads.  push blocks while it's full and
+// pop while it's empty.
+template<class T>
+class BoundedQueue {
+    Mutex mutex;
+    Semaphore space;
+    Semaphore items;
+    std::deque<T> queue;
+public:
+    BoundedQueue(int capacity) : space(capacity), items(0) { }
+
+    void push(const T& item) {
+        space.wait();
+        {
+            Lock lock(mutex);
+            queue.push_back(item);
+        }
+        items.post();
+    }
+
+    T pop() {
+        items.wait();
+        return take();
+    }
+
+    bool try_pop(T* item) {
+        if (!items.try_wait()) { return false; }
+        *item = take();
+        return true;
+    }
+
+private:
+    T take() {
+        T item;
+        {
+            Lock lock(mutex);
+            item = queue.front();
+            queue.pop_front();
+        }
+        space.post();
+        return item;
+    }
+};
+
+typedef int (*ThreadFunction)(void*);
+
+#ifdef HEADLESS
+struct ThreadStart {
+    ThreadFunction function;
+    void* data;
+
+    static void* trampoline(void* arg) {
+        ThreadStart* start = (ThreadStart*)arg;
+        ThreadStart copy = *start;
+        delete start;
+        copy.function(copy.data);
+        return NULL;
+    }
+};
+#endif
+
+// Starts a detached thread running function(data).
+inline void spawn_thread(ThreadFunction function, void* data) {
+#ifdef HEADLESS
+    ThreadStart* start = new ThreadStart;
+    start->function = function;
+    start->data = data;
+    pthread_t thread;
+    pthread_create(&thread, NULL, ThreadStart::trampoline, start);
+    pthread_detach(thread);
+#else
+    SDL_CreateThread(function, data);
+#endif
+}
+
+inline void sleep_milliseconds(int ms) {
+#ifdef HEADLESS
+    usleep(1000 * ms);
+#else
+    SDL_Delay(ms);
+#endif
+}
+
+// Number of processors available, for sizing thread pools.
+inline int cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = info.dwNumberOfProcessors;
+#else
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return count > 0 ? count : 1;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifndef HEADLESS
+#include "SDL.h"
+#endif
+
+// Monotonic clock with sub-microsecond resolution, for timing work as
+// small as a single ray.  Only differences are meaningful.
+inline double precise_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return double(count.QuadPart) / frequency.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+// Monotonic wall clock in seconds.  Only differences are meaningful.
+inline double wall_seconds() {
+#ifdef HEADLESS
+    return precise_seconds();
+#else
+    return 0.001 * SDL_GetTicks();
+#endif
+}
+
+#endif
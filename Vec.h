@@ -3,30 +3,49 @@
 
 #include <cmath>
 
-struct Vec;
-Vec operator+ (const Vec&, const Vec&);
-Vec operator- (const Vec&, const Vec&);
-Vec operator* (double, const Vec&);
-Vec operator/ (const Vec&, double);
-double operator* (const Vec&, const Vec&);
-
-struct Vec {
-    double x, y, z;
-    Vec(double x, double y, double z) 
-        : x(x), y(y), z(z) 
-    { } 
-    Vec() : x(0), y(0), z(0) { }
-
-    double norm2() const {
+// Scalar type for geometry and shading.  Build with -DRAYTRACE_FLOAT to
+// render in single precision.  That halves the size of rays and hits and
+// doubles the lanes per register in the packet kernels, but it is not a
+// measured speedup: portal-heavy views spend their time in scalar node
+// walks and double-precision portal transforms, and run no faster.
+#ifdef RAYTRACE_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+template<class T> struct VecT;
+template<class T> VecT<T> operator+ (const VecT<T>&, const VecT<T>&);
+template<class T> VecT<T> operator- (const VecT<T>&, const VecT<T>&);
+template<class T> VecT<T> operator* (typename VecT<T>::Scalar, const VecT<T>&);
+template<class T> VecT<T> operator/ (const VecT<T>&, typename VecT<T>::Scalar);
+template<class T> T operator* (const VecT<T>&, const VecT<T>&);
+
+template<class T>
+struct VecT {
+    // Scalar arguments of the operators go through this typedef so they
+    // aren't deduced, and 2*v or 0.5*v work for any T.
+    typedef T Scalar;
+
+    T x, y, z;
+    VecT(T x, T y, T z)
+        : x(x), y(y), z(z)
+    { }
+    VecT() : x(0), y(0), z(0) { }
+
+    template<class U>
+    explicit VecT(const VecT<U>& v) : x(v.x), y(v.y), z(v.z) { }
+
+    T norm2() const {
         return x*x + y*y + z*z;
     }
 
-    double norm() const {
+    T norm() const {
         return std::sqrt(norm2());
     }
 
-    Vec unit() const {
-        double length = norm();
+    VecT unit() const {
+        T length = norm();
         if (length == 0) {
             return *this;
         }
@@ -35,64 +54,76 @@ struct Vec {
         }
     }
 
-    static inline Vec cross(const Vec& v, const Vec& w) {
-        return Vec(v.y*w.z - v.z*w.y, v.z*w.x - v.x*w.z, v.x*w.y - v.y*w.x);
+    static inline VecT cross(const VecT& v, const VecT& w) {
+        return VecT(v.y*w.z - v.z*w.y, v.z*w.x - v.x*w.z, v.x*w.y - v.y*w.x);
     }
- 
-    Vec rotate(const Vec& axis, double angle) const {
-        const Vec& v = *this;
-        double cos_angle = cos(angle);
-        return cos_angle*v + sin(angle)*cross(axis, v) + ((1 - cos_angle)*(axis * v))*axis;
+
+    VecT rotate(const VecT& axis, T angle) const {
+        const VecT& v = *this;
+        T cos_angle = std::cos(angle);
+        return cos_angle*v + std::sin(angle)*cross(axis, v) + ((1 - cos_angle)*(axis * v))*axis;
     }
 
-    Vec reflect(const Vec& norm) const {
-        const Vec& v = *this;
+    VecT reflect(const VecT& norm) const {
+        const VecT& v = *this;
         return v - (2*v*norm)*norm;
     }
 
-    Vec flatten(const Vec& norm) const {
-        const Vec& v = *this;
+    VecT flatten(const VecT& norm) const {
+        const VecT& v = *this;
         return v - (v*norm)*norm;
     }
 };
 
-inline Vec operator+ (const Vec& a, const Vec& b) {
-    return Vec(a.x+b.x, a.y+b.y, a.z+b.z);
+typedef VecT<Real> Vec;
+
+template<class T>
+inline VecT<T> operator+ (const VecT<T>& a, const VecT<T>& b) {
+    return VecT<T>(a.x+b.x, a.y+b.y, a.z+b.z);
 }
 
-inline Vec operator- (const Vec& a, const Vec& b) {
-    return Vec(a.x-b.x, a.y-b.y, a.z-b.z);
+template<class T>
+inline VecT<T> operator- (const VecT<T>& a, const VecT<T>& b) {
+    return VecT<T>(a.x-b.x, a.y-b.y, a.z-b.z);
 }
 
-inline Vec operator- (const Vec& p) {
-    return Vec(-p.x, -p.y, -p.z);
+template<class T>
+inline VecT<T> operator- (const VecT<T>& p) {
+    return VecT<T>(-p.x, -p.y, -p.z);
 }
 
-inline Vec operator* (double a, const Vec& v) {
-    return Vec(a*v.x, a*v.y, a*v.z);
+template<class T>
+inline VecT<T> operator* (typename VecT<T>::Scalar a, const VecT<T>& v) {
+    return VecT<T>(a*v.x, a*v.y, a*v.z);
 }
 
-inline Vec operator* (const Vec& v, double a) {
-    return Vec(a*v.x, a*v.y, a*v.z);
+template<class T>
+inline VecT<T> operator* (const VecT<T>& v, typename VecT<T>::Scalar a) {
+    return VecT<T>(a*v.x, a*v.y, a*v.z);
 }
 
-inline Vec operator/ (const Vec& v, double b) {
+template<class T>
+inline VecT<T> operator/ (const VecT<T>& v, typename VecT<T>::Scalar b) {
     return (1/b)*v;
 }
 
-inline double operator* (const Vec& a, const Vec& b) {
+template<class T>
+inline T operator* (const VecT<T>& a, const VecT<T>& b) {
     return a.x*b.x + a.y*b.y + a.z*b.z;
 }
 
-inline Vec& operator+= (Vec& a, const Vec& b) {
+template<class T>
+inline VecT<T>& operator+= (VecT<T>& a, const VecT<T>& b) {
     return a = a + b;
 }
 
-inline Vec& operator-= (Vec& a, const Vec& b) {
+template<class T>
+inline VecT<T>& operator-= (VecT<T>& a, const VecT<T>& b) {
     return a = a - b;
 }
 
-inline double sign(double x) {
+template<class T>
+inline T sign(T x) {
     return x > 0 ? 1 : -1;
 };
 
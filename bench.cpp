@@ -0,0 +1,484 @@
+// Benchmark suite: microbenchmarks of the ray casting kernels, checks that
+// compiling scenes doesn't change their hits, and full frame renders of the
+// portal level from fixed cameras, each checked against a golden checksum
+// so a speedup can't quietly change the image.
+// Build with `make bench`; run from the repository root.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+#include "Render.h"
+#include "Levels.h"
+#include "SceneCache.h"
+#include "Image.h"
+#include "Timer.h"
+#include "Simd.h"
+#include "Shapes/CompiledScene.h"
+#include "Shapes/Instance.h"
+
+void usage() {
+    std::cerr <<
+        "Usage: bench [options]\n"
+        "  --quick             shorter runs and fewer frames\n"
+        "  --micro             only the microbenchmarks\n"
+        "  --frames            only the checks and frame renders\n"
+        "  --golden FILE       golden checksums (default bench.golden)\n"
+        "  --update-golden     record this build's checksums instead of checking them\n";
+}
+
+#ifdef RAYTRACE_FLOAT
+const char* PRECISION = "float";
+#else
+const char* PRECISION = "double";
+#endif
+
+// A fixed sequence of pseudo-random numbers in [0, 1), so every run casts
+// the same rays.
+class Random {
+    unsigned int state;
+public:
+    Random(unsigned int seed) : state(seed) { }
+    Real next() {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) / Real(1 << 24);
+    }
+    Real between(Real lo, Real hi) { return lo + (hi - lo) * next(); }
+};
+
+const int MICRO_RAYS = 4096;
+
+// Rays from near `eye` towards a box round `target`, about half of them
+// missing whatever is in it.
+std::vector<RayCast> make_casts(World* world, const Point& eye, const Point& target, Real spread) {
+    Random random(7);
+    std::vector<RayCast> casts;
+    for (int i = 0; i < MICRO_RAYS; i++) {
+        Point origin = eye + Vec(random.between(-0.1, 0.1), random.between(-0.1, 0.1), random.between(-0.1, 0.1));
+        Point aim = target + Vec(random.between(-spread, spread), random.between(-spread, spread),
+                                 random.between(-spread, spread));
+        RayCast cast(Ray(origin, (aim - origin).unit()), world);
+        cast.set_frame(Frame(Vec(1,0,0), Vec(0,1,0), Vec(0,0,1)));
+        casts.push_back(cast);
+    }
+    return casts;
+}
+
+// Calls bench(i) for i cycling over MICRO_RAYS until `seconds` have passed,
+// and prints the time per call.  bench returns something depending on the
+// work, so it isn't optimized away.
+template<class Bench>
+void micro(const char* name, Bench& bench, double seconds) {
+    double total = 0;
+    long calls = 0;
+    double start = wall_seconds();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < MICRO_RAYS; i++) {
+            total += bench(i);
+        }
+        calls += MICRO_RAYS;
+        elapsed = wall_seconds() - start;
+    }
+    std::cout << "  " << std::left << std::setw(28) << name << std::right << std::setw(9)
+              << std::fixed << std::setprecision(1) << 1e9 * elapsed / calls << " ns/call"
+              << (total == 12345.678 ? " " : "") << "\n";
+    std::cout.unsetf(std::ios::floatfield);
+    std::cout.precision(6);
+}
+
+struct CastBench {
+    const Shape* shape;
+    const std::vector<RayCast>& casts;
+    CastBench(const Shape* shape, const std::vector<RayCast>& casts) : shape(shape), casts(casts) { }
+    Real operator() (int i) {
+        RayHit hit;
+        shape->ray_cast(casts[i], &hit);
+        return hit.type == RayHit::TYPE_MISS ? 0 : hit.distance2;
+    }
+};
+
+struct RebaseBench {
+    const std::vector<RayCast>& casts;
+    Frame source, dest;
+    RebaseBench(const std::vector<RayCast>& casts)
+        : casts(casts),
+          source(Frame::from_normal_up(Vec(0, 0, -1), Vec(0, 1, 0))),
+          dest(Frame::from_normal_up(Vec(1, 0, 0), Vec(0, 1, 0)))
+    { }
+    Real operator() (int i) {
+        const RayCast& cast = casts[i];
+        RayCast out = cast.rebase(cast.ray.origin + cast.ray.direction, Point(0, 0, 8), source, Point(-8, 0, 0), dest);
+        return out.ray.direction.x + out.frame.up.z;
+    }
+};
+
+struct TexelBench {
+    const Image& image;
+    std::vector<int> xs, ys;
+    TexelBench(const Image& image) : image(image) {
+        Random random(11);
+        for (int i = 0; i < MICRO_RAYS; i++) {
+            xs.push_back(int(random.next() * image.width()));
+            ys.push_back(int(random.next() * image.height()));
+        }
+    }
+    Real operator() (int i) {
+        return image.texel(xs[i], ys[i]).red;
+    }
+};
+
+struct SkyboxBench {
+    const std::vector<RayCast>& casts;
+    RayCone cone;
+    SkyboxBench(const std::vector<RayCast>& casts, Real spread) : casts(casts), cone(0, spread) { }
+    Real operator() (int i) {
+        return compute_skybox(casts[i], cone).green;
+    }
+};
+
+// A cell of the portal grids: six portal walls, and a sphere in a box.
+Shape* make_cell(World* neighbour) {
+    std::vector<Shape*> shapes;
+    Vec normals[6] = { Vec(1,0,0), Vec(-1,0,0), Vec(0,1,0), Vec(0,-1,0), Vec(0,0,1), Vec(0,0,-1) };
+    for (int i = 0; i < 6; i++) {
+        Vec up = normals[i].y != 0 ? Vec(1,0,0) : Vec(0,1,0);
+        Frame frame = Frame::from_normal_up(normals[i], up);
+        Plane* plane = new Plane(Point(-8*normals[i]), frame, 16);
+        plane->set_target(neighbour, Point(8*normals[i]), frame);
+        shapes.push_back(plane);
+    }
+    Sphere* sphere = new Sphere(Point(0, 0, 0), 1);
+    sphere->set_target(neighbour, Point(0, 0, 0), 1);
+    shapes.push_back(new BoundingBox(Point(-1,-1,-1), Point(1,1,1), sphere));
+    return new LinearCompound(shapes);
+}
+
+void run_micro(double seconds) {
+    std::cout << "microbenchmarks:\n";
+    World world;
+    world.skybox = new Skybox("sunset.jpg");
+    world.scene = new EmptyShape;
+    std::vector<RayCast> casts = make_casts(&world, Point(0, 0, -3), Point(0, 0, 0), 2);
+
+    Sphere sphere(Point(0, 0, 0), 1);
+    sphere.set_target(&world, Point(0, 0, 0), 1);
+    CastBench sphere_bench(&sphere, casts);
+    micro("Sphere::ray_cast", sphere_bench, seconds);
+
+    Frame plane_frame = Frame::from_normal_up(Vec(0, 0, -1), Vec(0, 1, 0));
+    Plane plane(Point(0, 0, 0), plane_frame, 16);
+    plane.set_target(&world, Point(0, 0, 8), plane_frame);
+    CastBench plane_bench(&plane, casts);
+    micro("Plane::ray_cast", plane_bench, seconds);
+
+    Sphere* boxed = new Sphere(Point(0, 0, 0), 1);
+    boxed->set_target(&world, Point(0, 0, 0), 1);
+    BoundingBox box(Point(-1,-1,-1), Point(1,1,1), boxed);
+    CastBench box_bench(&box, casts);
+    micro("BoundingBox::ray_cast", box_bench, seconds);
+
+    Shape* cell = make_cell(&world);
+    CastBench cell_bench(cell, casts);
+    micro("LinearCompound::ray_cast", cell_bench, seconds);
+
+    // The same cell compiled, cast through its world.
+    World compiled_world;
+    compiled_world.skybox = world.skybox;
+    compiled_world.scene = make_cell(&compiled_world);
+    CompiledScene::compile(&compiled_world);
+    CastBench compiled_bench(compiled_world.scene, casts);
+    micro("compiled cell", compiled_bench, seconds);
+
+    RebaseBench rebase_bench(casts);
+    micro("RayCast::rebase", rebase_bench, seconds);
+
+    Image image("sunset.jpg");
+    TexelBench texel_bench(image);
+    micro("Image::texel", texel_bench, seconds);
+
+    SkyboxBench sharp_bench(casts, 0);
+    micro("compute_skybox", sharp_bench, seconds);
+    SkyboxBench blurred_bench(casts, Real(0.02));
+    micro("compute_skybox (filtered)", blurred_bench, seconds);
+}
+
+// Two worlds instancing a cell leading to its one slot, each the other's
+// target, with `extra`, whose portals lead to `reached`, added to the body
+// if not NULL.  Casts from inside each must hit the same compiled as through
+// the Shape interface; both worlds and `reached` must be compiled, so they
+// have ids for camera paths and jobs; and the worlds share their nodes only
+// if the body can be shared.  Returns whether all that holds.
+bool check_instances(const char* name, Shape* extra, World* reached, World* slot, Skybox* skybox, bool shared) {
+    std::vector<Shape*> shapes;
+    shapes.push_back(make_cell(slot));
+    if (extra) { shapes.push_back(extra); }
+    Shape* body = new LinearCompound(shapes);
+    std::vector<World*> slots(1, slot);
+    World* worlds[2] = { new World, new World };
+    for (int w = 0; w < 2; w++) {
+        worlds[w]->skybox = skybox;
+        worlds[w]->scene = new Instance(body, slots, std::vector<World*>(1, worlds[1-w]));
+    }
+
+    std::vector<RayCast> casts[2];
+    std::vector<RayHit> expected[2];
+    for (int w = 0; w < 2; w++) {
+        casts[w] = make_casts(worlds[w], Point(0, 0, -3), Point(0, 0, 0), 4);
+        expected[w].resize(casts[w].size());
+        for (size_t i = 0; i < casts[w].size(); i++) {
+            worlds[w]->scene->ray_cast(casts[w][i], &expected[w][i]);
+        }
+    }
+
+    const CompiledScene* scene = CompiledScene::compile(worlds[0]);
+    int mismatches = 0;
+    for (int w = 0; w < 2; w++) {
+        for (size_t i = 0; i < casts[w].size(); i++) {
+            RayHit hit;
+            worlds[w]->scene->ray_cast(casts[w][i], &hit);
+            const RayHit& want = expected[w][i];
+            if (hit.type != want.type
+                || (hit.type == RayHit::TYPE_PORTAL && hit.portal.new_cast.world != want.portal.new_cast.world)) {
+                mismatches++;
+            }
+        }
+    }
+    int first[2];
+    int unnumbered = reached && scene->world_id(reached) < 0;
+    for (int w = 0; w < 2; w++) {
+        int id = scene->world_id(worlds[w]);
+        unnumbered += id < 0;
+        first[w] = id < 0 ? -1 - w : scene->world_node_ranges()[id].first;
+    }
+    bool ok = mismatches == 0 && unnumbered == 0 && (first[0] == first[1]) == shared;
+    std::cout << "  " << std::left << std::setw(28) << name << std::right << std::setw(5) << mismatches
+              << " mismatches, " << unnumbered << " worlds without ids, "
+              << (first[0] == first[1] ? "shared" : "not shared")
+              << " " << (ok ? "ok" : "FAILED") << "\n";
+    return ok;
+}
+
+// Instancing checks: a body whose portals all lead to slots is shared, and
+// one with a portal elsewhere, or holding another instance, is cast through
+// the Shape interface rather than misread through the instances' tables.
+// Returns the number of failures.
+int run_checks() {
+    std::cout << "checks:\n";
+    Skybox* skybox = new Skybox("sunset.jpg");
+    World* slot = new World;
+    World* other = new World;
+    slot->skybox = other->skybox = skybox;
+    slot->scene = other->scene = new EmptyShape;
+    int failures = 0;
+
+    failures += !check_instances("instance, slots only", NULL, NULL, slot, skybox, true);
+
+    Sphere* portal = new Sphere(Point(2, 0, 0), 0.5);
+    portal->set_target(other, Point(0, 0, 0), 1);
+    failures += !check_instances("instance, portal off a slot", portal, other, slot, skybox, false);
+
+    World* inner_slot = new World;
+    inner_slot->skybox = skybox;
+    inner_slot->scene = new EmptyShape;
+    Sphere* inner = new Sphere(Point(-2, 0, 0), 0.5);
+    inner->set_target(inner_slot, Point(0, 0, 0), 1);
+    Shape* nested = new Instance(inner, std::vector<World*>(1, inner_slot), std::vector<World*>(1, other));
+    failures += !check_instances("instance in an instance", nested, other, slot, skybox, false);
+    return failures;
+}
+
+// A full frame render from a fixed camera.
+struct Scenario {
+    const char* name;
+    Real eye[3], forward[3];
+    int width, height;
+    int cast_limit;
+    bool anti_alias;
+    bool quick;                 // run with --quick
+};
+
+const Scenario SCENARIOS[] = {
+    { "entrance-320",    { 0, 0, -3 },       { 0, 0, 1 },   320, 240,  32, true,  true },
+    { "entrance-640",    { 0, 0, -3 },       { 0, 0, 1 },   640, 480,  32, true,  true },
+    { "entrance-1280",   { 0, 0, -3 },       { 0, 0, 1 },  1280, 960,  32, true,  false },
+    { "inside-cast4",    { 0.3, 0.2, 8.9 },  { 0.1, 0, 1 }, 640, 480,   4, false, true },
+    { "inside-cast12",   { 0.3, 0.2, 8.9 },  { 0.1, 0, 1 }, 640, 480,  12, false, true },
+    { "inside-cast32",   { 0.3, 0.2, 8.9 },  { 0.1, 0, 1 }, 640, 480,  32, false, false },
+};
+
+// FNV-1a over the image.
+std::string checksum(const unsigned char* pixels, size_t bytes) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < bytes; i++) {
+        h = (h ^ pixels[i]) * 1099511628211ULL;
+    }
+    char text[17];
+    sprintf(text, "%016llx", h);
+    return text;
+}
+
+// Golden checksums by precision and scenario name, one "PRECISION NAME SUM"
+// per line.
+typedef std::map<std::string, std::string> Golden;
+
+Golden read_golden(const char* path) {
+    Golden golden;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string precision, name, sum;
+        if (line.empty() || line[0] == '#' || !(fields >> precision >> name >> sum)) { continue; }
+        golden[precision + " " + name] = sum;
+    }
+    return golden;
+}
+
+bool write_golden(const char* path, const Golden& golden) {
+    std::ofstream out(path);
+    out << "# Checksums of bench's frame renders, by Real precision.  Rewrite with\n"
+           "# `bench --update-golden` when a change to the image is intended.\n";
+    for (Golden::const_iterator i = golden.begin(); i != golden.end(); ++i) {
+        out << i->first << " " << i->second << "\n";
+    }
+    return bool(out);
+}
+
+// Renders every scenario at each thread count, keeping the fastest of a
+// few runs.  Returns the number of checksum mismatches.
+int run_frames(World* world, bool quick, Golden* golden, bool update) {
+    std::vector<int> thread_counts;
+    thread_counts.push_back(1);
+    if (cpu_count() > 1) { thread_counts.push_back(cpu_count()); }
+    int runs = quick ? 1 : 3;
+    int failures = 0;
+
+    std::cout << "frames (" << PRECISION << ", " << native_simd_name() << "):\n";
+    for (size_t s = 0; s < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); s++) {
+        const Scenario& scenario = SCENARIOS[s];
+        if (quick && !scenario.quick) { continue; }
+
+        RenderInfo info;
+        info.world = world;
+        info.width = scenario.width;
+        info.height = scenario.height;
+        info.bpp = 3;
+        info.cast_limit = scenario.cast_limit;
+        info.anti_alias = scenario.anti_alias;
+        info.packet_size = native_packet_size();
+        info.eye = Point(scenario.eye[0], scenario.eye[1], scenario.eye[2]);
+        Vec forward = Vec(scenario.forward[0], scenario.forward[1], scenario.forward[2]).unit();
+        info.frame = Frame::from_normal_up(forward, Vec(0, 1, 0).flatten(forward).unit());
+
+        size_t bytes = info.bpp * info.width * info.height;
+        std::vector<unsigned char> pixels(bytes);
+        PixelBuffer buffer;
+        buffer.pixels = &pixels[0];
+
+        for (size_t t = 0; t < thread_counts.size(); t++) {
+            double best = HUGE_VAL;
+            double rays = 0;
+            std::string sum;
+            for (int run = 0; run < runs; run++) {
+                memset(&pixels[0], 0, bytes);
+                double start = wall_seconds();
+                ThreadedRenderer renderer(&info, thread_counts[t]);
+                renderer.render(buffer);
+                best = std::min(best, wall_seconds() - start);
+                rays = renderer.primary_rays();
+                std::string run_sum = checksum(&pixels[0], bytes);
+                if (!sum.empty() && run_sum != sum) { sum = "nondeterministic"; }
+                else if (sum.empty()) { sum = run_sum; }
+            }
+
+            std::string key = std::string(PRECISION) + " " + scenario.name;
+            const char* verdict;
+            if (update) {
+                (*golden)[key] = sum;
+                verdict = "recorded";
+            }
+            else if (!golden->count(key)) {
+                verdict = "NO GOLDEN";
+                failures++;
+            }
+            else if ((*golden)[key] != sum) {
+                verdict = "MISMATCH";
+                failures++;
+            }
+            else {
+                verdict = "ok";
+            }
+
+            std::ostringstream label;
+            label << scenario.name << " x" << thread_counts[t];
+            std::cout << "  " << std::left << std::setw(22) << label.str() << std::right
+                      << std::setw(5) << info.width << "x" << std::left << std::setw(4) << info.height
+                      << std::right << " cast " << std::setw(2) << info.cast_limit
+                      << std::fixed << std::setprecision(1)
+                      << std::setw(9) << 1000 * best << " ms"
+                      << std::setw(8) << rays / best / 1e6 << " Mrays/s"
+                      << std::setw(8) << 1e9 * best / rays << " ns/ray"
+                      << "  " << sum << " " << verdict << "\n";
+            std::cout.unsetf(std::ios::floatfield);
+            std::cout.precision(6);
+        }
+    }
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    bool quick = false;
+    bool micro_only = false;
+    bool frames_only = false;
+    bool update = false;
+    const char* golden_path = "bench.golden";
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "--quick")) { quick = true; }
+        else if (!strcmp(arg, "--micro")) { micro_only = true; }
+        else if (!strcmp(arg, "--frames")) { frames_only = true; }
+        else if (!strcmp(arg, "--update-golden")) { update = true; }
+        else if (!strcmp(arg, "--golden") && i+1 < argc) { golden_path = argv[++i]; }
+        else if (!strcmp(arg, "--help")) { usage(); return 0; }
+        else {
+            std::cerr << "Bad argument: " << arg << "\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (!frames_only) {
+        run_micro(quick ? 0.05 : 0.3);
+    }
+    if (micro_only) { return 0; }
+
+    if (run_checks() > 0) { return 1; }
+
+    World* world = load_scene_cached("levels/portals.scene");
+    if (!world) { return 1; }
+    Golden golden = read_golden(golden_path);
+    int failures = run_frames(world, quick, &golden, update);
+    if (update) {
+        if (!write_golden(golden_path, golden)) {
+            std::cerr << "Failed to write " << golden_path << "\n";
+            return 1;
+        }
+        std::cout << "checksums written to " << golden_path << "\n";
+    }
+    else if (failures > 0) {
+        std::cout << failures << " frame(s) don't match " << golden_path << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <sstream>
 #include <vector>
 #include <ctime>
+#include <cstring>
 #include "SDL.h"
 #include "SDL_opengl.h"
 #include "SDL_image.h"
@@ -11,186 +12,29 @@
 #include "Color.h"
 #include "Frame.h"
 #include "Shapes/Shape.h"
-#include "Shapes/Sphere.h"
-#include "Shapes/LinearCompound.h"
-#include "Shapes/Plane.h"
-#include "Shapes/BoundingBox.h"
 #include "Render.h"
+#include "Display.h"
+#include "Levels.h"
+#include "SceneCache.h"
+#include "Pipeline.h"
+#include "Progressive.h"
+#include "DynamicResolution.h"
+#include "ReprojectionCache.h"
+#include "Timer.h"
+#include "Telemetry.h"
+#include "HeatMap.h"
+#include "CameraPath.h"
 #include "Tweaks.h"
 
-/*
-///////////////////////////////////////////////////////////////////
-//                  DEBUG TEST WORLD
-///////////////////////////////////////////////////////////////////
-
-World* make_compound(Sphere** sphere_out) {
-    std::vector<Shape*> shapes;
-
-    // BoundingBoxes are for optimization only.
-
-    shapes.push_back(new Plane(Point(0, -4, 0), Vec(0, 1, 0)));
-
-    std::vector<Shape*> leftbox;
-    for (double x = -40; x < 0; x += 8) {
-        std::vector<Shape*> subshapes;
-        subshapes.push_back(new Sphere(Point(x, 0, 0), 1));
-        subshapes.push_back(new Sphere(Point(x-2, 0, 0), 1));
-        subshapes.push_back(new Sphere(Point(x+2, 0, 0), 1));
-        subshapes.push_back(new Sphere(Point(x, 2, 0), 1));
-        leftbox.push_back(new BoundingBox(Point(x-3,-1,-1), Point(x+3,3,1),
-                            new LinearCompound(subshapes)));
-    }
-    shapes.push_back(new BoundingBox(Point(-43,-1,-1), Point(3,3,1),
-                        new LinearCompound(leftbox)));
-    
-    std::vector<Shape*> rightbox;
-    for (double x = 0; x <= 40; x += 8) {
-        std::vector<Shape*> subshapes;
-        if (x == 0) {
-            *sphere_out = new Sphere(Point(x, 0, 0), 1);
-            subshapes.push_back(*sphere_out);
-        }
-        else {
-            subshapes.push_back(new Sphere(Point(x, 0, 0), 1));
-        }
-        subshapes.push_back(new Sphere(Point(x-2, 0, 0), 1));
-        subshapes.push_back(new Sphere(Point(x+2, 0, 0), 1));
-        subshapes.push_back(new Sphere(Point(x, 2, 0), 1));
-        rightbox.push_back(new BoundingBox(Point(x-3,-1,-1), Point(x+3,3,1),
-                            new LinearCompound(subshapes)));
-    }
-    shapes.push_back(new BoundingBox(Point(-3,-1,-1), Point(43,3,1),
-                        new LinearCompound(rightbox)));
-
-    World* world = new World;
-    world->scene = new LinearCompound(shapes);
-    return world;
-}
-
-World* make_world() {
-    Sphere* red_sphere;
-    Sphere* blue_sphere;
-    World* red_world = make_compound(&red_sphere);
-    World* blue_world = make_compound(&blue_sphere);
-
-    red_world->skybox = new Image("sunset.jpg");
-    blue_world->skybox = new Image("bluesky.jpg");
-    red_sphere->set_target(blue_world, Point(0, 0, 0), 1);
-    blue_sphere->set_target(red_world, Point(0, 0, 0), 1);
-
-    return red_world;
-}
-*/
-
-///////////////////////////////////////////////////////////////////
-//                  MAX LEVEL
-///////////////////////////////////////////////////////////////////
-
-World* make_sphere_grid_world(Image* skybox, World* grid_world, World* periodic_world, float grid_spacing) {
-	
-	const int grid_size = 3;
-	
-	World* worlds[grid_size][grid_size][grid_size];
-	for (int x = 0; x < grid_size; ++x)
-	{
-		for (int y = 0; y < grid_size; ++y)
-		{
-			for (int z = 0; z < grid_size; ++z)
-			{
-				worlds[x][y][z] = new World;
-			}
-		}
-	}
-
-	for (int x = 0; x < grid_size; ++x)
-	{
-		for (int y = 0; y < grid_size; ++y)
-		{
-			for (int z = 0; z < grid_size; ++z)
-			{
-				std::vector<Shape*> shapes;
-				Plane* left = new Plane(Point(-grid_spacing, 0, 0), Frame::from_normal_up(Vec(1, 0, 0), Vec(0, 1, 0)));
-				left->set_target(worlds[x > 0 ? x - 1 : grid_size - 1][y][z], Point(grid_spacing, 0, 0), Frame::from_normal_up(Vec(1, 0, 0), Vec(0, 1, 0)));
-				shapes.push_back(left);
-
-				Plane* right = new Plane(Point(grid_spacing, 0, 0), Frame::from_normal_up(Vec(-1, 0, 0), Vec(0, 1, 0)));
-				right->set_target(worlds[x < grid_size - 1 ? x + 1 : 0][y][z], Point(-grid_spacing, 0, 0), Frame::from_normal_up(Vec(-1, 0, 0), Vec(0, 1, 0)));
-				shapes.push_back(right);
-				
-				Plane* floor = new Plane(Point(0, -grid_spacing, 0), Frame::from_normal_up(Vec(0, 1, 0), Vec(1, 0, 0)));
-				floor->set_target(worlds[x][y > 0 ? y - 1 : grid_size - 1][z], Point(0, grid_spacing, 0), Frame::from_normal_up(Vec(0, 1, 0), Vec(1, 0, 0)));
-				shapes.push_back(floor);
-
-				Plane* ceiling = new Plane(Point(0, grid_spacing, 0), Frame::from_normal_up(Vec(0, -1, 0), Vec(1, 0, 0)));
-				ceiling->set_target(worlds[x][y < grid_size - 1 ? y + 1 : 0][z], Point(0, -grid_spacing, 0), Frame::from_normal_up(Vec(0, -1, 0), Vec(1, 0, 0)));
-				shapes.push_back(ceiling);
-
-				Plane* back = new Plane(Point(0, 0, -grid_spacing), Frame::from_normal_up(Vec(0, 0, 1), Vec(0, 1, 0)));
-				back->set_target(worlds[x][y][z > 0 ? z - 1 : grid_size - 1], Point(0, 0, grid_spacing), Frame::from_normal_up(Vec(0, 0, 1), Vec(0, 1, 0)));
-				shapes.push_back(back);
-
-				Plane* front = new Plane(Point(0, 0, grid_spacing), Frame::from_normal_up(Vec(0, 0, -1), Vec(0, 1, 0)));
-				front->set_target(worlds[x][y][z < grid_size - 1 ? z + 1 : 0], Point(0, 0, -grid_spacing), Frame::from_normal_up(Vec(0, 0, -1), Vec(0, 1, 0)));
-				shapes.push_back(front);
-
-				Sphere* sphere = new Sphere(Point(0, 0, 0), 1);
-				if (x == 2 && y == 2 && z == 2)
-				{
-					sphere->set_target(periodic_world, Point(0, 0, 0), 1);
-				}
-				else if (grid_world)
-				{
-					sphere->set_target(grid_world, Point(0, 0, 0), 1);
-				}
-				shapes.push_back(new BoundingBox(Point(-1,-1,-1), Point(1,1,1), sphere));
-
-				worlds[x][y][z]->scene = new LinearCompound(shapes);
-				worlds[x][y][z]->skybox = skybox;
-			}
-		}
-	}
-	
-	return worlds[1][1][1];
-}
-
-World* make_world() {
-	World* star_world = new World;
-	star_world->scene = new EmptyShape;
-	star_world->skybox = new Image("starfield.jpg");
-	
-	World* world_a = make_sphere_grid_world(new Image("sunset.jpg"), NULL, star_world, 8);
-	World* world_b = make_sphere_grid_world(new Image("forest.jpg"), world_a, NULL, 5);
-	World* world_c = make_sphere_grid_world(new Image("bluesky.jpg"), NULL, world_b, 3);
-	World* world_d = new World;
-	Sphere* sphere = new Sphere(Point(0, 0, 10), 1);
-	sphere->set_target(world_c, Point(0, 0, 0), 1);
-	world_d->scene = new BoundingBox(Point(-1, -1, 9), Point(1, 1, 11), sphere);
-	world_d->skybox = new Image("starfield.jpg");
-
-	std::vector<Shape*> shapes;
-	Sphere* sphere_c = new Sphere(Point(-2, 0, 3), 1);
-	sphere_c->set_target(world_c, Point(0, 0, 0), 1);
-	shapes.push_back(new BoundingBox(Point(-3, -1, 2), Point(-1, 1, 4), sphere_c));
-
-	Sphere* sphere_b = new Sphere(Point(0, 0, 3), 1);
-	sphere_b->set_target(world_b, Point(0, 0, 0), 1);
-	shapes.push_back(new BoundingBox(Point(-1, -1, 2), Point(1, 1, 4), sphere_b));
-
-	Sphere* sphere_a = new Sphere(Point(2, 0, 3), 1);
-	sphere_a->set_target(world_a, Point(0, 0, 0), 1);
-	shapes.push_back(new BoundingBox(Point(1, -1, 2), Point(3, 1, 4), sphere_a));
-	star_world->scene = new LinearCompound(shapes);
-
-	return world_d;
-}
-
 void quit() {
     IMG_Quit();
     SDL_Quit();
     exit(0);
 }
 
-void screenshot(RenderInfo* in_info) {
+// Saves a high quality render of the view, or with `heat_map` a cost heat
+// map of it.
+void screenshot(RenderInfo* in_info, HeatMapRenderer* heat_map = NULL) {
     const int width = 1280;
     const int height = 960;
     const int bpp = 3;
@@ -215,9 +59,11 @@ void screenshot(RenderInfo* in_info) {
     info->bpp = bpp;
     info->cast_limit = 32;
     info->anti_alias = true;
+    info->adaptive_samples = 4;
+    info->packet_size = native_packet_size();
 
     OpenGLTextureTarget* target = new OpenGLTextureTarget(info);
-    ThreadedRenderer* renderer = new ThreadedRenderer(info, 48);
+    ThreadedRenderer* renderer = new ThreadedRenderer(info, 48, 32, heat_map);
     target->render(renderer);
     target->prepare();
 
@@ -235,7 +81,9 @@ void screenshot(RenderInfo* in_info) {
 
     time_t now = time(NULL);
     std::ostringstream stream;
-    stream << "screenshots/screenshot-" << now << ".bmp";
+    stream << "screenshots/screenshot-" << now;
+    if (heat_map) { stream << "-" << heat_metric_name(heat_map->get_metric()); }
+    stream << ".bmp";
     SDL_SaveBMP(surface, stream.str().c_str());
     SDL_FreeSurface(surface);
 
@@ -245,30 +93,138 @@ void screenshot(RenderInfo* in_info) {
     delete info;
 }
 
+// Renders the view for the frame pipeline, on its render thread, from the
+// latest camera the game has set.
+class ViewRenderer : public FrameProducer {
+    Mutex camera_mutex;
+    RenderInfo camera;
+    bool jumped;
+
+    RenderInfo view;
+    Progressive* progressive;
+    ResolutionController* resolution;
+    ReprojectionCache* history; // NULL unless reprojecting
+    ThreadedRenderer* buf_renderer;
+    FrameTelemetry* telemetry;
+
+    // The heat map shown instead of the view, if any, as set by the game
+    // and as rendered.
+    bool heat, heat_shown;
+    HeatMetric heat_metric;
+    HeatMapRenderer heat_map;
+public:
+    // Reuses the previous frame's rays while moving if `reproject`.
+    ViewRenderer(const RenderInfo& info, FrameTelemetry* telemetry, bool reproject)
+        : camera(info), jumped(false), view(info), telemetry(telemetry),
+          heat(false), heat_shown(false), heat_metric(HEAT_CASTS), heat_map(HEAT_CASTS)
+    {
+        // Frames while moving are held to 60 per second; the resolution
+        // changes only the renderer's settings, not its buffers or threads.
+        resolution = new ResolutionController(1/60.0, 12);
+        progressive = new Progressive(&view, resolution->target_seconds());
+        progressive->set_motion_quality(resolution->scale(), resolution->cast_limit());
+        history = reproject ? new ReprojectionCache : NULL;
+        buf_renderer = new ThreadedRenderer(progressive->pass_info(), cpu_count(), 32, history);
+    }
+
+    // Called from the game's thread.  `jumped` if the eye went through a
+    // portal since the last call.
+    void set_camera(const RenderInfo& info, bool jumped_portal) {
+        Lock lock(camera_mutex);
+        camera = info;
+        jumped = jumped || jumped_portal;
+    }
+
+    // Called from the game's thread: shows a heat map of `metric` instead
+    // of the view, or the view again if !on.
+    void set_heat_map(bool on, HeatMetric metric) {
+        Lock lock(camera_mutex);
+        heat = on;
+        heat_metric = metric;
+    }
+
+    bool produce(FrameSlot* frame) {
+        {
+            Lock lock(camera_mutex);
+            view = camera;
+            if (jumped) {
+                if (history) { history->invalidate(); }
+                jumped = false;
+            }
+            if (heat != heat_shown || heat_metric != heat_map.get_metric()) {
+                heat_shown = heat;
+                heat_map.set_metric(heat_metric);
+                buf_renderer->set_tile_renderer(heat ? (TileRenderer*)&heat_map : history);
+                if (history) { history->invalidate(); }
+                progressive->restart();
+            }
+        }
+        Tile region;
+        if (!progressive->next_pass(&region)) { return false; }
+        bool motion = progressive->in_motion();
+        double start = wall_seconds();
+        buf_renderer->render_region(frame->buffer, region);
+        double seconds = wall_seconds() - start;
+        telemetry->frame_rendered(seconds, buf_renderer->trace_stats());
+
+        const RenderInfo* pass = progressive->pass_info();
+        frame->width = pass->width;
+        frame->height = pass->height;
+        frame->bpp = pass->bpp;
+        frame->region = region;
+        frame->seconds = seconds;
+        frame->show = progressive->pass_done(seconds);
+        if (motion) {
+            resolution->frame_done(seconds);
+            progressive->set_motion_quality(resolution->scale(), resolution->cast_limit());
+        }
+        return true;
+    }
+};
+
 class Game {
     RenderInfo* info;
-    OpenGLTextureTarget* render_target;
-    BufRenderer* buf_renderer;
+    ViewRenderer* view_renderer;
+    FramePipeline* pipeline;
+    PipelinedTexture* texture;
+    FrameTelemetry telemetry;
+    // The heat map shown, or HEAT_METRICS for the view.
+    int heat_metric;
+    CameraPathWriter recorder;
 
     Uint32 last_ticks;
 
     int skip_mousemotion;
 public:
-    Game()
+    // Records the camera's path to `record_path`, if given.
+    Game(const char* record_path, bool reproject)
     {
         info = new RenderInfo;
-        info->world = make_world();
+        info->world = load_scene_cached("levels/portals.scene");
+        if (!info->world) { exit(1); }
         info->eye = Point(0,0,-3);
         info->frame = Frame(Vec(1,0,0), Vec(0,1,0), Vec(0,0,1));
-        info->width = 400;
-        info->height = 300;
+        // The window's size: frames are rendered at most this big, and
+        // upscaled to it when smaller.
+        info->width = 800;
+        info->height = 600;
         info->bpp = 3;
         info->cast_limit = 12;
         info->anti_alias = false;
+        info->packet_size = native_packet_size();
 
-        render_target = new OpenGLTextureTarget(info);
-        buf_renderer = new ThreadedRenderer(info, 2);
-        
+        // Two frames in flight: one rendering while the other is uploaded.
+        view_renderer = new ViewRenderer(*info, &telemetry, reproject);
+        pipeline = new FramePipeline(view_renderer, 2, info->bpp*info->width*info->height);
+        texture = new PipelinedTexture(info->width, info->height);
+
+        std::string error;
+        if (record_path && !recorder.open(record_path, info->world, &error)) {
+            std::cerr << error << std::endl;
+            exit(1);
+        }
+
+        heat_metric = HEAT_METRICS;
         last_ticks = SDL_GetTicks();
         skip_mousemotion = 10;
     }
@@ -292,41 +248,40 @@ public:
 		if (keys[SDLK_e]) { rotation -= dt; }
 		info->frame = info->frame.rotate(info->frame.forward, info->frame.handedness() * rotation);
 
-        int safety = 5;
-        while (intention.norm2() > 0 && safety--) {
-            RayHit hit;
-            RayCast cast(Ray(info->eye, intention.unit()), info->world);
-            cast.set_frame(info->frame);
-            info->world->scene->ray_cast(cast, &hit);
-            if (hit.type == RayHit::TYPE_MISS) { break; }
-            else if (hit.type == RayHit::TYPE_PORTAL) {
-                double distance = std::sqrt(hit.distance2);
-                double idistance = intention.norm();
-                if (distance <= idistance) {
-                    std::cout << "Boing!\n";
-                    info->eye = hit.portal.new_cast.ray.origin;
-                    info->frame = hit.portal.new_cast.frame;
-                    info->world = hit.portal.new_cast.world;
-                    intention = (idistance - distance) * hit.portal.new_cast.ray.direction;
-                }
-                else {
-                    break;
-                }
-            }
-            else {
-                abort();
-            }
-        }
-        info->eye += intention;
+        bool jumped = move_camera(info, intention);
+        if (jumped) { std::cout << "Boing!\n"; }
         //info->frame = info->frame.upright(dt, Vec(0,1,0));
+        view_renderer->set_camera(*info, jumped);
+        recorder.add(dt, *info, jumped);
+    }
+
+    // Uploads the frames rendered since the last call.  Returns whether
+    // there were any.
+    bool present() {
+        bool presented = false;
+        for (;;) {
+            double start = wall_seconds();
+            if (!pipeline->present(texture)) { break; }
+            telemetry.frame_uploaded(wall_seconds() - start);
+            presented = true;
+        }
+        return presented;
     }
 
+    // Draws the latest frame and swaps it onto the screen.
     void draw() {
-        render_target->render(buf_renderer);
-        render_target->prepare();
-        render_target->draw();
+        double start = wall_seconds();
+        glClear(GL_COLOR_BUFFER_BIT);
+        texture->draw();
+        SDL_GL_SwapBuffers();
+        telemetry.frame_presented(wall_seconds() - start);
     }
 
+    FrameTelemetry& frame_telemetry() { return telemetry; }
+
+    int image_width() const { return texture->image_width(); }
+    int image_height() const { return texture->image_height(); }
+
     void event(const SDL_Event& e) {
         switch (e.type) {
             case SDL_QUIT:
@@ -338,7 +293,18 @@ public:
                 }
                 if (e.key.keysym.sym == SDLK_RETURN &&
                     (e.key.keysym.mod & (KMOD_LSHIFT | KMOD_RSHIFT))) {
-                    screenshot(info);
+                    if (heat_metric == HEAT_METRICS) { screenshot(info); }
+                    else {
+                        HeatMapRenderer heat_map((HeatMetric)heat_metric);
+                        screenshot(info, &heat_map);
+                    }
+                }
+                // H cycles through the heat maps and back to the view.
+                if (e.key.keysym.sym == SDLK_h) {
+                    heat_metric = (heat_metric + 1) % (HEAT_METRICS + 1);
+                    bool on = heat_metric != HEAT_METRICS;
+                    view_renderer->set_heat_map(on, on ? (HeatMetric)heat_metric : HEAT_CASTS);
+                    std::cout << "heat map: " << (on ? heat_metric_name((HeatMetric)heat_metric) : "off") << "\n";
                 }
                 break;
             case SDL_MOUSEMOTION: {
@@ -355,6 +321,22 @@ public:
 };
 
 int main(int argc, char** argv) {
+    // --stats adds the ray counters to the periodic frame time report;
+    // --record FILE saves the camera's path for render --replay;
+    // --reproject reuses rays between frames (see ReprojectionCache).
+    bool stats = false;
+    const char* record_path = NULL;
+    bool reproject = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--stats")) { stats = true; }
+        else if (!strcmp(argv[i], "--record") && i+1 < argc) { record_path = argv[++i]; }
+        else if (!strcmp(argv[i], "--reproject")) { reproject = true; }
+        else {
+            std::cerr << "Usage: main [--stats] [--record FILE] [--reproject]\n";
+            return 1;
+        }
+    }
+
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
         std::cerr << "SDL_Init Error: " << SDL_GetError() << std::endl;
         return 1;
@@ -377,29 +359,30 @@ int main(int argc, char** argv) {
 
     glEnable(GL_TEXTURE_2D);
 
-    Game* game = new Game();
+    Game* game = new Game(record_path, reproject);
 
-    Uint32 old_ticks = SDL_GetTicks();
     int frames = 0;
 
     while (true) {
         game->step();
 
-        glClear(GL_COLOR_BUFFER_BIT);
-        game->draw();
-        SDL_GL_SwapBuffers();
+        if (game->present()) {
+            game->draw();
+            frames++;
+        }
+        else {
+            SDL_Delay(2);
+        }
 
         SDL_Event e;
         while (SDL_PollEvent(&e)) {
             game->event(e);
         }
 
-        frames++;
-        if (frames % 30 == 0) {
-            Uint32 ticks = SDL_GetTicks();
-            std::cout << "FPS: " << frames/(0.001 * (ticks-old_ticks)) << "\n";
+        if (frames == 30) {
+            std::cout << game->image_width() << "x" << game->image_height() << " ";
+            game->frame_telemetry().dump(std::cout, stats);
             frames = 0;
-            old_ticks = ticks;
         }
     }
 }
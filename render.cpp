@@ -0,0 +1,481 @@
+// Headless offline renderer.  Renders one frame of the level to a PPM file
+// without SDL video or OpenGL; build with `make render`.
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Vec.h"
+#include "Point.h"
+#include "Frame.h"
+#include "Render.h"
+#include "Levels.h"
+#include "SceneFile.h"
+#include "SceneCache.h"
+#include "Shapes/CompiledScene.h"
+#include "Output.h"
+#include "Timer.h"
+#include "Telemetry.h"
+#include "Pipeline.h"
+#include "Simd.h"
+#include "HeatMap.h"
+#include "CameraPath.h"
+#include "Distributed.h"
+#include "Animation.h"
+
+void usage() {
+    std::cerr <<
+        "Usage: render [options]\n"
+        "  -o FILE             output file (PPM, default render.ppm)\n"
+        "  --level NAME        portals (default) or field\n"
+        "  --scene FILE        load the scene from FILE instead (see SceneFile.h)\n"
+        "  --spheres N         sphere count for the field level (default 5000)\n"
+        "  --no-compile        cast through the Shape tree instead of the compiled scene\n"
+        "  --no-cache          load scene files from source, ignoring FILE.cache\n"
+        "  --width N           image width (default 1280)\n"
+        "  --height N          image height (default 960)\n"
+        "  --eye X,Y,Z         camera position (default 0,0,-3)\n"
+        "  --forward X,Y,Z     view direction (default 0,0,1)\n"
+        "  --up X,Y,Z          up direction (default 0,1,0)\n"
+        "  --cast-limit N      maximum portal traversals per ray (default 32)\n"
+        "  --portal-cutoff F   end rays at portals narrower than F times their footprint;\n"
+        "                      0 follows them to the cast limit (default 0.25)\n"
+        "  --aa, --no-aa       enable/disable 4x anti-aliasing (default on)\n"
+        "  --adaptive N        adaptive anti-aliasing with up to N extra rays per pixel\n"
+        "  --aa-threshold T    colour difference that refines a pixel (default 0.1)\n"
+        "  --threads N         render threads (default: number of CPUs)\n"
+        "  --tile N            tile size in pixels for the scheduler (default 32)\n"
+        "  --packet N          rays per SIMD packet: 4, 8, 16, auto (default) or off\n"
+        "  --compare           also render with single rays and report both rates\n"
+        "  --heat METRIC       render what each pixel costs: casts, tests, depth or time\n"
+        "  --frames N          render N frames moving forward, through the frame pipeline\n"
+        "  --in-flight N       frames the pipeline buffers (default 2; 1 is unpipelined)\n"
+        "  --present-ms N      time each frame's present takes with --frames (default 0)\n"
+        "  --record FILE       save the camera path of --frames, for --replay\n"
+        "  --replay FILE       render each step of a recorded camera path, with timings\n"
+        "  --video FILE        render the frames of --frames or --replay to a video stream\n"
+        "                      in FILE, or - for standard output, instead of timing them\n"
+        "  --video-format F    y4m (default) or ppm, for a stream of PPM images\n"
+        "  --fps N             frame rate the Y4M stream declares (default 60)\n"
+        "  --concurrent N      frames rendered at once with --video, each with --threads\n"
+        "                      divided between them (default 2)\n"
+        "  --workers N         render in N worker processes, each with --threads threads,\n"
+        "                      handing them tiles of 4x the --tile size\n"
+        "  --coordinator PATH  socket workers connect to (default /tmp/raytrace-render-PID);\n"
+        "                      without --workers, waits for workers started by hand\n"
+        "  --worker PATH       render tiles for the coordinator at PATH until it's done\n";
+}
+
+// Renders one frame and returns the elapsed wall time in seconds, and the
+// number of primary rays traced and what they did.
+double timed_render(RenderInfo* info, int threads, int tile_size, PixelBuffer buffer, double* rays,
+                    TraceStats* stats, TileRenderer* tile_renderer = NULL) {
+    double start = wall_seconds();
+    {
+        ThreadedRenderer renderer(info, threads, tile_size, tile_renderer);
+        renderer.render(buffer);
+        *rays = renderer.primary_rays();
+        *stats = renderer.trace_stats();
+    }
+    return wall_seconds() - start;
+}
+
+// Prints how many portals rays went through before ending, and what else
+// they did.
+void print_depths(const TraceStats& stats) {
+    std::cout << "portal depth:";
+    for (size_t i = 0; i < stats.depths.size(); i++) {
+        if (stats.depths[i]) { std::cout << " " << i << ":" << stats.depths[i]; }
+    }
+    std::cout << "\n";
+    print_trace_stats(std::cout, stats);
+    std::cout << "\n";
+}
+
+// Renders frames of a camera moving steadily forward, through portals as
+// the player would, for measuring the frame pipeline.  The path can be
+// recorded, as if taken at 60 frames per second.
+class FlythroughRenderer : public FrameProducer {
+    RenderInfo info;
+    ThreadedRenderer renderer;
+    Real speed;
+    int remaining;
+    CameraPathWriter* recorder;
+public:
+    double render_seconds;
+
+    FlythroughRenderer(const RenderInfo& start, int threads, int tile_size, Real speed, int frames,
+                       CameraPathWriter* recorder = NULL)
+        : info(start), renderer(&info, threads, tile_size), speed(speed), remaining(frames),
+          recorder(recorder), render_seconds(0)
+    {
+        if (recorder) { recorder->add(0, info, false); }
+    }
+
+    bool produce(FrameSlot* frame) {
+        if (remaining == 0) { return false; }
+        remaining--;
+        double start = wall_seconds();
+        renderer.render(frame->buffer);
+        frame->seconds = wall_seconds() - start;
+        frame->width = info.width;
+        frame->height = info.height;
+        frame->bpp = info.bpp;
+        frame->region = Tile(0, 0, info.width, info.height);
+        frame->show = true;
+        render_seconds += frame->seconds;
+        bool jumped = move_camera(&info, speed * info.frame.forward);
+        if (recorder && remaining > 0) { recorder->add(1/60.0, info, jumped); }
+        return true;
+    }
+};
+
+// Renders each step of a recorded camera path, printing each frame's time
+// and what its rays did, then the time percentiles and totals.  Writes the
+// last frame to `output`.
+int replay(RenderInfo info, const char* path, int threads, int tile_size, const char* output) {
+    std::vector<CameraPose> poses;
+    std::string error;
+    if (!read_camera_path(path, info.world, &poses, &error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+    const CompiledScene* scene = CompiledScene::of(info.world);
+    PixelBuffer buffer;
+    buffer.pixels = new unsigned char [info.bpp*info.width*info.height];
+    ThreadedRenderer renderer(&info, threads, tile_size);
+    SampleWindow times(std::max(poses.size(), size_t(1)));
+    TraceStats total;
+    double total_seconds = 0;
+    for (size_t i = 0; i < poses.size(); i++) {
+        info.world = poses[i].world;
+        info.eye = poses[i].eye;
+        info.frame = poses[i].frame;
+        double start = wall_seconds();
+        renderer.render(buffer);
+        double seconds = wall_seconds() - start;
+        TraceStats stats = renderer.trace_stats();
+        times.add(seconds);
+        total.add(stats);
+        total_seconds += seconds;
+        printf("frame %d world %d%s: %.2f ms, %.3g primary rays/s, depth mean %.2f max %d, %.2f casts/ray\n",
+               int(i), scene->world_id(info.world), poses[i].jumped ? " (through portal)" : "",
+               1000 * seconds, renderer.primary_rays() / seconds, stats.mean_depth(), stats.max_depth(),
+               double(stats.casts) / std::max(stats.rays(), 1L));
+    }
+    std::cout << poses.size() << " frames in " << total_seconds << "s, ms p50/p95/p99: "
+              << 1000 * times.percentile(0.5) << "/" << 1000 * times.percentile(0.95) << "/"
+              << 1000 * times.percentile(0.99) << "\n";
+    print_trace_stats(std::cout, total);
+    std::cout << "\n";
+    bool ok = write_ppm(output, buffer, info.width, info.height, info.bpp);
+    if (!ok) { std::cerr << "Failed to write " << output << "\n"; }
+    delete[] buffer.pixels;
+    return ok ? 0 : 1;
+}
+
+// Renders a camera path (recorded, or `frames` steps forward from `info`)
+// to a video stream at `output`, "-" being standard output.
+int render_video(const RenderInfo& info, const char* path, int frames, int concurrent, int threads,
+                 int tile_size, const char* output, bool y4m, int fps) {
+    std::vector<CameraPose> poses;
+    std::string error;
+    if (path && !read_camera_path(path, info.world, &poses, &error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+    if (!path) { flythrough_path(info, Real(0.01), frames, &poses); }
+    bool to_stdout = !strcmp(output, "-");
+    FILE* file = to_stdout ? stdout : fopen(output, "wb");
+    if (!file) {
+        std::cerr << "Failed to open " << output << "\n";
+        return 1;
+    }
+    concurrent = std::max(std::min(concurrent, int(poses.size())), 1);
+    AnimationRenderer animation(info, poses, concurrent, std::max(threads / concurrent, 1), tile_size);
+    StreamSink sink(file, y4m, fps);
+    double start = wall_seconds();
+    animation.run(&sink);
+    double elapsed = wall_seconds() - start;
+    bool ok = sink.ok() && (to_stdout || fclose(file) == 0);
+    if (!ok) {
+        std::cerr << "Failed to write " << output << "\n";
+        return 1;
+    }
+    // Standard output may be the stream, so the summary goes to standard error.
+    std::cerr << poses.size() << " frames, " << concurrent << " at a time, in " << elapsed << "s: "
+              << poses.size() / elapsed << " frames/s (render " << 1000 * animation.frame_seconds() / poses.size()
+              << "ms/frame, " << animation.primary_rays() / elapsed << " primary rays/s) -> " << output << "\n";
+    print_trace_stats(std::cerr, animation.trace_stats());
+    std::cerr << "\n";
+    return 0;
+}
+
+// Loads a scene the way main does, for a worker process.
+World* load_job_scene(const char* scene, int spheres) {
+    if (*scene) { return load_scene_cached(scene); }
+    World* world = make_sphere_field_world(spheres);
+    CompiledScene::compile(world);
+    return world;
+}
+
+// Renders a frame in worker processes and writes it to `output`.  Spawns
+// `workers` local workers, if any, running this program.
+int distributed_render(RenderInfo* info, const char* program, const char* socket_path, int workers,
+                       int threads, const char* scene, int spheres, int tile_size, const char* output) {
+    std::string path = socket_path ? std::string(socket_path) : "";
+    if (!socket_path) {
+        char name[64];
+        sprintf(name, "/tmp/raytrace-render-%d", int(getpid()));
+        path = name;
+    }
+    TileCoordinator coordinator;
+    std::string error;
+    if (!coordinator.listen(path.c_str(), &error) || !coordinator.spawn_workers(program, workers, threads, &error)) {
+        std::cerr << error << "\n";
+        return 1;
+    }
+    if (workers == 0) {
+        std::cout << "waiting for workers at " << path << "\n";
+        coordinator.worker_wait = 60;
+    }
+
+    PixelBuffer buffer;
+    buffer.pixels = new unsigned char [info->bpp*info->width*info->height];
+    double start = wall_seconds();
+    bool ok = coordinator.render(info, scene ? scene : "", spheres, 4*tile_size, tile_size, buffer, &error);
+    double elapsed = wall_seconds() - start;
+    if (!ok) {
+        std::cerr << error << "\n";
+    }
+    else {
+        for (int i = 0; i < coordinator.worker_count(); i++) {
+            std::cout << "worker " << coordinator.worker_pid(i) << ": " << coordinator.worker_tiles(i) << " tiles\n";
+        }
+        double rays = coordinator.primary_rays();
+        std::cout << info->width << "x" << info->height << " in " << elapsed << "s (" << rays / elapsed
+                  << " primary rays/s) -> " << output << "\n";
+        ok = write_ppm(output, buffer, info->width, info->height, info->bpp);
+        if (!ok) { std::cerr << "Failed to write " << output << "\n"; }
+    }
+    delete[] buffer.pixels;
+    return ok ? 0 : 1;
+}
+
+bool parse_vec(const char* s, Vec* out) {
+    double x, y, z;
+    if (sscanf(s, "%lf,%lf,%lf", &x, &y, &z) != 3) { return false; }
+    *out = Vec(x, y, z);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* output = "render.ppm";
+    const char* level = "portals";
+    const char* scene = NULL;
+    int spheres = 5000;
+    Vec eye(0,0,-3);
+    Vec forward(0,0,1);
+    Vec up(0,1,0);
+    int threads = cpu_count();
+    int tile_size = 32;
+    bool compare = false;
+    bool compile = true;
+    bool use_cache = true;
+    int frames = 0;
+    int in_flight = 2;
+    int present_ms = 0;
+    bool heat = false;
+    const char* record = NULL;
+    const char* replay_path = NULL;
+    int workers = 0;
+    const char* coordinator = NULL;
+    const char* worker = NULL;
+    const char* video = NULL;
+    bool y4m = true;
+    int fps = 60;
+    int concurrent = 2;
+    HeatMetric heat_metric = HEAT_CASTS;
+
+    RenderInfo info;
+    info.width = 1280;
+    info.height = 960;
+    info.bpp = 3;
+    info.cast_limit = 32;
+    info.anti_alias = true;
+    info.packet_size = native_packet_size();
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i+1 < argc ? argv[i+1] : NULL;
+        bool ok = true;
+        if (!strcmp(arg, "--aa")) { info.anti_alias = true; continue; }
+        if (!strcmp(arg, "--no-aa")) { info.anti_alias = false; continue; }
+        if (!strcmp(arg, "--compare")) { compare = true; continue; }
+        if (!strcmp(arg, "--no-compile")) { compile = false; continue; }
+        if (!strcmp(arg, "--no-cache")) { use_cache = false; continue; }
+        if (!strcmp(arg, "--help")) { usage(); return 0; }
+        if (!value) { ok = false; }
+        else if (!strcmp(arg, "-o")) { output = value; }
+        else if (!strcmp(arg, "--level")) { level = value; ok = !strcmp(level, "portals") || !strcmp(level, "field"); }
+        else if (!strcmp(arg, "--scene")) { scene = value; }
+        else if (!strcmp(arg, "--spheres")) { spheres = atoi(value); ok = spheres > 0; }
+        else if (!strcmp(arg, "--width")) { info.width = atoi(value); ok = info.width > 0; }
+        else if (!strcmp(arg, "--height")) { info.height = atoi(value); ok = info.height > 0; }
+        else if (!strcmp(arg, "--eye")) { ok = parse_vec(value, &eye); }
+        else if (!strcmp(arg, "--forward")) { ok = parse_vec(value, &forward); }
+        else if (!strcmp(arg, "--up")) { ok = parse_vec(value, &up); }
+        else if (!strcmp(arg, "--cast-limit")) { info.cast_limit = atoi(value); ok = info.cast_limit > 0; }
+        else if (!strcmp(arg, "--threads")) { threads = atoi(value); ok = threads > 0; }
+        else if (!strcmp(arg, "--adaptive")) { info.adaptive_samples = atoi(value); ok = info.adaptive_samples > 0; }
+        else if (!strcmp(arg, "--aa-threshold")) { info.adaptive_threshold = atof(value); }
+        else if (!strcmp(arg, "--portal-cutoff")) { info.portal_cutoff = atof(value); ok = info.portal_cutoff >= 0; }
+        else if (!strcmp(arg, "--frames")) { frames = atoi(value); ok = frames > 0; }
+        else if (!strcmp(arg, "--in-flight")) { in_flight = atoi(value); ok = in_flight > 0; }
+        else if (!strcmp(arg, "--present-ms")) { present_ms = atoi(value); ok = present_ms >= 0; }
+        else if (!strcmp(arg, "--record")) { record = value; }
+        else if (!strcmp(arg, "--replay")) { replay_path = value; }
+        else if (!strcmp(arg, "--video")) { video = value; }
+        else if (!strcmp(arg, "--video-format")) { y4m = !strcmp(value, "y4m"); ok = y4m || !strcmp(value, "ppm"); }
+        else if (!strcmp(arg, "--fps")) { fps = atoi(value); ok = fps > 0; }
+        else if (!strcmp(arg, "--concurrent")) { concurrent = atoi(value); ok = concurrent > 0; }
+        else if (!strcmp(arg, "--workers")) { workers = atoi(value); ok = workers > 0; }
+        else if (!strcmp(arg, "--coordinator")) { coordinator = value; }
+        else if (!strcmp(arg, "--worker")) { worker = value; }
+        else if (!strcmp(arg, "--heat")) { ok = heat = parse_heat_metric(value, &heat_metric); }
+        else if (!strcmp(arg, "--tile")) { tile_size = atoi(value); ok = tile_size > 0; }
+        else if (!strcmp(arg, "--packet")) {
+            if (!strcmp(value, "auto")) { info.packet_size = native_packet_size(); }
+            else if (!strcmp(value, "off")) { info.packet_size = 0; }
+            else {
+                info.packet_size = atoi(value);
+                ok = info.packet_size == 4 || info.packet_size == 8 || info.packet_size == 16;
+            }
+        }
+        else { ok = false; }
+        if (!ok) {
+            std::cerr << "Bad argument: " << arg << "\n";
+            usage();
+            return 1;
+        }
+        i++;
+    }
+    if (threads < 1) { threads = 1; }
+    if (worker) {
+        return run_tile_worker(worker, threads, load_job_scene);
+    }
+    bool distributed = workers > 0 || coordinator;
+    if (video && !replay_path && frames == 0) {
+        std::cerr << "--video needs --frames or --replay\n";
+        return 1;
+    }
+    if (distributed && (!compile || heat || compare || frames > 0 || replay_path)) {
+        std::cerr << "--workers and --coordinator render single compiled frames only\n";
+        return 1;
+    }
+
+    if (!scene && strcmp(level, "field")) { scene = "levels/portals.scene"; }
+    double load_start = wall_seconds();
+    bool cached = false;
+    if (!scene) {
+        info.world = make_sphere_field_world(spheres);
+        if (compile) { CompiledScene::compile(info.world); }
+    }
+    else if (compile && use_cache) {
+        info.world = load_scene_cached(scene, &cached);
+    }
+    else {
+        info.world = load_scene(scene);
+        if (info.world && compile) { CompiledScene::compile(info.world); }
+    }
+    if (!info.world) { return 1; }
+    std::ostream& log = video && !strcmp(video, "-") ? std::cerr : std::cout;
+    log << "scene loaded in " << wall_seconds() - load_start << "s"
+        << (cached ? " (from cache)" : "") << "\n";
+    info.eye = Point(eye);
+    forward = forward.unit();
+    info.frame = Frame::from_normal_up(forward, up.flatten(forward).unit());
+
+    if (distributed) {
+        return distributed_render(&info, argv[0], coordinator, workers, threads, scene, spheres, tile_size, output);
+    }
+    if (video) {
+        return render_video(info, replay_path, frames, concurrent, threads, tile_size, video, y4m, fps);
+    }
+    if (replay_path) {
+        return replay(info, replay_path, threads, tile_size, output);
+    }
+    if (frames > 0) {
+        CameraPathWriter recorder;
+        std::string error;
+        if (record && !recorder.open(record, info.world, &error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        FlythroughRenderer flythrough(info, threads, tile_size, Real(0.01), frames, record ? &recorder : NULL);
+        HeadlessSink sink(present_ms);
+        {
+            FramePipeline pipeline(&flythrough, in_flight, info.bpp*info.width*info.height);
+            for (int i = 0; i < frames; i++) {
+                pipeline.present_next(&sink);
+            }
+        }
+        std::cout << frames << " frames, " << in_flight << " in flight: " << sink.frame_rate()
+                  << " frames/s (render " << 1000 * flythrough.render_seconds / frames << "ms/frame)\n";
+        PixelBuffer image;
+        image.pixels = (unsigned char*)sink.pixels();
+        if (!write_ppm(output, image, info.width, info.height, info.bpp)) {
+            std::cerr << "Failed to write " << output << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    PixelBuffer buffer;
+    buffer.pixels = new unsigned char [info.bpp*info.width*info.height];
+
+    double rays;
+    TraceStats stats;
+    if (heat) {
+        HeatMapRenderer heat_map(heat_metric);
+        double elapsed = timed_render(&info, threads, tile_size, buffer, &rays, &stats, &heat_map);
+        print_trace_stats(std::cout, stats);
+        std::cout << "\n";
+        if (!write_ppm(output, buffer, info.width, info.height, info.bpp)) {
+            std::cerr << "Failed to write " << output << "\n";
+            return 1;
+        }
+        std::cout << info.width << "x" << info.height << " " << heat_metric_name(heat_metric)
+                  << " heat map in " << elapsed << "s, red at " << heat_map.legend_scale() << " -> " << output << "\n";
+        delete[] buffer.pixels;
+        return 0;
+    }
+    if (compare && info.packet_size > 1) {
+        RenderInfo single = info;
+        single.packet_size = 0;
+        double elapsed = timed_render(&single, threads, tile_size, buffer, &rays, &stats);
+        std::cout << "single rays: " << rays / elapsed << " primary rays/s\n";
+    }
+
+    double elapsed = timed_render(&info, threads, tile_size, buffer, &rays, &stats);
+    print_depths(stats);
+    if (info.adaptive_samples > 0) {
+        std::cout << "adaptive: " << rays << " primary rays ("
+                  << rays / (double(info.width) * info.height) << " per pixel)\n";
+    }
+    if (info.packet_size > 1) {
+        std::cout << info.packet_size << "-ray packets (" << native_simd_name() << "): "
+                  << rays / elapsed << " primary rays/s\n";
+    }
+
+    if (!write_ppm(output, buffer, info.width, info.height, info.bpp)) {
+        std::cerr << "Failed to write " << output << "\n";
+        return 1;
+    }
+    std::cout << info.width << "x" << info.height << " in " << elapsed << "s ("
+              << rays / elapsed << " primary rays/s) -> " << output << "\n";
+
+    delete[] buffer.pixels;
+    return 0;
+}